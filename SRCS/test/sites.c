@@ -0,0 +1,43 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+/*
+ * The call sites of a program linked with libhilda.so are in the section
+ * of the program, not of the library, they must follow the rule changes.
+ */
+#include <stdio.h>
+
+#include <hilda/klog.h>
+
+static int __lines;
+
+static void logger_count(char *content, int len)
+{
+	__lines++;
+}
+
+static int hit(void)
+{
+	int lines = __lines;
+
+	kdebug("debug line\n");
+	return __lines - lines;
+}
+
+int main(int argc, char *argv[])
+{
+	int on, off, again;
+
+	klog_set_default_mask(KLOG_ALL_DFT);
+	klog_init(argc, argv);
+	klog_add_logger(logger_count);
+
+	on = hit();
+	klog_rule_add("mask=-d");
+	off = hit();
+	klog_rule_add("mask=d");
+	again = hit();
+
+	printf("sites: %d %d %d: %s\n", on, off, again,
+			on == 1 && off == 0 && again == 1 ? "ok" : "FAIL");
+	return on == 1 && off == 0 && again == 1 ? 0 : 1;
+}
@@ -3,317 +3,624 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include <hilda/ktypes.h>
 #include <hilda/md5sum.h>
 
-typedef kuchar *POINTER;
-typedef kushort UINT2;
-typedef kulong UINT4;
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-typedef struct {
-	UINT4 state[4];
-	UINT4 count[2];
-	kuchar buffer[64];
-} MD5_CTX;
+static const char __hexdig[] = "0123456789abcdef";
 
-static kvoid MD5Init(MD5_CTX *);
-static kvoid MD5Update(MD5_CTX *, const kuchar *, kuint);
-static kvoid MD5Final(kuchar[16], MD5_CTX *);
+static kinline uint32_t load32le(const unsigned char *p)
+{
+	uint32_t v;
 
-#define FMT "%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x"
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
 
-void md5_calculate(char rethash[32], const char *dat, int len)
+static kinline void store32le(unsigned char *p, uint32_t v)
 {
-	MD5_CTX context;
-	kuchar rawhash[16];
-	kuchar strhash[33];
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	v = __builtin_bswap32(v);
+#endif
+	memcpy(p, &v, sizeof(v));
+}
 
-	MD5Init(&context);
-	MD5Update(&context, (kuchar *) dat, (kuint) len);
-	MD5Final(rawhash, &context);
+static kinline void store64le(unsigned char *p, uint64_t v)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	v = __builtin_bswap64(v);
+#endif
+	memcpy(p, &v, sizeof(v));
+}
 
-	sprintf((char *)strhash, FMT,
-			rawhash[0], rawhash[1], rawhash[2], rawhash[3],
-			rawhash[4], rawhash[5], rawhash[6], rawhash[7],
-			rawhash[8], rawhash[9], rawhash[10], rawhash[11],
-			rawhash[12], rawhash[13], rawhash[14], rawhash[15]);
+/*
+ * All the 64 steps, STEP(f, a, b, c, d, word index, shift, constant).
+ * Shared by the scalar and the SIMD transform.
+ */
+#define MD5_ROUNDS(STEP, a, b, c, d) \
+	STEP(F, a, b, c, d,  0,  7, 0xd76aa478); \
+	STEP(F, d, a, b, c,  1, 12, 0xe8c7b756); \
+	STEP(F, c, d, a, b,  2, 17, 0x242070db); \
+	STEP(F, b, c, d, a,  3, 22, 0xc1bdceee); \
+	STEP(F, a, b, c, d,  4,  7, 0xf57c0faf); \
+	STEP(F, d, a, b, c,  5, 12, 0x4787c62a); \
+	STEP(F, c, d, a, b,  6, 17, 0xa8304613); \
+	STEP(F, b, c, d, a,  7, 22, 0xfd469501); \
+	STEP(F, a, b, c, d,  8,  7, 0x698098d8); \
+	STEP(F, d, a, b, c,  9, 12, 0x8b44f7af); \
+	STEP(F, c, d, a, b, 10, 17, 0xffff5bb1); \
+	STEP(F, b, c, d, a, 11, 22, 0x895cd7be); \
+	STEP(F, a, b, c, d, 12,  7, 0x6b901122); \
+	STEP(F, d, a, b, c, 13, 12, 0xfd987193); \
+	STEP(F, c, d, a, b, 14, 17, 0xa679438e); \
+	STEP(F, b, c, d, a, 15, 22, 0x49b40821); \
+	\
+	STEP(G, a, b, c, d,  1,  5, 0xf61e2562); \
+	STEP(G, d, a, b, c,  6,  9, 0xc040b340); \
+	STEP(G, c, d, a, b, 11, 14, 0x265e5a51); \
+	STEP(G, b, c, d, a,  0, 20, 0xe9b6c7aa); \
+	STEP(G, a, b, c, d,  5,  5, 0xd62f105d); \
+	STEP(G, d, a, b, c, 10,  9, 0x02441453); \
+	STEP(G, c, d, a, b, 15, 14, 0xd8a1e681); \
+	STEP(G, b, c, d, a,  4, 20, 0xe7d3fbc8); \
+	STEP(G, a, b, c, d,  9,  5, 0x21e1cde6); \
+	STEP(G, d, a, b, c, 14,  9, 0xc33707d6); \
+	STEP(G, c, d, a, b,  3, 14, 0xf4d50d87); \
+	STEP(G, b, c, d, a,  8, 20, 0x455a14ed); \
+	STEP(G, a, b, c, d, 13,  5, 0xa9e3e905); \
+	STEP(G, d, a, b, c,  2,  9, 0xfcefa3f8); \
+	STEP(G, c, d, a, b,  7, 14, 0x676f02d9); \
+	STEP(G, b, c, d, a, 12, 20, 0x8d2a4c8a); \
+	\
+	STEP(H, a, b, c, d,  5,  4, 0xfffa3942); \
+	STEP(H, d, a, b, c,  8, 11, 0x8771f681); \
+	STEP(H, c, d, a, b, 11, 16, 0x6d9d6122); \
+	STEP(H, b, c, d, a, 14, 23, 0xfde5380c); \
+	STEP(H, a, b, c, d,  1,  4, 0xa4beea44); \
+	STEP(H, d, a, b, c,  4, 11, 0x4bdecfa9); \
+	STEP(H, c, d, a, b,  7, 16, 0xf6bb4b60); \
+	STEP(H, b, c, d, a, 10, 23, 0xbebfbc70); \
+	STEP(H, a, b, c, d, 13,  4, 0x289b7ec6); \
+	STEP(H, d, a, b, c,  0, 11, 0xeaa127fa); \
+	STEP(H, c, d, a, b,  3, 16, 0xd4ef3085); \
+	STEP(H, b, c, d, a,  6, 23, 0x04881d05); \
+	STEP(H, a, b, c, d,  9,  4, 0xd9d4d039); \
+	STEP(H, d, a, b, c, 12, 11, 0xe6db99e5); \
+	STEP(H, c, d, a, b, 15, 16, 0x1fa27cf8); \
+	STEP(H, b, c, d, a,  2, 23, 0xc4ac5665); \
+	\
+	STEP(I, a, b, c, d,  0,  6, 0xf4292244); \
+	STEP(I, d, a, b, c,  7, 10, 0x432aff97); \
+	STEP(I, c, d, a, b, 14, 15, 0xab9423a7); \
+	STEP(I, b, c, d, a,  5, 21, 0xfc93a039); \
+	STEP(I, a, b, c, d, 12,  6, 0x655b59c3); \
+	STEP(I, d, a, b, c,  3, 10, 0x8f0ccc92); \
+	STEP(I, c, d, a, b, 10, 15, 0xffeff47d); \
+	STEP(I, b, c, d, a,  1, 21, 0x85845dd1); \
+	STEP(I, a, b, c, d,  8,  6, 0x6fa87e4f); \
+	STEP(I, d, a, b, c, 15, 10, 0xfe2ce6e0); \
+	STEP(I, c, d, a, b,  6, 15, 0xa3014314); \
+	STEP(I, b, c, d, a, 13, 21, 0x4e0811a1); \
+	STEP(I, a, b, c, d,  4,  6, 0xf7537e82); \
+	STEP(I, d, a, b, c, 11, 10, 0xbd3af235); \
+	STEP(I, c, d, a, b,  2, 15, 0x2ad7d2bb); \
+	STEP(I, b, c, d, a,  9, 21, 0xeb86d391)
+
+/* F and G in the form with one op less than RFC 1321 */
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define I(x, y, z) ((y) ^ ((x) | ~(z)))
 
-	memcpy(rethash, strhash, 32);
-}
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
 
-#ifdef _TEST_MD5_
-kint main(kvoid)
+#define STEP(f, a, b, c, d, i, s, ac) do { \
+	(a) += f((b), (c), (d)) + X(i) + (ac); \
+	(a) = ROTL32((a), (s)); \
+	(a) += (b); \
+} while (0)
+
+/*
+ * Transform nblk blocks, the words are loaded straight from the input,
+ * no Decode() into a copy and the state stays in registers between blocks.
+ */
+static void md5_transform(uint32_t state[4], const unsigned char *blk, size_t nblk)
 {
-	char sum[33];
-	char *string = "awertuqpoeriyhoasdghes";
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t sa, sb, sc, sd;
+
+#define X(i) load32le(blk + (i) * 4)
+	while (nblk--) {
+		sa = a;
+		sb = b;
+		sc = c;
+		sd = d;
+
+		MD5_ROUNDS(STEP, a, b, c, d);
+
+		a += sa;
+		b += sb;
+		c += sc;
+		d += sd;
+		blk += 64;
+	}
+#undef X
 
-	calculate(sum, (kuchar *) string, strlen(string));
-	sum[32] = '\0';
+	state[0] = a;
+	state[1] = b;
+	state[2] = c;
+	state[3] = d;
+}
 
-	return 0;
+void md5_init(md5_ctx_s *ctx)
+{
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->count = 0;
 }
-#endif
 
-#define S11 7
-#define S12 12
-#define S13 17
-#define S14 22
-#define S21 5
-#define S22 9
-#define S23 14
-#define S24 20
-#define S31 4
-#define S32 11
-#define S33 16
-#define S34 23
-#define S41 6
-#define S42 10
-#define S43 15
-#define S44 21
-
-static kvoid MD5Transform(UINT4[4], const kuchar[64]);
-static kvoid Encode(kuchar *, const UINT4 *, kuint);
-static kvoid Decode(UINT4 *, const kuchar *, kuint);
-
-static kuchar PADDING[64] = {
-	0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-};
+void md5_update(md5_ctx_s *ctx, const void *dat, size_t len)
+{
+	const unsigned char *p = (const unsigned char*)dat;
+	unsigned int used = (unsigned int)(ctx->count & 63), n;
+
+	ctx->count += len;
+
+	if (used) {
+		n = 64 - used;
+		if (len < n) {
+			memcpy(ctx->buf + used, p, len);
+			return;
+		}
+		memcpy(ctx->buf + used, p, n);
+		md5_transform(ctx->state, ctx->buf, 1);
+		p += n;
+		len -= n;
+	}
 
-/* F, G, H and I are basic MD5 functions.
-*/
-#define F(x, y, z) (((x) & (y)) | ((~x) & (z)))
-#define G(x, y, z) (((x) & (z)) | ((y) & (~z)))
-#define H(x, y, z) ((x) ^ (y) ^ (z))
-#define I(x, y, z) ((y) ^ ((x) | (~z)))
-
-/* ROTATE_LEFT rotates x left n bits.
-   15-April-2003 Sony: use MSVC intrinsic to save some cycles
-   */
-#ifdef _MSC_VER
-#pragma intrinsic(_rotl)
-#define ROTATE_LEFT(x, n) _rotl((x), (n))
-#else
-#define ROTATE_LEFT(x, n) (((x) << (n)) | ((x) >> (32-(n))))
-#endif
+	/* Whole blocks right from the caller's buffer */
+	if (len >= 64) {
+		md5_transform(ctx->state, p, len / 64);
+		p += len & ~(size_t)63;
+		len &= 63;
+	}
 
-/* FF, GG, HH, and II transformations for rounds 1, 2, 3, and 4.
-   Rotation is separate from addition to prevent recomputation.
-   */
-#define FF(a, b, c, d, x, s, ac) { \
-	(a) += F ((b), (c), (d)) + (x) + (UINT4)(ac); \
-	(a) = ROTATE_LEFT ((a), (s)); \
-	(a) += (b); \
-}
-#define GG(a, b, c, d, x, s, ac) { \
-	(a) += G ((b), (c), (d)) + (x) + (UINT4)(ac); \
-	(a) = ROTATE_LEFT ((a), (s)); \
-	(a) += (b); \
-}
-#define HH(a, b, c, d, x, s, ac) { \
-	(a) += H ((b), (c), (d)) + (x) + (UINT4)(ac); \
-	(a) = ROTATE_LEFT ((a), (s)); \
-	(a) += (b); \
-}
-#define II(a, b, c, d, x, s, ac) { \
-	(a) += I ((b), (c), (d)) + (x) + (UINT4)(ac); \
-	(a) = ROTATE_LEFT ((a), (s)); \
-	(a) += (b); \
+	if (len)
+		memcpy(ctx->buf, p, len);
 }
 
-/* MD5 initialization. Begins an MD5 operation, writing a new context.
-*/
-static kvoid MD5Init(MD5_CTX *context)
+void md5_final(md5_ctx_s *ctx, unsigned char digest[16])
 {
-	context->count[0] = context->count[1] = 0;
-	/* Load magic initialization constants.
-	*/
-	context->state[0] = 0x67452301;
-	context->state[1] = 0xefcdab89;
-	context->state[2] = 0x98badcfe;
-	context->state[3] = 0x10325476;
+	unsigned int used = (unsigned int)(ctx->count & 63);
+	int i;
+
+	ctx->buf[used++] = 0x80;
+	if (used > 56) {
+		memset(ctx->buf + used, 0, 64 - used);
+		md5_transform(ctx->state, ctx->buf, 1);
+		used = 0;
+	}
+	memset(ctx->buf + used, 0, 56 - used);
+	store64le(ctx->buf + 56, ctx->count << 3);
+	md5_transform(ctx->state, ctx->buf, 1);
+
+	for (i = 0; i < 4; i++)
+		store32le(digest + i * 4, ctx->state[i]);
+
+	memset(ctx, 0, sizeof(*ctx));
 }
 
-/* MD5 block update operation. Continues an MD5 message-digest
-   operation, processing another message block, and updating the
-   context.
-   */
-static kvoid MD5Update(MD5_CTX *context, const kuchar *input, kuint inputLen)
+void md5_hex(char rethash[32], const unsigned char digest[16])
 {
-	kuint i, index, partLen;
-
-	/* Compute number of bytes mod 64 */
-	index = (kuint) ((context->count[0] >> 3) & 0x3f);
-
-	/* Update number of bits */
-	if ((context->count[0] += ((UINT4) inputLen << 3))
-			< ((UINT4) inputLen << 3))
-		context->count[1]++;
-	context->count[1] += ((UINT4) inputLen >> 29);
-
-	partLen = 64 - index;
-
-	/* Transform as many times as possible.  */
-	if (inputLen >= partLen) {
-		memcpy((POINTER)&context->buffer[index],
-				(POINTER)input, partLen);
-		MD5Transform(context->state, context->buffer);
-
-		for (i = partLen; i + 63 < inputLen; i += 64)
-			MD5Transform(context->state, &input[i]);
-		index = 0;
-	} else
-		i = 0;
-
-	/* Buffer remaining input */
-	memcpy((POINTER)&context->buffer[index],
-			(POINTER)&input[i], inputLen - i);
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		rethash[i * 2] = __hexdig[digest[i] >> 4];
+		rethash[i * 2 + 1] = __hexdig[digest[i] & 0xf];
+	}
 }
 
-/* MD5 finalization. Ends an MD5 message-digest operation, writing the
-   the message digest and zeroizing the context.
-   */
-static kvoid MD5Final(kuchar digest[16], MD5_CTX *context)
+void md5_calculate(char rethash[32], const char *dat, int len)
 {
-	kuchar bits[8];
-	kuint index, padLen;
-
-	/* Save number of bits */
-	Encode(bits, context->count, 8);
-
-	/* Pad out to 56 mod 64.
-	*/
-	index = (kuint) ((context->count[0] >> 3) & 0x3f);
-	padLen = (index < 56) ? (56 - index) : (120 - index);
-	MD5Update(context, PADDING, (kuint) padLen);
-
-	/* Append length (before padding) */
-	MD5Update(context, bits, 8);
-	/* Store state in digest */
-	Encode(digest, context->state, 16);
-
-	/* Zeroize sensitive information.
-	*/
-	memset((POINTER) context, 0, sizeof(*context));
+	md5_ctx_s ctx;
+	unsigned char digest[16];
+
+	md5_init(&ctx);
+	md5_update(&ctx, dat, len);
+	md5_final(&ctx, digest);
+	md5_hex(rethash, digest);
 }
 
-/* MD5 basic transformation. Transforms state based on block.
-*/
-static kvoid MD5Transform(UINT4 state[4], const kuchar block[64])
+/*
+ * The old code kept the words in unsigned long, on LP64 the bits rotated
+ * out of 32 are kept and come back in later steps. Same steps on a wide
+ * state give the same wrong result.
+ */
+static void md5_transform_legacy(unsigned long state[4], const unsigned char *blk)
 {
-	UINT4 a = state[0], b = state[1], c = state[2], d = state[3], x[16];
-
-	Decode(x, block, 64);
-
-	/* Round 1 */
-	FF(a, b, c, d, x[0], S11, 0xd76aa478);	/* 1 */
-	FF(d, a, b, c, x[1], S12, 0xe8c7b756);	/* 2 */
-	FF(c, d, a, b, x[2], S13, 0x242070db);	/* 3 */
-	FF(b, c, d, a, x[3], S14, 0xc1bdceee);	/* 4 */
-	FF(a, b, c, d, x[4], S11, 0xf57c0faf);	/* 5 */
-	FF(d, a, b, c, x[5], S12, 0x4787c62a);	/* 6 */
-	FF(c, d, a, b, x[6], S13, 0xa8304613);	/* 7 */
-	FF(b, c, d, a, x[7], S14, 0xfd469501);	/* 8 */
-	FF(a, b, c, d, x[8], S11, 0x698098d8);	/* 9 */
-	FF(d, a, b, c, x[9], S12, 0x8b44f7af);	/* 10 */
-	FF(c, d, a, b, x[10], S13, 0xffff5bb1);	/* 11 */
-	FF(b, c, d, a, x[11], S14, 0x895cd7be);	/* 12 */
-	FF(a, b, c, d, x[12], S11, 0x6b901122);	/* 13 */
-	FF(d, a, b, c, x[13], S12, 0xfd987193);	/* 14 */
-	FF(c, d, a, b, x[14], S13, 0xa679438e);	/* 15 */
-	FF(b, c, d, a, x[15], S14, 0x49b40821);	/* 16 */
-
-	/* Round 2 */
-	GG(a, b, c, d, x[1], S21, 0xf61e2562);	/* 17 */
-	GG(d, a, b, c, x[6], S22, 0xc040b340);	/* 18 */
-	GG(c, d, a, b, x[11], S23, 0x265e5a51);	/* 19 */
-	GG(b, c, d, a, x[0], S24, 0xe9b6c7aa);	/* 20 */
-	GG(a, b, c, d, x[5], S21, 0xd62f105d);	/* 21 */
-	GG(d, a, b, c, x[10], S22, 0x2441453);	/* 22 */
-	GG(c, d, a, b, x[15], S23, 0xd8a1e681);	/* 23 */
-	GG(b, c, d, a, x[4], S24, 0xe7d3fbc8);	/* 24 */
-	GG(a, b, c, d, x[9], S21, 0x21e1cde6);	/* 25 */
-	GG(d, a, b, c, x[14], S22, 0xc33707d6);	/* 26 */
-	GG(c, d, a, b, x[3], S23, 0xf4d50d87);	/* 27 */
-	GG(b, c, d, a, x[8], S24, 0x455a14ed);	/* 28 */
-	GG(a, b, c, d, x[13], S21, 0xa9e3e905);	/* 29 */
-	GG(d, a, b, c, x[2], S22, 0xfcefa3f8);	/* 30 */
-	GG(c, d, a, b, x[7], S23, 0x676f02d9);	/* 31 */
-	GG(b, c, d, a, x[12], S24, 0x8d2a4c8a);	/* 32 */
-
-	/* Round 3 */
-	HH(a, b, c, d, x[5], S31, 0xfffa3942);	/* 33 */
-	HH(d, a, b, c, x[8], S32, 0x8771f681);	/* 34 */
-	HH(c, d, a, b, x[11], S33, 0x6d9d6122);	/* 35 */
-	HH(b, c, d, a, x[14], S34, 0xfde5380c);	/* 36 */
-	HH(a, b, c, d, x[1], S31, 0xa4beea44);	/* 37 */
-	HH(d, a, b, c, x[4], S32, 0x4bdecfa9);	/* 38 */
-	HH(c, d, a, b, x[7], S33, 0xf6bb4b60);	/* 39 */
-	HH(b, c, d, a, x[10], S34, 0xbebfbc70);	/* 40 */
-	HH(a, b, c, d, x[13], S31, 0x289b7ec6);	/* 41 */
-	HH(d, a, b, c, x[0], S32, 0xeaa127fa);	/* 42 */
-	HH(c, d, a, b, x[3], S33, 0xd4ef3085);	/* 43 */
-	HH(b, c, d, a, x[6], S34, 0x4881d05);	/* 44 */
-	HH(a, b, c, d, x[9], S31, 0xd9d4d039);	/* 45 */
-	HH(d, a, b, c, x[12], S32, 0xe6db99e5);	/* 46 */
-	HH(c, d, a, b, x[15], S33, 0x1fa27cf8);	/* 47 */
-	HH(b, c, d, a, x[2], S34, 0xc4ac5665);	/* 48 */
-
-	/* Round 4 */
-	II(a, b, c, d, x[0], S41, 0xf4292244);	/* 49 */
-	II(d, a, b, c, x[7], S42, 0x432aff97);	/* 50 */
-	II(c, d, a, b, x[14], S43, 0xab9423a7);	/* 51 */
-	II(b, c, d, a, x[5], S44, 0xfc93a039);	/* 52 */
-	II(a, b, c, d, x[12], S41, 0x655b59c3);	/* 53 */
-	II(d, a, b, c, x[3], S42, 0x8f0ccc92);	/* 54 */
-	II(c, d, a, b, x[10], S43, 0xffeff47d);	/* 55 */
-	II(b, c, d, a, x[1], S44, 0x85845dd1);	/* 56 */
-	II(a, b, c, d, x[8], S41, 0x6fa87e4f);	/* 57 */
-	II(d, a, b, c, x[15], S42, 0xfe2ce6e0);	/* 58 */
-	II(c, d, a, b, x[6], S43, 0xa3014314);	/* 59 */
-	II(b, c, d, a, x[13], S44, 0x4e0811a1);	/* 60 */
-	II(a, b, c, d, x[4], S41, 0xf7537e82);	/* 61 */
-	II(d, a, b, c, x[11], S42, 0xbd3af235);	/* 62 */
-	II(c, d, a, b, x[2], S43, 0x2ad7d2bb);	/* 63 */
-	II(b, c, d, a, x[9], S44, 0xeb86d391);	/* 64 */
+	unsigned long a = state[0], b = state[1], c = state[2], d = state[3];
+
+#define X(i) ((unsigned long)load32le(blk + (i) * 4))
+	MD5_ROUNDS(STEP, a, b, c, d);
+#undef X
 
 	state[0] += a;
 	state[1] += b;
 	state[2] += c;
 	state[3] += d;
+}
 
-	/* Zeroize sensitive information.
-	*/
-	memset((POINTER) x, 0, sizeof(x));
+void md5_calculate_legacy(char rethash[32], const char *dat, int len)
+{
+	unsigned long state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	const unsigned char *p = (const unsigned char*)dat;
+	unsigned char tail[128], digest[16];
+	int i, rest, tlen;
+
+	for (i = 0; i + 64 <= len; i += 64)
+		md5_transform_legacy(state, p + i);
+
+	rest = len - i;
+	tlen = (rest < 56) ? 64 : 128;
+	memcpy(tail, p + i, rest);
+	tail[rest] = 0x80;
+	memset(tail + rest + 1, 0, tlen - rest - 1 - 8);
+	store64le(tail + tlen - 8, (uint64_t)len << 3);
+
+	md5_transform_legacy(state, tail);
+	if (tlen == 128)
+		md5_transform_legacy(state, tail + 64);
+
+	for (i = 0; i < 4; i++)
+		store32le(digest + i * 4, (uint32_t)state[i]);
+	md5_hex(rethash, digest);
 }
 
-/* Encodes input (UINT4) into output (kuchar). Assumes len is
-   a multiple of 4.
-   */
-static kvoid Encode(kuchar *output, const UINT4 *input, kuint len)
+/*-----------------------------------------------------------------------
+ * Multi buffer, lane l of the vectors runs the message in lane l. Each
+ * lane walks the whole blocks of its message then one or two padded tail
+ * blocks, a lane done takes the next message.
+ */
+typedef void (*md5_mb_fn)(uint32_t st[4][MD5_MB_LANES],
+		const unsigned char *blk[MD5_MB_LANES]);
+
+typedef struct _md5_mb_impl_s md5_mb_impl_s;
+struct _md5_mb_impl_s {
+	md5_mb_fn fn;
+	int lanes;
+};
+
+typedef struct _mb_lane_s mb_lane_s;
+struct _mb_lane_s {
+	int idx;                        /** message index, -1 for idle */
+	const unsigned char *p;
+	size_t nblk;                    /** whole blocks left in p */
+	int ntail;                      /** tail blocks left */
+	int tofs;
+	unsigned char tail[128];
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Needs V_ADD etc. for the ISA defined before expanded */
+#define VF(x, y, z) V_XOR((z), V_AND((x), V_XOR((y), (z))))
+#define VG(x, y, z) V_XOR((y), V_AND((z), V_XOR((x), (y))))
+#define VH(x, y, z) V_XOR(V_XOR((x), (y)), (z))
+#define VI(x, y, z) V_XOR((y), V_OR((x), V_XOR((z), ones)))
+
+#define VSTEP(f, a, b, c, d, i, s, ac) do { \
+	(a) = V_ADD((a), V_ADD(V_ADD(V##f((b), (c), (d)), w[i]), V_SET1((int)(ac)))); \
+	(a) = V_OR(V_SLLI((a), (s)), V_SRLI((a), 32 - (s))); \
+	(a) = V_ADD((a), (b)); \
+} while (0)
+
+#define MD5_MB_SIMD(name, isa, vec, lanes) \
+__attribute__((target(isa))) \
+static void name(uint32_t st[4][MD5_MB_LANES], const unsigned char *blk[MD5_MB_LANES]) \
+{ \
+	uint32_t tw[16][lanes] __attribute__((aligned(32))); \
+	const vec ones = V_SET1(-1); \
+	vec a, b, c, d, w[16]; \
+	int i, l; \
+	\
+	for (l = 0; l < lanes; l++) \
+		for (i = 0; i < 16; i++) \
+			tw[i][l] = load32le(blk[l] + i * 4); \
+	for (i = 0; i < 16; i++) \
+		w[i] = V_LOAD((const vec*)tw[i]); \
+	\
+	a = V_LOAD((const vec*)st[0]); \
+	b = V_LOAD((const vec*)st[1]); \
+	c = V_LOAD((const vec*)st[2]); \
+	d = V_LOAD((const vec*)st[3]); \
+	\
+	MD5_ROUNDS(VSTEP, a, b, c, d); \
+	\
+	V_STORE((vec*)st[0], V_ADD(a, V_LOAD((const vec*)st[0]))); \
+	V_STORE((vec*)st[1], V_ADD(b, V_LOAD((const vec*)st[1]))); \
+	V_STORE((vec*)st[2], V_ADD(c, V_LOAD((const vec*)st[2]))); \
+	V_STORE((vec*)st[3], V_ADD(d, V_LOAD((const vec*)st[3]))); \
+}
+
+#define V_ADD _mm_add_epi32
+#define V_AND _mm_and_si128
+#define V_OR _mm_or_si128
+#define V_XOR _mm_xor_si128
+#define V_SLLI _mm_slli_epi32
+#define V_SRLI _mm_srli_epi32
+#define V_SET1 _mm_set1_epi32
+#define V_LOAD _mm_loadu_si128
+#define V_STORE _mm_storeu_si128
+MD5_MB_SIMD(md5_mb_sse2, "sse2", __m128i, 4)
+#undef V_ADD
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_SLLI
+#undef V_SRLI
+#undef V_SET1
+#undef V_LOAD
+#undef V_STORE
+
+#define V_ADD _mm256_add_epi32
+#define V_AND _mm256_and_si256
+#define V_OR _mm256_or_si256
+#define V_XOR _mm256_xor_si256
+#define V_SLLI _mm256_slli_epi32
+#define V_SRLI _mm256_srli_epi32
+#define V_SET1 _mm256_set1_epi32
+#define V_LOAD _mm256_loadu_si256
+#define V_STORE _mm256_storeu_si256
+MD5_MB_SIMD(md5_mb_avx2, "avx2", __m256i, 8)
+#undef V_ADD
+#undef V_AND
+#undef V_OR
+#undef V_XOR
+#undef V_SLLI
+#undef V_SRLI
+#undef V_SET1
+#undef V_LOAD
+#undef V_STORE
+#endif
+
+static const md5_mb_impl_s *md5_mb_init(void);
+static const md5_mb_impl_s *__md5_mb;
+
+static const md5_mb_impl_s *md5_mb_init(void)
 {
-	kuint i, j;
+	static const md5_mb_impl_s none = { NULL, 1 };
+	const md5_mb_impl_s *impl = &none;
+
+#if defined(__x86_64__) || defined(__i386__)
+	static const md5_mb_impl_s sse2 = { md5_mb_sse2, 4 };
+	static const md5_mb_impl_s avx2 = { md5_mb_avx2, 8 };
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		impl = &avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		impl = &sse2;
+#endif
 
-	for (i = 0, j = 0; j < len; i++, j += 4) {
-		output[j] = (kuchar) (input[i] & 0xff);
-		output[j + 1] = (kuchar) ((input[i] >> 8) & 0xff);
-		output[j + 2] = (kuchar) ((input[i] >> 16) & 0xff);
-		output[j + 3] = (kuchar) ((input[i] >> 24) & 0xff);
+	__atomic_store_n(&__md5_mb, impl, __ATOMIC_RELAXED);
+	return impl;
+}
+
+static void lane_load(mb_lane_s *lane, uint32_t st[4][MD5_MB_LANES], int l,
+		int idx, const void *dat, size_t len)
+{
+	size_t rest;
+
+	lane->idx = idx;
+	if (idx < 0)
+		return;
+
+	lane->p = (const unsigned char*)dat;
+	lane->nblk = len / 64;
+	lane->tofs = 0;
+
+	rest = len & 63;
+	lane->ntail = (rest < 56) ? 1 : 2;
+	memcpy(lane->tail, lane->p + len - rest, rest);
+	lane->tail[rest] = 0x80;
+	memset(lane->tail + rest + 1, 0, lane->ntail * 64 - rest - 1 - 8);
+	store64le(lane->tail + lane->ntail * 64 - 8, (uint64_t)len << 3);
+
+	st[0][l] = 0x67452301;
+	st[1][l] = 0xefcdab89;
+	st[2][l] = 0x98badcfe;
+	st[3][l] = 0x10325476;
+}
+
+/* Next block of lane, NULL if all done */
+static kinline const unsigned char *lane_block(mb_lane_s *lane)
+{
+	const unsigned char *blk;
+
+	if (lane->nblk) {
+		blk = lane->p;
+		lane->p += 64;
+		lane->nblk--;
+		return blk;
+	}
+	if (lane->ntail) {
+		blk = lane->tail + lane->tofs;
+		lane->tofs += 64;
+		lane->ntail--;
+		return blk;
 	}
+	return NULL;
 }
 
-/* Decodes input (kuchar) into output (UINT4). Assumes len is
-   a multiple of 4.
-   */
-static kvoid Decode(UINT4 *output, const kuchar *input, kuint len)
+static void lane_digest(uint32_t st[4][MD5_MB_LANES], int l, unsigned char digest[16])
 {
-	kuint i, j;
+	int i;
 
-	for (i = 0, j = 0; j < len; i++, j += 4)
-		output[i] = ((UINT4) input[j]) | (((UINT4) input[j + 1]) << 8) |
-			(((UINT4) input[j + 2]) << 16) |
-			(((UINT4) input[j + 3]) << 24);
+	for (i = 0; i < 4; i++)
+		store32le(digest + i * 4, st[i][l]);
 }
 
+void md5_mb(const void *dat[], const size_t len[], unsigned char digest[][16], int cnt)
+{
+	static const unsigned char zero[64];
+	const md5_mb_impl_s *impl = __atomic_load_n(&__md5_mb, __ATOMIC_RELAXED);
+	uint32_t st[4][MD5_MB_LANES] __attribute__((aligned(32)));
+	const unsigned char *blk[MD5_MB_LANES];
+	mb_lane_s lane[MD5_MB_LANES];
+	uint32_t one[4];
+	md5_ctx_s ctx;
+	int i, l, last = 0, next = 0, active;
+
+	if (!impl)
+		impl = md5_mb_init();
+
+	if (!impl->fn || cnt < 2) {
+		for (i = 0; i < cnt; i++) {
+			md5_init(&ctx);
+			md5_update(&ctx, dat[i], len[i]);
+			md5_final(&ctx, digest[i]);
+		}
+		return;
+	}
+
+	for (l = 0; l < impl->lanes; l++) {
+		if (next < cnt) {
+			lane_load(&lane[l], st, l, next, dat[next], len[next]);
+			next++;
+		} else
+			lane_load(&lane[l], st, l, -1, NULL, 0);
+	}
+
+	for (;;) {
+		active = 0;
+		for (l = 0; l < impl->lanes; l++) {
+			blk[l] = zero;
+			if (lane[l].idx < 0)
+				continue;
+			blk[l] = lane_block(&lane[l]);
+			last = l;
+			active++;
+		}
+		if (!active)
+			break;
+
+		/* Only one left, e.g. one long message, no use to run SIMD */
+		if (active == 1 && next >= cnt) {
+			l = last;
+			for (i = 0; i < 4; i++)
+				one[i] = st[i][l];
+			do
+				md5_transform(one, blk[l], 1);
+			while ((blk[l] = lane_block(&lane[l])));
+			for (i = 0; i < 4; i++)
+				st[i][l] = one[i];
+			lane_digest(st, l, digest[lane[l].idx]);
+			break;
+		}
+
+		impl->fn(st, blk);
+
+		for (l = 0; l < impl->lanes; l++) {
+			if (lane[l].idx < 0 || lane[l].nblk || lane[l].ntail)
+				continue;
+
+			lane_digest(st, l, digest[lane[l].idx]);
+			if (next < cnt) {
+				lane_load(&lane[l], st, l, next, dat[next], len[next]);
+				next++;
+			} else
+				lane[l].idx = -1;
+		}
+	}
+}
+
+#ifdef _TEST_MD5_
+#include <time.h>
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *vec[][2] = {
+		{ "", "d41d8cd98f00b204e9800998ecf8427e" },
+		{ "a", "0cc175b9c0f1b6a831c399e269772661" },
+		{ "abc", "900150983cd24fb0d6963f7d28e17f72" },
+		{ "message digest", "f96b697d7cb7938d525a2f31aaf161d0" },
+		{ "abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b" },
+		{ "12345678901234567890123456789012345678901234567890123456789012345678901234567890",
+			"57edf4a22be3c955ac49da2e2107b67a" },
+	};
+	const int nmsg = 64, msize = 4096, loop = 200;
+	const void *dat[64];
+	size_t len[64];
+	unsigned char (*mb)[16], one[16];
+	char hash[33], *buf;
+	md5_ctx_s ctx;
+	double t0, t1, t2;
+	int i, j, bad = 0;
+
+	hash[32] = '\0';
+	for (i = 0; i < sizeof(vec) / sizeof(vec[0]); i++) {
+		md5_calculate(hash, vec[i][0], strlen(vec[i][0]));
+		if (strcmp(hash, vec[i][1]))
+			printf("BAD: \"%s\" %s != %s\n", vec[i][0], hash, vec[i][1]), bad++;
+	}
+
+	buf = (char*)malloc(nmsg * msize);
+	mb = (unsigned char (*)[16])malloc(nmsg * 16);
+	for (i = 0; i < nmsg * msize; i++)
+		buf[i] = (char)rand();
+	for (i = 0; i < nmsg; i++) {
+		dat[i] = buf + i * msize;
+		len[i] = msize - (i * 37) % 200;
+	}
+
+	md5_mb(dat, len, mb, nmsg);
+	for (i = 0; i < nmsg; i++) {
+		md5_init(&ctx);
+		md5_update(&ctx, dat[i], len[i]);
+		md5_final(&ctx, one);
+		if (memcmp(one, mb[i], 16))
+			printf("BAD: mb lane of message %d\n", i), bad++;
+	}
+
+	t0 = now();
+	for (j = 0; j < loop; j++)
+		for (i = 0; i < nmsg; i++)
+			md5_calculate_legacy(hash, (const char*)dat[i], len[i]);
+	t1 = now();
+	for (j = 0; j < loop; j++)
+		for (i = 0; i < nmsg; i++) {
+			md5_init(&ctx);
+			md5_update(&ctx, dat[i], len[i]);
+			md5_final(&ctx, one);
+		}
+	t2 = now();
+	printf("legacy: %.3fs, md5: %.3fs, ", t1 - t0, t2 - t1);
+
+	t0 = now();
+	for (j = 0; j < loop; j++)
+		md5_mb(dat, len, mb, nmsg);
+	t1 = now();
+	printf("mb: %.3fs\n", t1 - t0);
+
+	free(buf);
+	free(mb);
+	return bad ? 1 : 0;
+}
+#endif
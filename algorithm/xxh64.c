@@ -0,0 +1,159 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+#include <string.h>
+#include <stdint.h>
+
+#include <hilda/xxh64.h>
+
+#define P64_1 0x9E3779B185EBCA87ULL
+#define P64_2 0xC2B2AE3D27D4EB4FULL
+#define P64_3 0x165667B19E3779F9ULL
+#define P64_4 0x85EBCA77C2B2AE63ULL
+#define P64_5 0x27D4EB2F165667C5ULL
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static kinline uint64_t read64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static kinline uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static kinline uint64_t xround(uint64_t acc, uint64_t input)
+{
+	acc += input * P64_2;
+	acc = ROTL64(acc, 31);
+	return acc * P64_1;
+}
+
+static kinline uint64_t xmerge(uint64_t acc, uint64_t val)
+{
+	acc ^= xround(0, val);
+	return acc * P64_1 + P64_4;
+}
+
+/* All the 32 byte stripes in p, return bytes consumed */
+static size_t stripes(unsigned long long v[4], const unsigned char *p, size_t len)
+{
+	uint64_t v1 = v[0], v2 = v[1], v3 = v[2], v4 = v[3];
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v1 = xround(v1, read64(p + i));
+		v2 = xround(v2, read64(p + i + 8));
+		v3 = xround(v3, read64(p + i + 16));
+		v4 = xround(v4, read64(p + i + 24));
+	}
+
+	v[0] = v1;
+	v[1] = v2;
+	v[2] = v3;
+	v[3] = v4;
+	return i;
+}
+
+void xxh64_init(xxh64_s *st, unsigned long long seed)
+{
+	memset(st, 0, sizeof(*st));
+	st->seed = seed;
+	st->v[0] = seed + P64_1 + P64_2;
+	st->v[1] = seed + P64_2;
+	st->v[2] = seed;
+	st->v[3] = seed - P64_1;
+}
+
+void xxh64_update(xxh64_s *st, const void *dat, size_t len)
+{
+	const unsigned char *p = (const unsigned char*)dat;
+	size_t n;
+
+	st->total += len;
+
+	if (st->memsize) {
+		n = 32 - st->memsize;
+		if (n > len)
+			n = len;
+		memcpy(st->mem + st->memsize, p, n);
+		st->memsize += n;
+		p += n;
+		len -= n;
+
+		if (st->memsize < 32)
+			return;
+		stripes(st->v, st->mem, 32);
+		st->memsize = 0;
+	}
+
+	n = stripes(st->v, p, len);
+	p += n;
+	len -= n;
+
+	if (len) {
+		memcpy(st->mem, p, len);
+		st->memsize = len;
+	}
+}
+
+unsigned long long xxh64_digest(const xxh64_s *st)
+{
+	const unsigned char *p = st->mem, *end = st->mem + st->memsize;
+	uint64_t h;
+
+	if (st->total >= 32) {
+		h = ROTL64((uint64_t)st->v[0], 1) + ROTL64((uint64_t)st->v[1], 7) +
+			ROTL64((uint64_t)st->v[2], 12) + ROTL64((uint64_t)st->v[3], 18);
+		h = xmerge(h, st->v[0]);
+		h = xmerge(h, st->v[1]);
+		h = xmerge(h, st->v[2]);
+		h = xmerge(h, st->v[3]);
+	} else
+		h = st->seed + P64_5;
+
+	h += st->total;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= xround(0, read64(p));
+		h = ROTL64(h, 27) * P64_1 + P64_4;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t)read32(p) * P64_1;
+		h = ROTL64(h, 23) * P64_2 + P64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= (*p) * P64_5;
+		h = ROTL64(h, 11) * P64_1;
+	}
+
+	h ^= h >> 33;
+	h *= P64_2;
+	h ^= h >> 29;
+	h *= P64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+unsigned long long xxh64(const void *dat, size_t len, unsigned long long seed)
+{
+	xxh64_s st;
+
+	xxh64_init(&st, seed);
+	xxh64_update(&st, dat, len);
+	return xxh64_digest(&st);
+}
@@ -7,6 +7,12 @@
  */
 
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
 
 #include <hilda/ktypes.h>
 #include <hilda/md5sum.h>
@@ -16,6 +22,7 @@
 #include <hilda/ftfs.h>
 
 static char MAGIC[4] = { 'F', 'T', 'F', 'S' };
+static char MAGIC2[4] = { 'F', 'T', 'F', '2' };
 
 typedef struct _ftfs_s ftfs_s;
 struct _ftfs_s {
@@ -25,6 +32,135 @@ struct _ftfs_s {
 	char data[0];                   /** Some compiler dont know data[0] */
 };
 
+/*
+ * Version 2, for big images. The payload is cut to chunks, each chunk has
+ * its own digest, so one chunk can be checked and read alone.
+ *
+ *   ftfs2_hdr_s | nchunk raw md5 digest of 16 bytes | payload
+ */
+typedef struct _ftfs2_hdr_s ftfs2_hdr_s;
+struct _ftfs2_hdr_s {
+	char magic[4];                  /** 'F' 'T' 'F' '2' */
+	char md5sum[32];                /** check sum of fields below and chunk digests */
+	unsigned int chunk_size;
+	unsigned int nchunk;
+	unsigned int resv;
+	unsigned long long len;         /** payload length */
+};
+
+/* Payload read by so many bytes once when verify from fd */
+#define FTFS_READ_SIZE          (64 * 1024)
+
+/* Max bytes of chunks read once for ftfs2_check() */
+#define FTFS2_BATCH_SIZE        (1024 * 1024)
+
+static int writev_all(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t n;
+
+	while (cnt) {
+		n = writev(fd, iov, cnt);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+
+		while (cnt && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	char *p = (char*)buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* pread does not move the file offset, threads can share the fd */
+static int pread_full(int fd, void *buf, size_t len, off_t ofs)
+{
+	char *p = (char*)buf;
+	ssize_t n;
+
+	while (len) {
+		n = pread(fd, p, len, ofs);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		ofs += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* The payload need not follow the header, no copy to hash them in one */
+static void hdr_sum(char sum[32], const int *lenp, const char *dat, int len)
+{
+	md5_ctx_s ctx;
+	unsigned char digest[16];
+
+	md5_init(&ctx);
+	md5_update(&ctx, lenp, sizeof(*lenp));
+	md5_update(&ctx, dat, len);
+	md5_final(&ctx, digest);
+	md5_hex(sum, digest);
+}
+
+static void hdr_fill(ftfs_s *fs, const char *dat, int len)
+{
+	memcpy(fs->magic, MAGIC, sizeof(MAGIC));
+	fs->len = len;
+	hdr_sum(fs->md5sum, &fs->len, dat, len);
+}
+
+/* Packed by 64 bit build before md5sum fixed, see md5_calculate_legacy() */
+static int legacy_match(const ftfs_s *fs, const char *dat)
+{
+	char hash[32], *buf;
+	int ret;
+
+	if (sizeof(long) <= 4)
+		return 0;
+
+	if (dat == fs->data) {
+		md5_calculate_legacy(hash, (const char*)&fs->len, sizeof(fs->len) + fs->len);
+		return !memcmp(hash, fs->md5sum, 32);
+	}
+
+	buf = (char*)kmem_alloc(sizeof(fs->len) + fs->len, char);
+	memcpy(buf, &fs->len, sizeof(fs->len));
+	memcpy(buf + sizeof(fs->len), dat, fs->len);
+	md5_calculate_legacy(hash, buf, sizeof(fs->len) + fs->len);
+	ret = !memcmp(hash, fs->md5sum, 32);
+	kmem_free(buf);
+
+	return ret;
+}
+
 /**
  * \brief Pack the raw data bo FTFS format.
  * Giving data, wrap the data with FTFS header. Caller should
@@ -39,24 +175,41 @@ struct _ftfs_s {
 void *ftfs_pack(const char *dat, int len, int *packlen)
 {
 	int packsize = sizeof(ftfs_s) + len;
-	ftfs_s *fs = (ftfs_s*)kmem_alloz(packsize, char);
-
-	fs->magic[0] = MAGIC[0];
-	fs->magic[1] = MAGIC[1];
-	fs->magic[2] = MAGIC[2];
-	fs->magic[3] = MAGIC[3];
+	ftfs_s *fs = (ftfs_s*)kmem_alloc(packsize, char);
 
-	fs->len = len;
+	hdr_fill(fs, dat, len);
 	memcpy(fs->data, dat, len);
 
-	md5_calculate(fs->md5sum, (char*)&fs->len, sizeof(fs->len) + len);
-
 	if (packlen)
 		*packlen = packsize;
 
 	return (void*)fs;
 }
 
+/* Header to hdr, then hdr and dat as is to iov[0] and iov[1] */
+void ftfs_pack_iov(char hdr[FTFS_HDR_LEN], const char *dat, int len, struct iovec iov[2])
+{
+	ftfs_s fs;
+
+	hdr_fill(&fs, dat, len);
+	memcpy(hdr, &fs, sizeof(fs));
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(fs);
+	iov[1].iov_base = (void*)dat;
+	iov[1].iov_len = len;
+}
+
+/* Same bytes as write ftfs_pack() result, no copy of payload */
+int ftfs_write(int fd, const char *dat, int len)
+{
+	char hdr[FTFS_HDR_LEN];
+	struct iovec iov[2];
+
+	ftfs_pack_iov(hdr, dat, len, iov);
+	return writev_all(fd, iov, 2);
+}
+
 /**
  * \brief Peek the raw data form ftfs_s struct.
  *
@@ -82,8 +235,8 @@ int ftfs_unpack(void *pack, char **md5sum, char **dat, int *len)
 		return -1;
 	}
 
-	md5_calculate(newhash, (char*)&fs->len, sizeof(fs->len) + fs->len);
-	if (memcmp(newhash, fs->md5sum, 32)) {
+	hdr_sum(newhash, &fs->len, fs->data, fs->len);
+	if (memcmp(newhash, fs->md5sum, 32) && !legacy_match(fs, fs->data)) {
 		kerror("ftfs_unpack: Bad md5 checksum.\n");
 		return -2;
 	}
@@ -98,6 +251,110 @@ int ftfs_unpack(void *pack, char **md5sum, char **dat, int *len)
 	return 0;
 }
 
+/* As ftfs_unpack(), but never look beyond size, e.g. a mapped file */
+int ftfs_check(const void *pack, size_t size, char **dat, int *len)
+{
+	const char *data = (const char*)pack + sizeof(ftfs_s);
+	char newhash[32];
+	ftfs_s fs;
+
+	if (!pack || size < sizeof(ftfs_s))
+		return -3;
+
+	/* Need not be aligned */
+	memcpy(&fs, pack, sizeof(fs));
+
+	if (memcmp(fs.magic, MAGIC, sizeof(MAGIC))) {
+		kerror("ftfs_check: Bad magic number.\n");
+		return -1;
+	}
+	if (fs.len < 0 || (size_t)fs.len > size - sizeof(ftfs_s)) {
+		kerror("ftfs_check: Bad length %d, only %zu.\n", fs.len, size);
+		return -3;
+	}
+
+	hdr_sum(newhash, &fs.len, data, fs.len);
+	if (memcmp(newhash, fs.md5sum, 32) && !legacy_match(&fs, data)) {
+		kerror("ftfs_check: Bad md5 checksum.\n");
+		return -2;
+	}
+
+	if (dat)
+		*dat = (char*)data;
+	if (len)
+		*len = fs.len;
+
+	return 0;
+}
+
+/*
+ * Read one package from fd and hash each piece just read, while it is
+ * still in cache, no second pass over the payload.
+ */
+int ftfs_read(int fd, char **dat, int *len)
+{
+	ftfs_s fs;
+	md5_ctx_s ctx;
+	unsigned char digest[16];
+	unsigned long long size;
+	char newhash[32], *buf;
+	struct stat st;
+	off_t pos;
+	int got, n;
+
+	if (read_full(fd, &fs, sizeof(fs)))
+		return -3;
+
+	if (memcmp(fs.magic, MAGIC, sizeof(MAGIC))) {
+		kerror("ftfs_read: Bad magic number.\n");
+		return -1;
+	}
+	if (fs.len < 0)
+		return -3;
+
+	/* The length is not trusted, a pipe has no size, a short read fails it */
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) &&
+			(pos = lseek(fd, 0, SEEK_CUR)) >= 0) {
+		size = st.st_size > pos ? st.st_size - pos : 0;
+		if ((unsigned long long)fs.len > size) {
+			kerror("ftfs_read: Truncated, only %llu bytes.\n", size);
+			return -3;
+		}
+	}
+
+	buf = (char*)kmem_alloc(fs.len ? fs.len : 1, char);
+
+	md5_init(&ctx);
+	md5_update(&ctx, &fs.len, sizeof(fs.len));
+	for (got = 0; got < fs.len; got += n) {
+		n = fs.len - got;
+		if (n > FTFS_READ_SIZE)
+			n = FTFS_READ_SIZE;
+		if (read_full(fd, buf + got, n)) {
+			kmem_free(buf);
+			return -3;
+		}
+		md5_update(&ctx, buf + got, n);
+	}
+	md5_final(&ctx, digest);
+	md5_hex(newhash, digest);
+
+	if (memcmp(newhash, fs.md5sum, 32) && !legacy_match(&fs, buf)) {
+		kerror("ftfs_read: Bad md5 checksum.\n");
+		kmem_free(buf);
+		return -2;
+	}
+
+	if (dat)
+		*dat = buf;
+	else
+		kmem_free(buf);
+	if (len)
+		*len = fs.len;
+
+	return 0;
+}
+
 /**
  * \brief Get the rest data length of the whole ftfs package.
  *
@@ -131,3 +388,289 @@ int ftfs_header_length()
 	return sizeof(ftfs_s);
 }
 
+/*-----------------------------------------------------------------------
+ * FTFS v2
+ */
+static kinline size_t chunk_len(unsigned long long len, unsigned int chunk_size, unsigned int idx)
+{
+	unsigned long long rest = len - (unsigned long long)idx * chunk_size;
+
+	return rest < chunk_size ? (size_t)rest : chunk_size;
+}
+
+/* Digest of chunk first to first + cnt - 1, dat is where chunk first is */
+static void chunk_sums(const char *dat, unsigned long long len, unsigned int chunk_size,
+		unsigned int first, unsigned int cnt, unsigned char (*sums)[16])
+{
+	const void *p[MD5_MB_LANES];
+	size_t l[MD5_MB_LANES];
+	unsigned int i, n;
+
+	for (i = 0; i < cnt; i += n) {
+		for (n = 0; n < MD5_MB_LANES && i + n < cnt; n++) {
+			p[n] = dat + (size_t)(i + n) * chunk_size;
+			l[n] = chunk_len(len, chunk_size, first + i + n);
+		}
+		md5_mb(p, l, sums + i, n);
+	}
+}
+
+static void hdr2_sum(char sum[32], const ftfs2_hdr_s *hdr, const void *sums)
+{
+	md5_ctx_s ctx;
+	unsigned char digest[16];
+	size_t ofs = offsetof(ftfs2_hdr_s, chunk_size);
+
+	md5_init(&ctx);
+	md5_update(&ctx, (const char*)hdr + ofs, sizeof(*hdr) - ofs);
+	md5_update(&ctx, sums, (size_t)hdr->nchunk * 16);
+	md5_final(&ctx, digest);
+	md5_hex(sum, digest);
+}
+
+/* Magic and the chunk geometry, before believe nchunk */
+static int hdr2_geometry(const ftfs2_hdr_s *hdr)
+{
+	if (memcmp(hdr->magic, MAGIC2, sizeof(MAGIC2))) {
+		kerror("ftfs2: Bad magic number.\n");
+		return -1;
+	}
+	if (!hdr->chunk_size || hdr->chunk_size > FTFS2_CHUNK_MAX ||
+			hdr->nchunk > FTFS2_CHUNK_CNT_MAX ||
+			hdr->len > ULLONG_MAX - (hdr->chunk_size - 1) ||
+			hdr->nchunk != (hdr->len + hdr->chunk_size - 1) / hdr->chunk_size) {
+		kerror("ftfs2: Bad chunk %u x %u for %llu bytes.\n",
+				hdr->nchunk, hdr->chunk_size, hdr->len);
+		return -3;
+	}
+	return 0;
+}
+
+/*
+ * Write the v2 package, the chunk digests are run by md5_mb(), the
+ * payload goes out from dat without copy.
+ */
+int ftfs2_write(int fd, const char *dat, unsigned long long len, unsigned int chunk_size)
+{
+	ftfs2_hdr_s hdr;
+	unsigned char (*sums)[16];
+	unsigned long long nchunk;
+	struct iovec iov[3];
+	int ret;
+
+	if (!chunk_size)
+		chunk_size = FTFS2_CHUNK_SIZE;
+	if (chunk_size > FTFS2_CHUNK_MAX)
+		return -1;
+
+	nchunk = (len + chunk_size - 1) / chunk_size;
+	if (nchunk > FTFS2_CHUNK_CNT_MAX)
+		return -1;
+
+	sums = (unsigned char (*)[16])kmem_alloc(nchunk ? (size_t)nchunk * 16 : 1, char);
+	chunk_sums(dat, len, chunk_size, 0, nchunk, sums);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MAGIC2, sizeof(MAGIC2));
+	hdr.chunk_size = chunk_size;
+	hdr.nchunk = nchunk;
+	hdr.len = len;
+	hdr2_sum(hdr.md5sum, &hdr, sums);
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = sums;
+	iov[1].iov_len = (size_t)nchunk * 16;
+	iov[2].iov_base = (void*)dat;
+	iov[2].iov_len = len;
+	ret = writev_all(fd, iov, 3);
+
+	kmem_free(sums);
+	return ret;
+}
+
+/* Only header and chunk digests are checked, the chunks are checked when read */
+int ftfs2_open_mem(ftfs2_s *f2, const void *pack, size_t size)
+{
+	const unsigned char *sums;
+	char newhash[32];
+	ftfs2_hdr_s hdr;
+	int ret;
+
+	if (!pack || size < sizeof(hdr))
+		return -3;
+
+	/* Need not be aligned */
+	memcpy(&hdr, pack, sizeof(hdr));
+	if ((ret = hdr2_geometry(&hdr)))
+		return ret;
+
+	size -= sizeof(hdr);
+	if ((unsigned long long)hdr.nchunk * 16 > size ||
+			hdr.len > size - (size_t)hdr.nchunk * 16) {
+		kerror("ftfs2_open_mem: Truncated, only %zu bytes.\n", size);
+		return -3;
+	}
+
+	sums = (const unsigned char*)pack + sizeof(hdr);
+	hdr2_sum(newhash, &hdr, sums);
+	if (memcmp(newhash, hdr.md5sum, 32)) {
+		kerror("ftfs2_open_mem: Bad md5 checksum.\n");
+		return -2;
+	}
+
+	f2->chunk_size = hdr.chunk_size;
+	f2->nchunk = hdr.nchunk;
+	f2->len = hdr.len;
+	f2->sums = (const unsigned char (*)[16])sums;
+	f2->dat = (const char*)(sums + (size_t)hdr.nchunk * 16);
+	f2->fd = -1;
+	f2->dofs = 0;
+	f2->own = NULL;
+	return 0;
+}
+
+/* Package starts at the current offset of fd, the offset is not changed */
+int ftfs2_open_fd(ftfs2_s *f2, int fd)
+{
+	ftfs2_hdr_s hdr;
+	unsigned char (*sums)[16];
+	unsigned long long size;
+	char newhash[32];
+	struct stat st;
+	off_t base;
+	int ret;
+
+	base = lseek(fd, 0, SEEK_CUR);
+	if (base < 0)
+		return -3;
+
+	if (pread_full(fd, &hdr, sizeof(hdr), base))
+		return -3;
+	if ((ret = hdr2_geometry(&hdr)))
+		return ret;
+
+	/* Raw device says 0, a short read fails it later */
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+		size = st.st_size > base + (off_t)sizeof(hdr) ?
+			st.st_size - base - sizeof(hdr) : 0;
+		if ((unsigned long long)hdr.nchunk * 16 > size ||
+				hdr.len > size - (size_t)hdr.nchunk * 16) {
+			kerror("ftfs2_open_fd: Truncated, only %llu bytes.\n", size);
+			return -3;
+		}
+	}
+
+	sums = (unsigned char (*)[16])kmem_alloc(hdr.nchunk ? (size_t)hdr.nchunk * 16 : 1, char);
+	if (pread_full(fd, sums, (size_t)hdr.nchunk * 16, base + sizeof(hdr))) {
+		kmem_free(sums);
+		return -3;
+	}
+
+	hdr2_sum(newhash, &hdr, sums);
+	if (memcmp(newhash, hdr.md5sum, 32)) {
+		kerror("ftfs2_open_fd: Bad md5 checksum.\n");
+		kmem_free(sums);
+		return -2;
+	}
+
+	f2->chunk_size = hdr.chunk_size;
+	f2->nchunk = hdr.nchunk;
+	f2->len = hdr.len;
+	f2->sums = (const unsigned char (*)[16])sums;
+	f2->dat = NULL;
+	f2->fd = fd;
+	f2->dofs = base + sizeof(hdr) + (off_t)hdr.nchunk * 16;
+	f2->own = sums;
+	return 0;
+}
+
+void ftfs2_close(ftfs2_s *f2)
+{
+	kmem_free_sz(f2->own);
+	f2->sums = NULL;
+}
+
+/*
+ * Check chunk idx and copy to buf, return the chunk length. buf can be
+ * NULL for opened from memory, only check it. Nothing shared is changed,
+ * threads can read different chunks at the same time.
+ */
+int ftfs2_read_chunk(ftfs2_s *f2, unsigned int idx, char *buf)
+{
+	const char *p;
+	md5_ctx_s ctx;
+	unsigned char digest[16];
+	size_t n;
+
+	if (idx >= f2->nchunk)
+		return -3;
+
+	n = chunk_len(f2->len, f2->chunk_size, idx);
+	if (f2->fd < 0)
+		p = f2->dat + (size_t)idx * f2->chunk_size;
+	else {
+		if (!buf || pread_full(f2->fd, buf, n, f2->dofs + (off_t)idx * f2->chunk_size))
+			return -3;
+		p = buf;
+	}
+
+	md5_init(&ctx);
+	md5_update(&ctx, p, n);
+	md5_final(&ctx, digest);
+	if (memcmp(digest, f2->sums[idx], 16)) {
+		kerror("ftfs2_read_chunk: Bad md5 checksum of chunk %u.\n", idx);
+		return -2;
+	}
+
+	if (buf && p != buf)
+		memcpy(buf, p, n);
+	return (int)n;
+}
+
+/* Check all the chunks, several chunks are hashed at the same time */
+int ftfs2_check(ftfs2_s *f2)
+{
+	unsigned char sums[MD5_MB_LANES][16];
+	unsigned int i, j, cnt, batch;
+	char *buf = NULL;
+	const char *p;
+	int ret = 0;
+
+	batch = MD5_MB_LANES;
+	if (f2->fd >= 0) {
+		while (batch > 1 && (size_t)batch * f2->chunk_size > FTFS2_BATCH_SIZE)
+			batch--;
+		buf = (char*)kmem_alloc((size_t)batch * f2->chunk_size, char);
+	}
+
+	for (i = 0; i < f2->nchunk && !ret; i += cnt) {
+		cnt = f2->nchunk - i;
+		if (cnt > batch)
+			cnt = batch;
+
+		if (f2->fd < 0)
+			p = f2->dat + (size_t)i * f2->chunk_size;
+		else {
+			size_t n = (size_t)(cnt - 1) * f2->chunk_size +
+				chunk_len(f2->len, f2->chunk_size, i + cnt - 1);
+
+			if (pread_full(f2->fd, buf, n, f2->dofs + (off_t)i * f2->chunk_size)) {
+				ret = -3;
+				break;
+			}
+			p = buf;
+		}
+
+		chunk_sums(p, f2->len, f2->chunk_size, i, cnt, sums);
+		for (j = 0; j < cnt; j++)
+			if (memcmp(sums[j], f2->sums[i + j], 16)) {
+				kerror("ftfs2_check: Bad md5 checksum of chunk %u.\n", i + j);
+				ret = -2;
+				break;
+			}
+	}
+
+	kmem_free_s(buf);
+	return ret;
+}
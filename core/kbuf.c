@@ -4,6 +4,10 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <hilda/kbuf.h>
 
@@ -174,6 +178,186 @@ void kbuf_vaddf(kbuf_s *kb, const char *fmt, va_list ap)
 	kbuf_setlen(kb, kb->len + len);
 }
 
+char *kbuf_reserve(kbuf_s *kb, size_t len)
+{
+	kbuf_grow(kb, len);
+	return kb->buf + kb->len;
+}
+
+void kbuf_commit(kbuf_s *kb, size_t len)
+{
+	kbuf_setlen(kb, kb->len + len);
+}
+
+/* Two digits a time, "00" to "99" */
+static const char __dec2[201] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static const char __hex[] = "0123456789abcdef";
+
+int kbuf_fmt_u(char *p, unsigned long long v)
+{
+	char tmp[KBUF_NUM_MAX], *q = tmp + sizeof(tmp);
+	unsigned int i;
+	int len;
+
+	while (v >= 100) {
+		i = (unsigned int)(v % 100) * 2;
+		v /= 100;
+		q -= 2;
+		q[0] = __dec2[i];
+		q[1] = __dec2[i + 1];
+	}
+	if (v >= 10) {
+		q -= 2;
+		q[0] = __dec2[v * 2];
+		q[1] = __dec2[v * 2 + 1];
+	} else
+		*--q = '0' + (char)v;
+
+	len = tmp + sizeof(tmp) - q;
+	memcpy(p, q, len);
+	return len;
+}
+
+int kbuf_fmt_i(char *p, long long v)
+{
+	if (v < 0) {
+		*p = '-';
+		return 1 + kbuf_fmt_u(p + 1, 0ULL - (unsigned long long)v);
+	}
+	return kbuf_fmt_u(p, (unsigned long long)v);
+}
+
+/* Lower case, zero padded to width, p must hold max(width, 16) bytes */
+int kbuf_fmt_x(char *p, unsigned long long v, int width)
+{
+	int i, len = 1;
+
+	if (v)
+		len = (64 - __builtin_clzll(v) + 3) / 4;
+	if (width > len) {
+		memset(p, '0', width - len);
+		p += width - len;
+	} else
+		width = len;
+
+	for (i = len - 1; i >= 0; i--) {
+		p[i] = __hex[v & 0xf];
+		v >>= 4;
+	}
+	return width;
+}
+
+/* Same as %p of glibc */
+int kbuf_fmt_p(char *p, const void *ptr)
+{
+	if (!ptr) {
+		memcpy(p, "(nil)", 5);
+		return 5;
+	}
+
+	p[0] = '0';
+	p[1] = 'x';
+	return 2 + kbuf_fmt_x(p + 2, (uintptr_t)ptr, 0);
+}
+
+void kbuf_addi(kbuf_s *kb, long long v, int width)
+{
+	char tmp[KBUF_NUM_MAX];
+
+	if (!width)
+		kbuf_commit(kb, kbuf_fmt_i(kbuf_reserve(kb, KBUF_NUM_MAX), v));
+	else
+		kbuf_addpad(kb, tmp, kbuf_fmt_i(tmp, v), width);
+}
+
+void kbuf_addu(kbuf_s *kb, unsigned long long v, int width)
+{
+	char tmp[KBUF_NUM_MAX];
+
+	if (!width)
+		kbuf_commit(kb, kbuf_fmt_u(kbuf_reserve(kb, KBUF_NUM_MAX), v));
+	else
+		kbuf_addpad(kb, tmp, kbuf_fmt_u(tmp, v), width);
+}
+
+void kbuf_addx(kbuf_s *kb, unsigned long long v, int width)
+{
+	char *p = kbuf_reserve(kb, width > 16 ? width : 16);
+
+	kbuf_commit(kb, kbuf_fmt_x(p, v, width));
+}
+
+void kbuf_addp(kbuf_s *kb, const void *ptr)
+{
+	kbuf_commit(kb, kbuf_fmt_p(kbuf_reserve(kb, KBUF_NUM_MAX), ptr));
+}
+
+void kbuf_addpad(kbuf_s *kb, const char *str, size_t len, int width)
+{
+	size_t pad, w = width < 0 ? -width : width;
+	char *p;
+
+	pad = w > len ? w - len : 0;
+	p = kbuf_reserve(kb, len + pad);
+
+	if (width < 0) {
+		memcpy(p, str, len);
+		memset(p + len, ' ', pad);
+	} else {
+		memset(p, ' ', pad);
+		memcpy(p + pad, str, len);
+	}
+	kbuf_commit(kb, len + pad);
+}
+
+void kbuf_addesc(kbuf_s *kb, const char *str, size_t len)
+{
+	const unsigned char *s = (const unsigned char*)str;
+	char *p, *start;
+	size_t i;
+
+	p = start = kbuf_reserve(kb, len * 4);
+
+	for (i = 0; i < len; i++) {
+		switch (s[i]) {
+		case '\\':
+		case '"':
+			*p++ = '\\';
+			*p++ = s[i];
+			break;
+		case '\n':
+			*p++ = '\\';
+			*p++ = 'n';
+			break;
+		case '\r':
+			*p++ = '\\';
+			*p++ = 'r';
+			break;
+		case '\t':
+			*p++ = '\\';
+			*p++ = 't';
+			break;
+		default:
+			if (s[i] < 0x20 || s[i] == 0x7f) {
+				*p++ = '\\';
+				*p++ = 'x';
+				*p++ = __hex[s[i] >> 4];
+				*p++ = __hex[s[i] & 0xf];
+			} else
+				*p++ = s[i];
+			break;
+		}
+	}
+
+	kbuf_commit(kb, p - start);
+}
+
 size_t kbuf_fread(kbuf_s *kb, size_t size, FILE *fp, int *err)
 {
 	size_t bytes;
@@ -194,75 +378,183 @@ size_t kbuf_fread(kbuf_s *kb, size_t size, FILE *fp, int *err)
 	return bytes;
 }
 
+/* Append the whole file, one read when the size is known */
+int kbuf_load_file(kbuf_s *kb, const char *path)
+{
+	struct stat st;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	/* procfs and pipe say 0, read till EOF anyway */
+	if (!fstat(fd, &st) && st.st_size > 0)
+		kbuf_grow(kb, st.st_size);
+
+	for (;;) {
+		if (!kbuf_avail(kb))
+			kbuf_grow(kb, 4096);
+
+		n = read(fd, kb->buf + kb->len, kbuf_avail(kb));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		kbuf_setlen(kb, kb->len + n);
+	}
+
+	close(fd);
+	return n < 0 ? -1 : 0;
+}
+
+int kbuf_map_file(kbuf_map_s *km, const char *path)
+{
+	struct stat st;
+	void *dat;
+	int fd;
+
+	km->dat = NULL;
+	km->len = 0;
+	km->mapped = 0;
+	kbuf_init(&km->kb, 0);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size >= KBUF_MAP_MIN) {
+		dat = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (dat != MAP_FAILED) {
+			madvise(dat, st.st_size, MADV_SEQUENTIAL);
+			close(fd);
+
+			km->dat = (const char*)dat;
+			km->len = st.st_size;
+			km->mapped = 1;
+			return 0;
+		}
+	}
+	close(fd);
+
+	if (kbuf_load_file(&km->kb, path)) {
+		kbuf_release(&km->kb);
+		return -1;
+	}
+
+	km->dat = km->kb.buf;
+	km->len = km->kb.len;
+	return 0;
+}
+
+void kbuf_unmap(kbuf_map_s *km)
+{
+	if (km->mapped)
+		munmap((void*)km->dat, km->len);
+	else
+		kbuf_release(&km->kb);
+
+	km->dat = NULL;
+	km->len = 0;
+	km->mapped = 0;
+}
+
+const char *kbuf_getline(const char *dat, size_t len, size_t *pos, size_t *linelen)
+{
+	const char *line, *end, *cr;
+
+	if (*pos >= len)
+		return NULL;
+
+	line = dat + *pos;
+	end = memchr(line, '\n', len - *pos);
+	if (!end)
+		end = dat + len;
+
+	cr = memchr(line, '\r', end - line);
+	if (cr) {
+		*linelen = cr - line;
+		*pos = cr + 1 - dat;
+		if (cr + 1 == end && end < dat + len)
+			(*pos)++;
+	} else {
+		*linelen = end - line;
+		*pos = end - dat + (end < dat + len);
+	}
+
+	return line;
+}
+
+#define DUMP_PUTS(p, s) do { memcpy((p), (s), sizeof(s) - 1); (p) += sizeof(s) - 1; } while (0)
+
 void kbuf_dump(kbuf_s *kb, const char *banner, char *dat, int len, int width)
 {
-	int i, line, offset = 0, blen;
-	char cache[2048], *pbuf, *p;
+	static const char hex[] = "0123456789ABCDEF";
+	int i, line, offset = 0;
+	unsigned char c;
+	char *p;
 
 	if (width <= 0)
 		width = 16;
 
-	/* 6 => "%04x  "; 3 => "%02x ", 1 => "%c", 2 => " |", 2 => "|\n" */
-	blen = 6 + (3 + 1) * width + 2 + 2;
-	if ((size_t)blen > sizeof(cache))
-		pbuf = (char*)malloc(blen);
-	else
-		pbuf = cache;
-
 	kbuf_addf(kb, "\n%s\n", banner);
 	kbuf_addf(kb, "Data:%p, Length:%d\n", dat, len);
 
 	while (offset < len) {
-		p = pbuf;
-
-		p += sprintf(p, "%04x  ", offset);
 		line = len - offset;
-
 		if (line > width)
 			line = width;
 
+		/* odd byte is colored twice, 14 + 12; offset may be longer than 4 digits */
+		kbuf_grow(kb, 27 * width + 32);
+		p = kb->buf + kb->len;
+
+		p += sprintf(p, "%04x  ", offset);
+
 		for (i = 0; i < line; i++) {
-			unsigned char c = (unsigned char)dat[i];
+			c = (unsigned char)dat[i];
 
 			if (i % 2 == 0) {
-				p += sprintf(p, "%02X ", c);
+				*p++ = hex[c >> 4];
+				*p++ = hex[c & 0x0f];
+				*p++ = ' ';
 			} else {
-				p += sprintf(p, "\033[0;33m%02X\033[0m ", c);
-			}
-			if (i % 4 == 3) {
-				p += sprintf(p, " ");
+				DUMP_PUTS(p, "\033[0;33m");
+				*p++ = hex[c >> 4];
+				*p++ = hex[c & 0x0f];
+				DUMP_PUTS(p, "\033[0m ");
 			}
+			if (i % 4 == 3)
+				*p++ = ' ';
 		}
 		for (; i < width; i++) {
-			p += sprintf(p, "  ");
-			if (i % 4 == 3) {
-				p += sprintf(p, " ");
-			}
+			*p++ = ' ';
+			*p++ = ' ';
+			if (i % 4 == 3)
+				*p++ = ' ';
 		}
 
-		p += sprintf(p, " |");
+		DUMP_PUTS(p, " |");
 		for (i = 0; i < line; i++) {
-			unsigned char c;
-
-			if ((unsigned char)dat[i] >= 0x20 && (unsigned char)dat[i] < 0x7f)
-				c = (unsigned char)dat[i];
-			else
+			c = (unsigned char)dat[i];
+			if (c < 0x20 || c >= 0x7f)
 				c = (unsigned char)'.';
 
 			if (i % 2 == 0) {
-				p += sprintf(p, "%c", c);
+				*p++ = (char)c;
 			} else {
-				p += sprintf(p, "\033[0;33m%c\033[0m", c);
+				DUMP_PUTS(p, "\033[0;33m");
+				*p++ = (char)c;
+				DUMP_PUTS(p, "\033[0m");
 			}
 		}
-		p += sprintf(p, "|\n");
-		kbuf_addf(kb, "%s", pbuf);
+		DUMP_PUTS(p, "|\n");
+
+		kbuf_setlen(kb, p - kb->buf);
 
 		offset += line;
 		dat += width;
 	}
-
-	if (pbuf != cache)
-		free(pbuf);
 }
 
@@ -3,14 +3,20 @@
 #include <string.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <hilda/ktypes.h>
 
 #include <hilda/klog.h>
 #include <hilda/kmem.h>
 #include <hilda/kstr.h>
-#include <hilda/md5sum.h>
+#include <hilda/xxh64.h>
 #include <hilda/sdlist.h>
+#include <hilda/kbuf.h>
 
 #include <hilda/helper.h>
 #include <hilda/kopt.h>
@@ -95,7 +101,7 @@ static void queue_target(kcfg_target_s *ct)
 		}
 	}
 
-	ARR_INC(1, c->target.arr, c->target.cnt, kcfg_target_s*);
+	ARR_ADD(1, c->target.arr, c->target.cnt, c->target.cap, kcfg_target_s*);
 	c->target.arr[i] = ct;
 }
 
@@ -129,6 +135,7 @@ kcfg_target_s *kcfg_target_add(const char *name, KCFG_SAVE dosave,
 	nct->del = dodelete;
 	nct->ua = ua;
 	nct->ub = ub;
+	nct->dirty = 1;
 
 	queue_target(nct);
 	return nct;
@@ -181,10 +188,9 @@ static kinline int target_opt_find(kcfg_target_s *ct, const char *opt)
 
 	for (i = 0; i < ct->opts.cnt; i++) {
 		path = ct->opts.arr[i];
-		if (path && (0 == strcmp(path, opt))) {
-			klog("%s, pos: %d\n", path, i);
+		/* On the path of every opt set, no log here */
+		if (path && (0 == strcmp(path, opt)))
 			return i;
-		}
 	}
 
 	return -1;
@@ -207,12 +213,14 @@ static int target_opt_add(kcfg_target_s *ct, const char *opt)
 		path = ct->opts.arr[i];
 		if (!path) {
 			ct->opts.arr[i] = kstr_dup(opt);
+			__atomic_store_n(&ct->dirty, 1, __ATOMIC_RELEASE);
 			return 0;
 		}
 	}
 
-	ARR_INC(10, ct->opts.arr, ct->opts.cnt, char*);
+	ARR_ADD(10, ct->opts.arr, ct->opts.cnt, ct->opts.cap, char*);
 	ct->opts.arr[i] = kstr_dup(opt);
+	__atomic_store_n(&ct->dirty, 1, __ATOMIC_RELEASE);
 
 	return 0;
 }
@@ -224,8 +232,24 @@ static void target_opt_clr(kcfg_target_s *ct)
 		kmem_free_sz(ct->opts.arr[i]);
 }
 
+/*
+ * Only the targets hold this opt will be saved. The opt is set by any
+ * thread, the dirty flag is taken by cfg_save_dpc.
+ */
 static void ow_opt_dirty(int ses, void *opt, void *wch)
 {
+	kcfg_s *c = __g_cfg;
+	kcfg_target_s *ct;
+	char *path = kopt_path(opt);
+	int i;
+
+	for (i = 0; i < c->target.cnt; i++) {
+		ct = c->target.arr[i];
+		if (ct && !__atomic_load_n(&ct->dirty, __ATOMIC_RELAXED) &&
+				target_opt_find(ct, path) >= 0)
+			__atomic_store_n(&ct->dirty, 1, __ATOMIC_RELEASE);
+	}
+
 	if (__g_cfg_loaded)
 		kcfg_save_delay(500);
 }
@@ -251,45 +275,80 @@ int kcfg_target_opt_del(const char *name, const char *opt)
 		j = target_opt_find(c->target.arr[i], opt);
 		if (j >= 0) {
 			kmem_free_z(c->target.arr[i]->opts.arr[j]);
+			__atomic_store_n(&c->target.arr[i]->dirty, 1,
+					__ATOMIC_RELEASE);
 			return 0;
 		}
 	}
 	return -1;
 }
 
-static void make_save_buffer(kcfg_target_s *ct, char **dat, int *len)
-{
-	int i, klen, vlen, dlen = 0;
-	char *buf = 0, *v, *opt;
+/*
+ * The buffer is "opt=val" lines. The hash is fed per opt while the values
+ * are got, if hash given and equal to *hash, nothing is built.
+ */
+static void make_save_buffer(kcfg_target_s *ct, char **dat, int *len,
+		unsigned long long *hash)
+{
+	int i, dlen = 0;
+	char *buf = NULL, *p, **vals, *opt, stk[4096];
+	unsigned long long h;
+	kmem_arena_s ar;
+	xxh64_s st;
+
+	*dat = NULL;
+	*len = 0;
+	if (!ct->opts.cnt) {
+		if (hash)
+			*hash = xxh64("", 0, 0);
+		return;
+	}
+
+	/* Values only live until the buffer is made */
+	kmem_arena_init(&ar, stk, sizeof(stk));
+	vals = (char**)kmem_arena_get_z(&ar, ct->opts.cnt * sizeof(char*));
+	xxh64_init(&st, 0);
 
 	for (i = 0; i < ct->opts.cnt; i++) {
 		opt = ct->opts.arr[i];
 		if (!opt)
 			continue;
 
-		v = NULL;
-		if (EC_OK == kopt_getini(opt, &v)) {
-			if (!v)
-				continue;
+		if (EC_OK != kopt_getini_ex(opt, &ar, &vals[i]) || !vals[i]) {
+			vals[i] = NULL;
+			continue;
+		}
 
-			klen = strlen(opt);
-			vlen = strlen(v);
-			buf = (char*)kmem_realloc(buf, dlen + klen + vlen + 2);
-			memcpy(buf + dlen, opt, klen);
-			memcpy(buf + dlen + klen, "=", 1);
-			memcpy(buf + dlen + klen + 1, v, vlen);
-			memcpy(buf + dlen + klen + 1 + vlen, "\n", 1);
-			dlen += klen + 1 + vlen + 1;
+		if (dlen)
+			xxh64_update(&st, "\n", 1);
+		xxh64_update(&st, opt, strlen(opt));
+		xxh64_update(&st, "=", 1);
+		xxh64_update(&st, vals[i], strlen(vals[i]));
 
-			kmem_free(v);
-		}
+		dlen += strlen(opt) + 1 + strlen(vals[i]) + 1;
 	}
 
-	if (buf) {
+	if (hash) {
+		h = xxh64_digest(&st);
+		if (h == *hash)
+			dlen = 0;
+		*hash = h;
+	}
+
+	if (dlen) {
+		p = buf = (char*)kmem_alloc(dlen + 1, char);
+		for (i = 0; i < ct->opts.cnt; i++) {
+			if (!vals[i])
+				continue;
+			p += sprintf(p, "%s=%s\n", ct->opts.arr[i], vals[i]);
+		}
+
 		dlen--;
 		buf[dlen] = '\0';
 	}
 
+	kmem_arena_release(&ar);
+
 	*dat = buf;
 	*len = dlen;
 }
@@ -343,7 +402,7 @@ static int og_target(void *opt, void *pa, void *pb)
 		return -1;
 
 	ct = __g_cfg->target.arr[i];
-	make_save_buffer(ct, &dat, &len);
+	make_save_buffer(ct, &dat, &len, NULL);
 	kopt_set_cur_str(opt, dat);
 	return 0;
 }
@@ -397,6 +456,8 @@ int kcfg_init()
 	__g_cfg = (kcfg_s*)kmem_alloz(1, kcfg_s);
 
 	kopt_getptr("p:/env/mque", (void**)&__g_mque_main);
+	if (__g_mque_main)
+		kmque_diag_add(__g_mque_main, "main");
 
 	target_file();
 
@@ -425,7 +486,8 @@ int kcfg_final(kcfg_s *cfg)
 static void cfg_save_dpc(void *ua, void *ub)
 {
 	int i, len;
-	char *dat, hash[32];
+	char *dat;
+	unsigned long long hash;
 	kcfg_s *c = __g_cfg;
 	kcfg_target_s *ct;
 
@@ -433,20 +495,23 @@ static void cfg_save_dpc(void *ua, void *ub)
 		ct = c->target.arr[i];
 		if ((!ct) || (!ct->save) || is_skipped_target(ct->name))
 			continue;
+		/* Changed while saving will be dirty again */
+		if (!__atomic_exchange_n(&ct->dirty, 0, __ATOMIC_ACQUIRE))
+			continue;
 
-		dat = NULL;
-		len = 0;
-		make_save_buffer(ct, &dat, &len);
-		klog("make_save_buffer, return:\n%s\n", dat);
+		hash = ct->data_hash;
+		make_save_buffer(ct, &dat, &len, &hash);
 
-		md5_calculate(hash, dat, len);
-		if (memcmp(hash, ct->data_hash, sizeof(hash))) {
+		if (hash != ct->data_hash) {
+			klog("make_save_buffer, return:\n%s\n", dat);
 			if (!ct->save(ct, dat, len, ct->ua, ct->ub))
-				memcpy(ct->data_hash, hash, sizeof(hash));
-			else
+				ct->data_hash = hash;
+			else {
 				kerror("fail: %s\n", ct->name);
+				__atomic_store_n(&ct->dirty, 1, __ATOMIC_RELEASE);
+			}
 		} else
-			kerror("(%s): not touched\n", ct->name);
+			klog("(%s): not touched\n", ct->name);
 
 		kmem_free_s(dat);
 	}
@@ -455,7 +520,8 @@ static void cfg_save_dpc(void *ua, void *ub)
 static int tc_cfg_save(void *id, void *userdata)
 {
 	if (id == __g_tm_cfg_save) {
-		mentry_post(__g_mque_main, cfg_save_dpc, NULL, NULL, NULL);
+		mentry_post_prio(__g_mque_main, KMQUE_PRIO_LOW,
+				cfg_save_dpc, NULL, NULL, NULL);
 		__g_tm_cfg_save = NULL;
 	}
 	return 0;
@@ -473,7 +539,8 @@ int kcfg_save_delay(int msec)
 
 int kcfg_save()
 {
-	mentry_post(__g_mque_main, cfg_save_dpc, NULL, NULL, NULL);
+	mentry_post_prio(__g_mque_main, KMQUE_PRIO_LOW,
+			cfg_save_dpc, NULL, NULL, NULL);
 	return 0;
 }
 
@@ -536,7 +603,7 @@ static int load_targets()
 			continue;
 		if (ct->load(ct, &dat, &len, ct->ua, ct->ub))
 			continue;
-		md5_calculate(ct->data_hash, dat, len);
+		ct->data_hash = xxh64(dat, len, 0);
 
 		kvarrarr[kvcnt] = NULL;
 		kvcntarr[kvcnt] = 0;
@@ -589,6 +656,57 @@ int kcfg_load()
 	return 0;
 }
 
+/* Whole file to kmem for KCFG_LOAD, read once into the returned buffer */
+static int load_whole_file(const char *path, char **dat, int *len)
+{
+	struct stat st;
+	char *buf;
+	size_t cap, cnt = 0;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	/* procfs and pipe say 0, read till EOF anyway, room for NUL and EOF */
+	cap = 4096;
+	if (!fstat(fd, &st) && st.st_size > 0 && st.st_size < INT_MAX)
+		cap = st.st_size + 2;
+
+	/* Straight into kmem, the caller frees it by kmem_free */
+	buf = kmem_alloc(cap, char);
+	for (;;) {
+		if (cnt + 1 >= cap) {
+			cap *= 2;
+			if (cap > (size_t)INT_MAX + 1) {
+				n = -1;
+				break;
+			}
+			buf = (char*)kmem_realloc(buf, cap);
+		}
+
+		n = read(fd, buf + cnt, cap - cnt - 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		cnt += n;
+	}
+
+	close(fd);
+
+	if (n < 0 || !cnt) {
+		kmem_free(buf);
+		return -1;
+	}
+
+	buf[cnt] = '\0';
+	*dat = buf;
+	*len = (int)cnt;
+	return 0;
+}
+
 /*----------------------------------------------------
  * command line
  *
@@ -597,21 +715,7 @@ int kcfg_load()
 static int argv_load(kcfg_target_s *ct, char **dat,
 		int *len, void *ua, void *ub)
 {
-	char *path = &ct->name[5], buf[64 * 1024];
-	FILE *fp;
-
-	fp = fopen(path, "rt");
-	if (!fp)
-		return -1;
-	*len = fread(buf, sizeof(char), sizeof(buf), fp);
-	fclose(fp);
-
-	if (*len <= 0)
-		return -1;
-
-	*dat = (char*)kmem_alloz(*len, char);
-	memcpy(*dat, buf, *len);
-	return 0;
+	return load_whole_file(&ct->name[5], dat, len);
 }
 
 static int target_argv()
@@ -652,21 +756,7 @@ static int target_argv()
 static int file_load(kcfg_target_s *ct, char **dat,
 		int *len, void *ua, void *ub)
 {
-	char *path = &ct->name[5], buf[64 * 1024];
-	FILE *fp;
-
-	fp = fopen(path, "rt");
-	if (!fp)
-		return -1;
-	*len = fread(buf, sizeof(char), sizeof(buf), fp);
-	fclose(fp);
-
-	if (*len <= 0)
-		return -1;
-
-	*dat = (char*)kmem_alloz(*len, char);
-	memcpy(*dat, buf, *len);
-	return 0;
+	return load_whole_file(&ct->name[5], dat, len);
 }
 
 static int os_cfg_target_file_add(int ses, void *opt, void *pa, void *pb)
@@ -0,0 +1,541 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include <hilda/kmem.h>
+#include <hilda/helper.h>
+#include <hilda/kchain.h>
+
+/* At most so many entries for one writev or sendmsg */
+#define KCHAIN_IOV_MAX          64
+
+static kchain_seg_s *seg_new(unsigned int size)
+{
+	kchain_seg_s *seg = (kchain_seg_s*)kmem_get(sizeof(kchain_seg_s) + size);
+
+	seg->ref = 1;
+	seg->size = size;
+	seg->used = 0;
+	return seg;
+}
+
+static void seg_ref(kchain_seg_s *seg)
+{
+	__atomic_add_fetch(&seg->ref, 1, __ATOMIC_RELAXED);
+}
+
+static void seg_unref(kchain_seg_s *seg)
+{
+	if (!__atomic_sub_fetch(&seg->ref, 1, __ATOMIC_ACQ_REL))
+		kmem_rel(seg);
+}
+
+static kchain_ent_s *ent_push(kchain_s *kc, kchain_seg_s *seg, unsigned int ofs, unsigned int len)
+{
+	kchain_ent_s *e;
+
+	ARR_GROW(kc->arr, kc->cap, kc->cnt + 1, kchain_ent_s);
+	e = &kc->arr[kc->cnt++];
+	e->seg = seg;
+	e->ofs = ofs;
+	e->len = len;
+	return e;
+}
+
+static void ent_insert_head(kchain_s *kc, kchain_seg_s *seg, unsigned int len)
+{
+	ARR_GROW(kc->arr, kc->cap, kc->cnt + 1, kchain_ent_s);
+	memmove(kc->arr + 1, kc->arr, kc->cnt * sizeof(kchain_ent_s));
+	kc->cnt++;
+
+	kc->arr[0].seg = seg;
+	kc->arr[0].ofs = 0;
+	kc->arr[0].len = len;
+	kc->len += len;
+}
+
+/*
+ * Free space after the last entry. Only when the entry ends at the end of
+ * the written data and nobody else holds the segment, else a slice could
+ * see the bytes changed.
+ */
+static unsigned int tail_room(kchain_s *kc)
+{
+	kchain_ent_s *e;
+
+	if (!kc->cnt)
+		return 0;
+
+	e = &kc->arr[kc->cnt - 1];
+	if (e->ofs + e->len != e->seg->used)
+		return 0;
+	if (__atomic_load_n(&e->seg->ref, __ATOMIC_ACQUIRE) != 1)
+		return 0;
+	return e->seg->size - e->seg->used;
+}
+
+/* The last entry with at least min bytes room */
+static kchain_ent_s *tail_get(kchain_s *kc, unsigned int min)
+{
+	unsigned int size = kc->seg_size;
+
+	if (kc->cnt && tail_room(kc) >= min)
+		return &kc->arr[kc->cnt - 1];
+
+	if (size < min)
+		size = min;
+	return ent_push(kc, seg_new(size), 0, 0);
+}
+
+void kchain_init(kchain_s *kc, unsigned int seg_size)
+{
+	kc->len = 0;
+	kc->seg_size = seg_size ? seg_size : KCHAIN_SEG_SIZE;
+	kc->arr = NULL;
+	kc->cnt = 0;
+	kc->cap = 0;
+}
+
+void kchain_release(kchain_s *kc)
+{
+	int i;
+
+	for (i = 0; i < kc->cnt; i++)
+		seg_unref(kc->arr[i].seg);
+	ARR_FREE(kc->arr, kc->cnt, kc->cap);
+	kc->len = 0;
+}
+
+void kchain_add(kchain_s *kc, const void *data, size_t len)
+{
+	const char *p = (const char*)data;
+	kchain_ent_s *e;
+	unsigned int n;
+
+	kc->len += len;
+
+	while (len) {
+		n = tail_room(kc);
+		if (!n) {
+			tail_get(kc, 1);
+			n = kc->seg_size;
+		}
+		if (n > len)
+			n = len;
+
+		e = &kc->arr[kc->cnt - 1];
+		memcpy(e->seg->dat + e->seg->used, p, n);
+		e->seg->used += n;
+		e->len += n;
+
+		p += n;
+		len -= n;
+	}
+}
+
+void kchain_adds(kchain_s *kc, const char *str)
+{
+	kchain_add(kc, str, strlen(str));
+}
+
+void kchain_addf(kchain_s *kc, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	kchain_vaddf(kc, fmt, ap);
+	va_end(ap);
+}
+
+/* Format in place into the tail segment, link a bigger one if not fit */
+void kchain_vaddf(kchain_s *kc, const char *fmt, va_list ap)
+{
+	kchain_ent_s *e;
+	kchain_seg_s *seg;
+	unsigned int room;
+	va_list cp;
+	int n;
+
+	e = tail_get(kc, 64);
+	seg = e->seg;
+	room = seg->size - seg->used;
+
+	va_copy(cp, ap);
+	n = vsnprintf(seg->dat + seg->used, room, fmt, cp);
+	va_end(cp);
+	if (n < 0)
+		return;
+
+	if ((unsigned int)n >= room) {
+		if (!e->len) {
+			kc->cnt--;
+			seg_unref(seg);
+		}
+		e = tail_get(kc, n + 1);
+		seg = e->seg;
+		vsnprintf(seg->dat + seg->used, n + 1, fmt, ap);
+	}
+
+	seg->used += n;
+	e->len += n;
+	kc->len += n;
+}
+
+/* Move all the data of src to the tail of kc, src is empty after */
+void kchain_join(kchain_s *kc, kchain_s *src)
+{
+	int i;
+
+	for (i = 0; i < src->cnt; i++)
+		if (src->arr[i].len)
+			ent_push(kc, src->arr[i].seg, src->arr[i].ofs, src->arr[i].len);
+		else
+			seg_unref(src->arr[i].seg);
+	kc->len += src->len;
+
+	src->cnt = 0;
+	src->len = 0;
+}
+
+/* Header before all the data, e.g. length or status line */
+void kchain_prepend(kchain_s *kc, const void *data, size_t len)
+{
+	kchain_seg_s *seg;
+
+	if (!len)
+		return;
+
+	seg = seg_new(len);
+	memcpy(seg->dat, data, len);
+	seg->used = len;
+	ent_insert_head(kc, seg, len);
+}
+
+void kchain_prependf(kchain_s *kc, const char *fmt, ...)
+{
+	kchain_seg_s *seg;
+	va_list ap;
+	char stk[256];
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(stk, sizeof(stk), fmt, ap);
+	va_end(ap);
+	if (n <= 0)
+		return;
+
+	if (n < sizeof(stk)) {
+		kchain_prepend(kc, stk, n);
+		return;
+	}
+
+	seg = seg_new(n + 1);
+	va_start(ap, fmt);
+	vsnprintf(seg->dat, n + 1, fmt, ap);
+	va_end(ap);
+	seg->used = n;
+	ent_insert_head(kc, seg, n);
+}
+
+/*
+ * Append bytes [ofs, ofs + len) of src to dst without copy, the segments
+ * are shared. dst and src must not be the same chain.
+ */
+int kchain_slice(kchain_s *dst, const kchain_s *src, size_t ofs, size_t len)
+{
+	kchain_ent_s *e;
+	unsigned int n;
+	int i;
+
+	if (ofs > src->len || len > src->len - ofs)
+		return -1;
+
+	dst->len += len;
+
+	for (i = 0; i < src->cnt && len; i++) {
+		e = &src->arr[i];
+		if (ofs >= e->len) {
+			ofs -= e->len;
+			continue;
+		}
+
+		n = e->len - ofs;
+		if (n > len)
+			n = len;
+
+		seg_ref(e->seg);
+		ent_push(dst, e->seg, e->ofs + ofs, n);
+
+		ofs = 0;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Remove len bytes from head, e.g. the part already sent */
+void kchain_drop(kchain_s *kc, size_t len)
+{
+	kchain_ent_s *e;
+	int i;
+
+	if (len >= kc->len) {
+		for (i = 0; i < kc->cnt; i++)
+			seg_unref(kc->arr[i].seg);
+		kc->cnt = 0;
+		kc->len = 0;
+		return;
+	}
+
+	kc->len -= len;
+
+	for (i = 0; i < kc->cnt; i++) {
+		e = &kc->arr[i];
+		if (len < e->len) {
+			e->ofs += len;
+			e->len -= len;
+			break;
+		}
+		len -= e->len;
+		seg_unref(e->seg);
+	}
+
+	kc->cnt -= i;
+	memmove(kc->arr, kc->arr + i, kc->cnt * sizeof(kchain_ent_s));
+}
+
+/* Fill iov for writev or sendmsg, return count of iov used */
+int kchain_iov(const kchain_s *kc, struct iovec *iov, int max)
+{
+	int i, n = 0;
+
+	for (i = 0; i < kc->cnt && n < max; i++) {
+		if (!kc->arr[i].len)
+			continue;
+		iov[n].iov_base = kc->arr[i].seg->dat + kc->arr[i].ofs;
+		iov[n].iov_len = kc->arr[i].len;
+		n++;
+	}
+
+	return n;
+}
+
+/* Flatten bytes from ofs to buf, return bytes copied */
+size_t kchain_copy(const kchain_s *kc, size_t ofs, void *buf, size_t len)
+{
+	kchain_ent_s *e;
+	char *p = (char*)buf;
+	size_t n, copied = 0;
+	int i;
+
+	for (i = 0; i < kc->cnt && copied < len; i++) {
+		e = &kc->arr[i];
+		if (ofs >= e->len) {
+			ofs -= e->len;
+			continue;
+		}
+
+		n = e->len - ofs;
+		if (n > len - copied)
+			n = len - copied;
+		memcpy(p + copied, e->seg->dat + e->ofs + ofs, n);
+
+		ofs = 0;
+		copied += n;
+	}
+
+	return copied;
+}
+
+/* One writev, the bytes written are dropped */
+ssize_t kchain_writev(kchain_s *kc, int fd)
+{
+	struct iovec iov[KCHAIN_IOV_MAX];
+	ssize_t n;
+	int cnt;
+
+	cnt = kchain_iov(kc, iov, KCHAIN_IOV_MAX);
+	if (!cnt)
+		return 0;
+
+	n = writev(fd, iov, cnt);
+	if (n > 0)
+		kchain_drop(kc, n);
+	return n;
+}
+
+/*
+ * Send all by sendmsg, for blocking socket. Return 0 if all sent, -1 on
+ * error or peer closed, the data not sent stays in chain.
+ */
+int kchain_send(kchain_s *kc, int sock, int flags)
+{
+	struct iovec iov[KCHAIN_IOV_MAX];
+	struct msghdr msg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+
+	while (kc->len) {
+		msg.msg_iovlen = kchain_iov(kc, iov, KCHAIN_IOV_MAX);
+
+		n = sendmsg(sock, &msg, flags);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+
+		kchain_drop(kc, n);
+	}
+
+	return 0;
+}
+
+#ifdef KCHAIN_TEST
+#include <stdlib.h>
+
+/*
+ * Random operations on small segments, the chain is compared with a flat
+ * copy after each. A slice is held over the later operations, so writing
+ * into a shared segment is found.
+ */
+typedef struct {
+	char *dat;
+	size_t len, cap;
+} flat_s;
+
+static void flat_put(flat_s *f, size_t ofs, const void *dat, size_t len)
+{
+	if (f->len + len > f->cap) {
+		f->cap = (f->len + len) * 2;
+		f->dat = realloc(f->dat, f->cap);
+	}
+	memmove(f->dat + ofs + len, f->dat + ofs, f->len - ofs);
+	memcpy(f->dat + ofs, dat, len);
+	f->len += len;
+}
+
+static int chain_check(const kchain_s *kc, const flat_s *f)
+{
+	static char buf[1 << 20];
+	size_t ofs, len;
+
+	if (kchain_len(kc) != f->len)
+		return -1;
+	if (kchain_copy(kc, 0, buf, sizeof(buf)) != f->len)
+		return -1;
+	if (memcmp(buf, f->dat, f->len))
+		return -1;
+
+	ofs = f->len ? rand() % (f->len + 1) : 0;
+	len = rand() % (f->len - ofs + 1);
+	if (kchain_copy(kc, ofs, buf, len) != len)
+		return -1;
+	return memcmp(buf, f->dat + ofs, len) ? -1 : 0;
+}
+
+static int chain_test(unsigned int seg_size, int loop)
+{
+	kchain_s kc, hold;
+	flat_s f = { malloc(1), 0, 1 }, h = { malloc(1), 0, 1 };
+	char dat[256], str[512];
+	size_t ofs, len;
+	int i, j, op, ret = -1;
+
+	kchain_init(&kc, seg_size);
+	kchain_init(&hold, seg_size);
+
+	for (i = 0; i < loop; i++) {
+		len = rand() % sizeof(dat);
+		for (j = 0; j < len; j++)
+			dat[j] = (char)rand();
+
+		op = rand() % 7;
+		switch (op) {
+		case 0:
+			kchain_add(&kc, dat, len);
+			flat_put(&f, f.len, dat, len);
+			break;
+		case 1:
+			/* Often longer than the room of tail */
+			op = rand();
+			j = sprintf(str, "%d:%0*d", i, (int)len, op);
+			kchain_addf(&kc, "%d:%0*d", i, (int)len, op);
+			op = 1;
+			flat_put(&f, f.len, str, j);
+			break;
+		case 2:
+			kchain_prepend(&kc, dat, len);
+			flat_put(&f, 0, dat, len);
+			break;
+		case 3:
+			j = sprintf(str, "%x;", i);
+			kchain_prependf(&kc, "%x;", i);
+			flat_put(&f, 0, str, j);
+			break;
+		case 4:
+			/* Slice then append to both, the tail segment is shared */
+			kchain_release(&hold);
+			h.len = 0;
+			ofs = rand() % (f.len + 1);
+			len = rand() % (f.len - ofs + 1);
+			if (kchain_slice(&hold, &kc, ofs, len))
+				goto done;
+			flat_put(&h, 0, f.dat + ofs, len);
+
+			kchain_add(&hold, dat, sizeof(dat) / 2);
+			flat_put(&h, h.len, dat, sizeof(dat) / 2);
+			kchain_add(&kc, dat + 8, sizeof(dat) / 2);
+			flat_put(&f, f.len, dat + 8, sizeof(dat) / 2);
+			break;
+		case 5:
+			/* Across several entries */
+			len = f.len ? rand() % (f.len + 1) : 0;
+			kchain_drop(&kc, len);
+			f.len -= len;
+			memmove(f.dat, f.dat + len, f.len);
+			break;
+		case 6:
+			if (f.len < (256 << 10))
+				break;
+			kchain_drop(&kc, f.len);
+			f.len = 0;
+			break;
+		}
+
+		if (chain_check(&kc, &f) || chain_check(&hold, &h))
+			goto done;
+	}
+	ret = 0;
+
+done:
+	if (ret)
+		printf("loop %d, op %d: len %zu, flat %zu\n", i, op, kchain_len(&kc), f.len);
+	kchain_release(&kc);
+	kchain_release(&hold);
+	free(f.dat);
+	free(h.dat);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	static unsigned int sizes[] = { 1, 16, 100, KCHAIN_SEG_SIZE };
+	int i, err, ret = 0;
+
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		err = chain_test(sizes[i], 20000);
+		printf("seg_size %u: %s\n", sizes[i], err ? "FAIL" : "ok");
+		if (err)
+			ret = -1;
+	}
+
+	return ret;
+}
+#endif /* KCHAIN_TEST */
@@ -10,6 +10,8 @@
 #include <time.h>
 #include <sys/inotify.h>
 #include <execinfo.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <hilda/helper.h>
 #include <hilda/kmem.h>
@@ -18,6 +20,7 @@
 #include <hilda/karg.h>
 #include <hilda/klog.h>
 #include <hilda/kbuf.h>
+#include <hilda/sdlist.h>
 
 extern ssize_t getline(char **lineptr, size_t *n, FILE *stream);
 
@@ -28,18 +31,39 @@ static char *get_execpath(int *size);
 static char *get_basename(char *name);
 static char *get_progname();
 
-static unsigned int __dft_mask = KLOG_ALL;
+static unsigned int __dft_mask = KLOG_ALL_DFT;
+
+static unsigned long long mono_usec(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec * 1000000ULL + tp.tv_nsec / 1000;
+}
 
 /*-----------------------------------------------------------------------
  * Local definition:
  */
 
-/* STRing ARRay to save programe name, module name, file name etc */
-typedef struct _strarr_s strarr_s;
-struct _strarr_s {
-	int size;
-	int cnt;
-	char **arr;
+/*
+ * STRing TABle to intern programe name, module name, file name etc.
+ *
+ * Open addressing hash. Lookup is lock free, insert is within cc->mutex.
+ * A slot is filled by setting hash then str, and never changed. The table
+ * is replaced when half full, the old one is kept until cleanup because
+ * a reader may still be walking it.
+ */
+typedef struct _strslot_s strslot_s;
+struct _strslot_s {
+	unsigned int hash;
+	char *str;
+};
+
+typedef struct _strtab_s strtab_s;
+struct _strtab_s {
+	strtab_s *old;
+	unsigned int size, cnt;
+	strslot_s slots[0];
 };
 
 typedef struct _rule_s rule_s;
@@ -49,7 +73,7 @@ struct _rule_s {
 	/* 0 is know care */
 	/* -1 is all */
 
-	/* XXX: the prog modu file func is return from strarr_add */
+	/* XXX: the prog modu file func is return from strtab_add */
 	char *prog;	/* Program command line */
 	char *modu;	/* Module name */
 	char *file;	/* File name */
@@ -61,6 +85,18 @@ struct _rule_s {
 
 	/* Which flag to be set or clear */
 	unsigned int set, clr;
+
+	/* Lines per second and burst, -1 is not care, 0 is no limit */
+	int rate, burst;
+
+	/* Drop the repeated lines, -1 is not care */
+	int dedup;
+};
+
+/* What the rules say about rate limit and dedup, see site_limit */
+typedef struct _rulelim_s rulelim_s;
+struct _rulelim_s {
+	unsigned int rate, burst, dedup;
 };
 
 typedef struct _rulearr_s rulearr_s;
@@ -70,9 +106,147 @@ struct _rulearr_s {
 	rule_s *arr;
 };
 
-/* How many logger slot */
-#define MAX_NLOGGER 8
-#define MAX_RLOGGER 8
+/*
+ * Compiled rules.
+ *
+ * Rules are indexed by the most specific name they have: func, file, modu
+ * then prog. A call site only walks the rules indexed by its own names
+ * plus the rules without any name, in the original order.
+ */
+typedef struct _ruleslot_s ruleslot_s;
+struct _ruleslot_s {
+	char *key;
+	unsigned int beg, cnt;
+};
+
+typedef struct _ruleidx_s ruleidx_s;
+struct _ruleidx_s {
+	/* Built for this touches */
+	int touches;
+
+	unsigned int size;
+	ruleslot_s *slots;
+
+	/* Rule position in arr_rule, grouped by slot, then the no name ones */
+	unsigned int *ids;
+	unsigned int any_beg, any_cnt;
+};
+
+/* Time stamp of a log, only the fields asked by mask are filled */
+typedef struct _klog_ts_s klog_ts_s;
+struct _klog_ts_s {
+	unsigned long tick;		/* KLOG_RTM, KLOG_ATM: realtime in MS */
+	time_t t;			/* KLOG_ATM */
+	unsigned long long usec;	/* KLOG_UTM: monotonic from init */
+};
+
+/* Asynchronous mode, see klog_async_start */
+typedef struct _klog_ring_s klog_ring_s;
+typedef struct _klog_async_s klog_async_s;
+
+#define REC_ALIGN(x)    (((x) + 7) & ~7U)
+#define REC_PAD         0x80000000
+
+#define BATCH_SIZE      (64 * 1024)
+#define BATCH_ENTS      4096
+
+typedef struct _klog_rec_s klog_rec_s;
+struct _klog_rec_s {
+	/* Size of this record, or REC_PAD | size to skip to the ring end */
+	unsigned int len;
+	unsigned int mask;
+
+	unsigned char type;
+	int ln;
+	int msglen;
+
+	unsigned long tid;
+	klog_ts_s ts;
+
+	char *prog, *modu, *file, *func;
+
+	char msg[0];
+};
+
+typedef struct _batch_ent_s batch_ent_s;
+struct _batch_ent_s {
+	int ofs;
+	unsigned int level;
+};
+
+struct _klog_ring_s {
+	K_dlist_entry entry;
+
+	/* head only moved by the owner, tail only moved by the writer */
+	unsigned int head, tail;
+	unsigned int size;
+
+	/* Owner thread exited, free it after drained */
+	int dead;
+
+	char *buf;
+};
+
+struct _klog_async_s {
+	int running;
+	int quit;
+
+	int policy;
+	unsigned int ring_size;
+	unsigned int flush_ms;
+
+	unsigned long dropped;
+	unsigned long truncated;
+
+	SPL_HANDLE thread;
+	SPL_HANDLE sem;
+
+	/* Protect rings */
+	SPL_HANDLE mutex;
+	K_dlist_entry rings;
+
+	pthread_key_t key;
+
+	char *batch;
+	int batch_len;
+
+	/* Lines in batch, for the loggers not want all the levels */
+	batch_ent_s *ents;
+	int ent_cnt;
+};
+
+/* Binary mode, see klog_bin_start */
+typedef struct _klog_bin_s klog_bin_s;
+struct _klog_bin_s {
+	SPL_HANDLE mutex;
+	FILE *fp;
+
+	/* Keys of the strings already in file, 0 is empty slot */
+	unsigned long long *keys;
+	unsigned int key_size, key_cnt;
+};
+
+/*
+ * Registered loggers. A set is never changed after published, add or
+ * delete build a new one, see loggers_replace.
+ */
+typedef struct _logger_s logger_s;
+struct _logger_s {
+	void *fn;
+
+	/* Only the levels in mask, KLOG_TYPE_ALL part, are sent to it */
+	unsigned int mask;
+};
+
+typedef struct _loggers_s loggers_s;
+struct _loggers_s {
+	int cnt;
+
+	/* OR of all the masks */
+	unsigned int mask;
+
+	logger_s arr[0];
+};
 
 /* Control Center for klog */
 typedef struct _klogcc_s klogcc_s;
@@ -82,18 +256,32 @@ struct _klogcc_s {
 
 	pid_t pid;
 
+	/* Base of KLOG_UTM */
+	unsigned long long utm_base;
+
 	SPL_HANDLE mutex;
 
-	strarr_s arr_file_name;
-	strarr_s arr_modu_name;
-	strarr_s arr_prog_name;
-	strarr_s arr_func_name;
+	strtab_s *tab_file_name;
+	strtab_s *tab_modu_name;
+	strtab_s *tab_prog_name;
+	strtab_s *tab_func_name;
 
 	rulearr_s arr_rule;
+	ruleidx_s *ridx;
+
+	/* touches of last rule delete or clear, see klog_recalc_mask */
+	int rule_base;
+
+	/* Readers take no lock, see loggers_enter */
+	loggers_s *nloggers, *rloggers;
+	unsigned int lgr_epoch;
+	int lgr_readers[2];
 
-	unsigned char nlogger_cnt, rlogger_cnt;
-	KNLOGGER nloggers[MAX_NLOGGER];
-	KRLOGGER rloggers[MAX_RLOGGER];
+	/* Serialize the logger writers */
+	SPL_HANDLE lgr_mutex;
+
+	klog_async_s *async;
+	klog_bin_s *bin;
 };
 
 static klogcc_s *__g_klogcc = NULL;
@@ -112,72 +300,205 @@ static void *klog_cc(void)
 /*-----------------------------------------------------------------------
  * klog-logger
  */
-int klog_add_logger(KNLOGGER logger)
+/*
+ * A reader counts itself into lgr_readers[epoch & 1] before load the set.
+ * A writer publishes the new set, flips the epoch and waits the readers
+ * of old epoch gone, then no one can still see the old set.
+ *
+ * The epoch is checked again after counted: a writer flipped between the
+ * sample and the count did not wait for this reader, and the next writer
+ * waits the other counter, so the reader must retry with the new epoch.
+ *
+ * XXX: Never add or delete logger inside a logger, it waits itself.
+ */
+static kinline int loggers_enter(klogcc_s *cc)
+{
+	unsigned int epoch;
+	int e;
+
+	for (;;) {
+		epoch = __atomic_load_n(&cc->lgr_epoch, __ATOMIC_SEQ_CST);
+		e = epoch & 1;
+
+		__atomic_add_fetch(&cc->lgr_readers[e], 1, __ATOMIC_SEQ_CST);
+		if (likely(__atomic_load_n(&cc->lgr_epoch, __ATOMIC_SEQ_CST) == epoch))
+			return e;
+		__atomic_sub_fetch(&cc->lgr_readers[e], 1, __ATOMIC_RELEASE);
+	}
+}
+
+static kinline void loggers_leave(klogcc_s *cc, int e)
+{
+	__atomic_sub_fetch(&cc->lgr_readers[e], 1, __ATOMIC_RELEASE);
+}
+
+static kinline loggers_s *loggers_get(loggers_s **pset)
+{
+	return __atomic_load_n(pset, __ATOMIC_SEQ_CST);
+}
+
+/* XXX: should be called within cc->lgr_mutex */
+static void loggers_replace(klogcc_s *cc, loggers_s **pset, loggers_s *set)
+{
+	loggers_s *old = *pset;
+	int e;
+
+	__atomic_store_n(pset, set, __ATOMIC_SEQ_CST);
+
+	e = __atomic_fetch_add(&cc->lgr_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+	while (__atomic_load_n(&cc->lgr_readers[e], __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	kmem_free_s(old);
+}
+
+static loggers_s *loggers_dup(loggers_s *old, int cnt)
+{
+	loggers_s *set;
+
+	set = (loggers_s*)kmem_alloz(sizeof(loggers_s) +
+			cnt * sizeof(logger_s), char);
+	if (old) {
+		set->cnt = old->cnt < cnt ? old->cnt : cnt;
+		memcpy(set->arr, old->arr, set->cnt * sizeof(logger_s));
+	}
+	return set;
+}
+
+static void loggers_calc(loggers_s *set)
 {
-	klogcc_s *cc = (klogcc_s*)klog_cc();
 	int i;
 
-	for (i = 0; i < MAX_NLOGGER; i++)
-		if (cc->nloggers[i] == logger)
-			return 0;
+	set->mask = 0;
+	for (i = 0; i < set->cnt; i++)
+		set->mask |= set->arr[i].mask;
+}
+
+/* Add or update mask if already there */
+static int loggers_add(klogcc_s *cc, loggers_s **pset, void *fn,
+		unsigned int mask)
+{
+	loggers_s *old, *set;
+	int i, cnt;
+
+	spl_mutex_lock(cc->lgr_mutex);
+
+	old = *pset;
+	cnt = old ? old->cnt : 0;
+
+	for (i = 0; i < cnt; i++)
+		if (old->arr[i].fn == fn)
+			break;
+
+	if (i < cnt && old->arr[i].mask == mask) {
+		spl_mutex_unlock(cc->lgr_mutex);
+		return 0;
+	}
+
+	set = loggers_dup(old, i < cnt ? cnt : cnt + 1);
+	if (i == cnt)
+		set->cnt++;
+	set->arr[i].fn = fn;
+	set->arr[i].mask = mask;
+	loggers_calc(set);
+
+	loggers_replace(cc, pset, set);
+
+	spl_mutex_unlock(cc->lgr_mutex);
+	return 0;
+}
+
+static int loggers_del(klogcc_s *cc, loggers_s **pset, void *fn)
+{
+	loggers_s *old, *set;
+	int i, cnt;
 
-	if (cc->nlogger_cnt >= MAX_NLOGGER) {
-		wlogf("klog_add_logger: Only up to %d logger supported.\n", MAX_NLOGGER);
+	spl_mutex_lock(cc->lgr_mutex);
+
+	old = *pset;
+	cnt = old ? old->cnt : 0;
+
+	for (i = 0; i < cnt; i++)
+		if (old->arr[i].fn == fn)
+			break;
+
+	if (i == cnt) {
+		spl_mutex_unlock(cc->lgr_mutex);
 		return -1;
 	}
 
-	cc->nloggers[cc->nlogger_cnt++] = logger;
+	set = loggers_dup(old, cnt);
+	set->cnt--;
+	memmove(&set->arr[i], &old->arr[i + 1], (cnt - i - 1) * sizeof(logger_s));
+	loggers_calc(set);
+
+	loggers_replace(cc, pset, set);
+
+	spl_mutex_unlock(cc->lgr_mutex);
 	return 0;
 }
 
-int klog_del_logger(KNLOGGER logger)
+/* Level bit of the type char, all for the unknown types, e.g. '!' */
+static kinline unsigned int type_level(unsigned char type)
+{
+	switch (type) {
+	case 'F': return KLOG_FATAL;
+	case 'A': return KLOG_ALERT;
+	case 'C': return KLOG_CRIT;
+	case 'E': return KLOG_ERR;
+	case 'W': return KLOG_WARNING;
+	case 'N': return KLOG_NOTICE;
+	case 'I': return KLOG_INFO;
+	case 'D': return KLOG_DEBUG;
+	default: return KLOG_TYPE_ALL;
+	}
+}
+
+/**
+ * \brief Add a normal logger.
+ *
+ * \param mask Levels, KLOG_FATAL ... KLOG_DEBUG, the logger wants, the
+ *        others are not formatted for it.
+ */
+int klog_add_logger_ex(KNLOGGER logger, unsigned int mask)
 {
 	klogcc_s *cc = (klogcc_s*)klog_cc();
-	int i;
 
-	for (i = 0; i < cc->nlogger_cnt; i++)
-		if (cc->nloggers[i] == logger) {
-			cc->nlogger_cnt--;
-			cc->nloggers[i] = cc->nloggers[cc->nlogger_cnt];
-			cc->nloggers[cc->nlogger_cnt] = NULL;
-			return 0;
-		}
+	return loggers_add(cc, &cc->nloggers, (void*)logger, mask & KLOG_TYPE_ALL);
+}
 
-	return -1;
+int klog_add_logger(KNLOGGER logger)
+{
+	return klog_add_logger_ex(logger, KLOG_TYPE_ALL);
 }
 
-int klog_add_rlogger(KRLOGGER logger)
+/**
+ * \brief Delete a logger, when return, the logger is no longer called.
+ */
+int klog_del_logger(KNLOGGER logger)
 {
 	klogcc_s *cc = (klogcc_s*)klog_cc();
-	int i;
 
-	for (i = 0; i < MAX_RLOGGER; i++)
-		if (cc->rloggers[i] == logger)
-			return 0;
+	return loggers_del(cc, &cc->nloggers, (void*)logger);
+}
 
-	if (cc->rlogger_cnt >= MAX_RLOGGER) {
-		wlogf("klog_add_logger: Only up to %d logger supported.\n", MAX_RLOGGER);
-		return -1;
-	}
+int klog_add_rlogger_ex(KRLOGGER logger, unsigned int mask)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
 
-	cc->rloggers[cc->rlogger_cnt++] = logger;
-	return 0;
+	return loggers_add(cc, &cc->rloggers, (void*)logger, mask & KLOG_TYPE_ALL);
+}
+
+int klog_add_rlogger(KRLOGGER logger)
+{
+	return klog_add_rlogger_ex(logger, KLOG_TYPE_ALL);
 }
 
 int klog_del_rlogger(KRLOGGER logger)
 {
 	klogcc_s *cc = (klogcc_s*)klog_cc();
-	int i;
-
-	for (i = 0; i < cc->rlogger_cnt; i++)
-		if (cc->rloggers[i] == logger) {
-			cc->rlogger_cnt--;
-			cc->rloggers[i] = cc->rloggers[cc->rlogger_cnt];
-			cc->rloggers[cc->rlogger_cnt] = NULL;
-			return 0;
-		}
 
-	return -1;
+	return loggers_del(cc, &cc->rloggers, (void*)logger);
 }
 
 /*-----------------------------------------------------------------------
@@ -199,27 +520,20 @@ void *klog_attach(void *logcc)
 static char *get_execpath(int *size)
 {
 	kbuf_s kb;
-	FILE *fp;
 	char buff[256];
-	int err = 0;
 	char *path = NULL;
 
 	sprintf(buff, "/proc/%d/cmdline", getpid());
-	fp = fopen(buff, "rt");
-	if (fp) {
-		kbuf_init(&kb, 0);
-
-		while (kbuf_fread(&kb, 1024, fp, &err) > 0 && !err)
-			;
-		fclose(fp);
-
+	kbuf_init(&kb, 0);
+	if (!kbuf_load_file(&kb, buff)) {
 		if (size)
 			*size = kb.len;
-		kb.buf[kb.len] = '\0';
 
+		/* Not NULL even if empty */
+		kbuf_grow(&kb, 0);
 		path = kbuf_detach(&kb, NULL);
-		kbuf_release(&kb);
 	}
+	kbuf_release(&kb);
 
 	return path;
 }
@@ -237,7 +551,7 @@ static void klog_init_default()
 
 	cl_buf = get_execpath(&cl_size);
 	karg_build_nul(cl_buf, cl_size, &argc, &argv);
-	kmem_free(cl_buf);
+	free(cl_buf);
 
 	klog_init(argc, argv);
 	karg_free(argc, argv);
@@ -250,17 +564,33 @@ char *klog_info(void) {
 	klogcc_s *cc = (klogcc_s*)klog_cc();
 
 	ofs += sprintf(&buf[ofs], "cc: %p", cc);
-	ofs += sprintf(&buf[ofs], "nlogger_cnt: %d", cc->nlogger_cnt);
-	ofs += sprintf(&buf[ofs], "rlogger_cnt: %d", cc->rlogger_cnt);
+	ofs += sprintf(&buf[ofs], "nlogger_cnt: %d",
+			cc->nloggers ? cc->nloggers->cnt : 0);
+	ofs += sprintf(&buf[ofs], "rlogger_cnt: %d",
+			cc->rloggers ? cc->rloggers->cnt : 0);
+	if (cc->async)
+		ofs += sprintf(&buf[ofs], "async: %d, dropped: %lu, truncated: %lu",
+				cc->async->running, cc->async->dropped,
+				cc->async->truncated);
 
 	return (char*)buf;
 }
 
+static void sites_refresh(rule_s *rule);
+
 void klog_touch(void)
 {
 	klogcc_s *cc = (klogcc_s*)klog_cc();
 
 	cc->touches++;
+	sites_refresh(NULL);
+}
+
+/* Only the sites matched by the rule added or deleted are updated */
+static void rule_touch(klogcc_s *cc, rule_s *rule)
+{
+	cc->touches++;
+	sites_refresh(rule);
 }
 int klog_touches(void)
 {
@@ -281,7 +611,7 @@ static char *get_basename(char *name)
 
 	bn = bn ? strdup(bn) : strdup("");
 
-	kmem_free_s(dupname);
+	free(dupname);
 
 	return bn;
 }
@@ -300,8 +630,8 @@ static char *get_progname()
 	if (execpath) {
 		execname = get_basename(execpath);
 		strncpy(prog_name_buff, execname, sizeof(prog_name_buff));
-		kmem_free(execpath);
-		kmem_free(execname);
+		free(execpath);
+		free(execname);
 	} else
 		snprintf(prog_name_buff, sizeof(prog_name_buff) - 1,
 				"PROG-%d", (int)getpid());
@@ -425,6 +755,33 @@ static void process_cfg(int argc, char *argv[])
 		cfg = getenv("KLOG_RTCFG");
 	if (cfg)
 		spl_thread_create(thread_monitor_cfgfile, strdup(cfg), 0);
+
+	/*
+	 * 3. Asynchronous mode, "drop" or "block" when ring full
+	 */
+	cfg = NULL;
+	i = karg_find(argc, argv, "--klog-async", 1);
+	if (i > 0)
+		cfg = argv[i + 1];
+
+	if (!cfg)
+		cfg = getenv("KLOG_ASYNC");
+	if (cfg)
+		klog_async_start(0, strcmp(cfg, "block") ? KLOG_ASYNC_DROP :
+				KLOG_ASYNC_BLOCK, 0);
+
+	/*
+	 * 4. Binary mode, decode it by tools/klogbin.py
+	 */
+	cfg = NULL;
+	i = karg_find(argc, argv, "--klog-bin", 1);
+	if (i > 0)
+		cfg = argv[i + 1];
+
+	if (!cfg)
+		cfg = getenv("KLOG_BIN");
+	if (cfg)
+		klog_bin_start(cfg);
 }
 
 static void rule_add_from_mask(unsigned int mask)
@@ -456,6 +813,8 @@ static void rule_add_from_mask(unsigned int mask)
 		rule[i++] = 's';
 	if (mask & KLOG_ATM)
 		rule[i++] = 'S';
+	if (mask & KLOG_UTM)
+		rule[i++] = 'u';
 
 	if (mask & KLOG_PID)
 		rule[i++] = 'j';
@@ -482,28 +841,26 @@ void klog_set_default_mask(unsigned int mask)
 	__dft_mask = mask;
 }
 
+static void strtab_free(strtab_s *tab);
+
 static void klog_cleanup()
 {
 	klogcc_s *cc = (klogcc_s*)klog_cc();
-	int i;
-
-	for (i = 0; i < cc->arr_file_name.cnt; i++)
-		kmem_free_s((void*)cc->arr_file_name.arr[i]);
-	kmem_free_s((void*)cc->arr_file_name.arr);
 
-	for (i = 0; i < cc->arr_modu_name.cnt; i++)
-		kmem_free_s((void*)cc->arr_modu_name.arr[i]);
-	kmem_free_s((void*)cc->arr_modu_name.arr);
+	klog_async_stop();
+	klog_bin_stop();
 
-	for (i = 0; i < cc->arr_prog_name.cnt; i++)
-		kmem_free_s((void*)cc->arr_prog_name.arr[i]);
-	kmem_free_s((void*)cc->arr_prog_name.arr);
-
-	for (i = 0; i < cc->arr_func_name.cnt; i++)
-		kmem_free_s((void*)cc->arr_func_name.arr[i]);
-	kmem_free_s((void*)cc->arr_func_name.arr);
+	strtab_free(cc->tab_file_name);
+	strtab_free(cc->tab_modu_name);
+	strtab_free(cc->tab_prog_name);
+	strtab_free(cc->tab_func_name);
 
 	kmem_free_s((void*)cc->arr_rule.arr);
+	if (cc->ridx) {
+		kmem_free_s(cc->ridx->slots);
+		kmem_free_s(cc->ridx->ids);
+		kmem_free_z(cc->ridx);
+	}
 }
 
 void *klog_init(int argc, char **argv)
@@ -517,7 +874,9 @@ void *klog_init(int argc, char **argv)
 	__g_klogcc = cc;
 
 	cc->mutex = spl_mutex_create();
+	cc->lgr_mutex = spl_mutex_create();
 	cc->pid = getpid();
+	cc->utm_base = mono_usec();
 
 	/* Set default before configure file */
 	if (__dft_mask)
@@ -532,35 +891,39 @@ void *klog_init(int argc, char **argv)
 	return (void*)__g_klogcc;
 }
 
-int klog_vf(unsigned char type, unsigned int mask, char *prog, char *modu,
-		char *file, char *func, int ln, const char *fmt, va_list ap)
+static void klog_now(klogcc_s *cc, unsigned int mask, klog_ts_s *ts)
 {
-	klogcc_s *cc = (klogcc_s*)klog_cc();
-	va_list ap_copy0, ap_copy1;
-
-	char buffer[4096], *bufptr = buffer;
-	int i, ret, ofs, bufsize = sizeof(buffer);
+	struct timespec tp;
 
-	char tmbuf[128];
-	time_t t;
-	struct tm *tmp;
+	if (mask & (KLOG_RTM | KLOG_ATM)) {
+		/* ATM only shows MS, the coarse one is good enough and cheaper */
+		if (mask & KLOG_RTM)
+			clock_gettime(CLOCK_REALTIME, &tp);
+		else
+			clock_gettime(CLOCK_REALTIME_COARSE, &tp);
 
-	unsigned long tick = 0;
-
-	for (i = 0; i < cc->rlogger_cnt; i++)
-		if (cc->rloggers[i]) {
-			va_copy(ap_copy1, ap);
-			cc->rloggers[i](type, mask, prog, modu, file, func, ln, fmt, ap_copy1);
-			va_end(ap_copy1);
-		}
+		ts->t = tp.tv_sec;
+		ts->tick = tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+	}
 
-	if (unlikely(!cc->nlogger_cnt))
-		return 0;
+	if (mask & KLOG_UTM)
+		ts->usec = mono_usec() - cc->utm_base;
+}
 
-	if (mask & (KLOG_RTM | KLOG_ATM))
-		tick = spl_get_ticks();
+/* Rendered "S:YYYY/mm/dd HH:MM:SS." of the last second seen by thread */
+static kthread_local struct {
+	time_t sec;
+	int len;
+	char str[32];
+} __t_atm = { -1, 0, "" };
 
-	ofs = 0;
+static int fmt_prefix(char *bufptr, unsigned char type, unsigned int mask,
+		pid_t pid, unsigned long tid, klog_ts_s *ts,
+		char *prog, char *modu, char *file, char *func, int ln)
+{
+	struct tm tmp;
+	unsigned int ms;
+	int ofs = 0;
 
 	/* Type */
 	if (likely(type)) {
@@ -598,19 +961,32 @@ int klog_vf(unsigned char type, unsigned int mask, char *prog, char *modu,
 
 	/* Time */
 	if (mask & KLOG_RTM)
-		ofs += sprintf(bufptr + ofs, "s:%lu|", tick);
+		ofs += sprintf(bufptr + ofs, "s:%lu|", ts->tick);
+	if (mask & KLOG_UTM)
+		ofs += sprintf(bufptr + ofs, "u:%llu|", ts->usec);
 	if (mask & KLOG_ATM) {
-		t = time(NULL);
-		tmp = localtime(&t);
-		strftime(tmbuf, sizeof(tmbuf), "%Y/%m/%d %H:%M:%S", tmp);
-		ofs += sprintf(bufptr + ofs, "S:%s.%03d|", tmbuf, (unsigned int)(tick % 1000));
+		if (unlikely(__t_atm.sec != ts->t)) {
+			localtime_r(&ts->t, &tmp);
+			__t_atm.len = strftime(__t_atm.str, sizeof(__t_atm.str),
+					"S:%Y/%m/%d %H:%M:%S.", &tmp);
+			__t_atm.sec = ts->t;
+		}
+		memcpy(bufptr + ofs, __t_atm.str, __t_atm.len);
+		ofs += __t_atm.len;
+
+		ms = (unsigned int)(ts->tick % 1000);
+		bufptr[ofs++] = '0' + ms / 100;
+		bufptr[ofs++] = '0' + ms / 10 % 10;
+		bufptr[ofs++] = '0' + ms % 10;
+		bufptr[ofs++] = '|';
+		bufptr[ofs] = '\0';
 	}
 
 	/* ID */
 	if (mask & KLOG_PID)
-		ofs += sprintf(bufptr + ofs, "j:%d|", (int)cc->pid);
+		ofs += sprintf(bufptr + ofs, "j:%d|", (int)pid);
 	if (mask & KLOG_TID)
-		ofs += sprintf(bufptr + ofs, "x:%x|", (int)(long)spl_thread_current());
+		ofs += sprintf(bufptr + ofs, "x:%x|", (int)tid);
 
 	/* Name and LINE */
 	if ((mask & KLOG_PROG) && prog)
@@ -631,6 +1007,67 @@ int klog_vf(unsigned char type, unsigned int mask, char *prog, char *modu,
 	if (likely(ofs))
 		ofs += sprintf(bufptr + ofs, " ");
 
+	return ofs;
+}
+
+/* Logs from the writer thread itself are always synchronous */
+static kthread_local int __t_async_writer = 0;
+
+static int klog_async_put(klog_async_s *as, unsigned char type,
+		unsigned int mask, char *prog, char *modu, char *file,
+		char *func, int ln, const char *fmt, va_list ap);
+static int klog_bin_put(klog_bin_s *bin, unsigned char type,
+		unsigned int mask, char *prog, char *modu, char *file,
+		char *func, int ln, const char *fmt, va_list ap);
+
+int klog_vf(unsigned char type, unsigned int mask, char *prog, char *modu,
+		char *file, char *func, int ln, const char *fmt, va_list ap)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
+	loggers_s *rl, *nl;
+	va_list ap_copy0, ap_copy1;
+
+	char buffer[4096], *bufptr = buffer;
+	int i, e, ret = 0, ofs, bufsize = sizeof(buffer);
+	unsigned int level = type_level(type);
+
+	klog_ts_s ts;
+
+	e = loggers_enter(cc);
+
+	rl = loggers_get(&cc->rloggers);
+	if (rl && (rl->mask & level))
+		for (i = 0; i < rl->cnt; i++)
+			if (rl->arr[i].mask & level) {
+				va_copy(ap_copy1, ap);
+				((KRLOGGER)rl->arr[i].fn)(type, mask, prog, modu,
+						file, func, ln, fmt, ap_copy1);
+				va_end(ap_copy1);
+			}
+
+	if (cc->bin && cc->bin->fp) {
+		loggers_leave(cc, e);
+		return klog_bin_put(cc->bin, type, mask, prog, modu,
+				file, func, ln, fmt, ap);
+	}
+
+	/* No one wants it, skip the format */
+	nl = loggers_get(&cc->nloggers);
+	if (unlikely(!nl || !(nl->mask & level)))
+		goto done;
+
+	if (cc->async && cc->async->running && likely(!__t_async_writer)) {
+		loggers_leave(cc, e);
+		return klog_async_put(cc->async, type, mask, prog, modu,
+				file, func, ln, fmt, ap);
+	}
+
+	klog_now(cc, mask, &ts);
+
+	ofs = fmt_prefix(bufptr, type, mask, cc->pid,
+			(unsigned long)spl_thread_current(), &ts,
+			prog, modu, file, func, ln);
+
 	va_copy(ap_copy0, ap);
 	ret = vsnprintf(bufptr + ofs, bufsize - ofs, fmt, ap_copy0);
 	va_end(ap_copy0);
@@ -644,12 +1081,15 @@ int klog_vf(unsigned char type, unsigned int mask, char *prog, char *modu,
 
 	ret += ofs;
 
-	for (i = 0; i < cc->nlogger_cnt; i++)
-		if (cc->nloggers[i])
-			cc->nloggers[i](bufptr, ret);
+	for (i = 0; i < nl->cnt; i++)
+		if (nl->arr[i].mask & level)
+			((KNLOGGER)nl->arr[i].fn)(bufptr, ret);
 
 	if (bufptr != buffer)
 		kmem_free(bufptr);
+
+done:
+	loggers_leave(cc, e);
 	return ret;
 }
 
@@ -666,310 +1106,1759 @@ int klog_f(unsigned char type, unsigned int mask, char *prog, char *modu,
 	return ret;
 }
 
-static int strarr_find(strarr_s *sa, char *str)
-{
-	int i;
+/*-----------------------------------------------------------------------
+ * Asynchronous mode
+ *
+ * Every logging thread owns a single producer, single consumer ring. The
+ * caller only formats the message body into its ring, the prefix and the
+ * nloggers are done by the writer thread, one nlogger call per batch, or
+ * per run of wanted lines for the logger with a level mask.
+ */
+static kthread_local klog_ring_s *__t_ring = NULL;
 
-	if (unlikely(!str))
-		return -1;
+/* End of a line cut to fit the ring, counted by klog_async_truncated */
+#define TRUNC_MARK      "...(truncated)\n"
+
+static void ring_release(void *ua)
+{
+	klog_ring_s *ring = (klog_ring_s*)ua;
 
-	for (i = 0; i < sa->cnt; i++)
-		if (sa->arr[i] && !strcmp(sa->arr[i], str))
-			return i;
-	return -1;
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
 }
 
-static char *strarr_add(strarr_s *sa, char *str)
+static klog_ring_s *ring_get(klog_async_s *as)
 {
-	int pos = strarr_find(sa, str);
+	klog_ring_s *ring = __t_ring;
 
-	if (pos != -1)
-		return sa->arr[pos];
+	if (likely(ring))
+		return ring;
 
-	if (sa->cnt >= sa->size)
-		ARR_INC(256, sa->arr, sa->size, char*);
+	ring = (klog_ring_s*)kmem_alloz(1, klog_ring_s);
+	ring->size = as->ring_size;
+	ring->buf = kmem_alloc(ring->size, char);
 
-	sa->arr[sa->cnt] = strdup(str);
-	sa->cnt++;
+	spl_mutex_lock(as->mutex);
+	kdlist_insert_tail_entry(&as->rings, &ring->entry);
+	spl_mutex_unlock(as->mutex);
 
-	/* Return the position been inserted */
-	return sa->arr[sa->cnt - 1];
+	pthread_setspecific(as->key, ring);
+	__t_ring = ring;
+
+	return ring;
 }
 
-char *klog_file_name_add(char *name)
+static int klog_async_put(klog_async_s *as, unsigned char type,
+		unsigned int mask, char *prog, char *modu, char *file,
+		char *func, int ln, const char *fmt, va_list ap)
 {
-	klogcc_s *cc = (klogcc_s*)klog_cc();
-	char *newstr, *newname = get_basename(name);
+	klog_ring_s *ring = ring_get(as);
+	klog_rec_s *rec;
+	va_list ap_copy;
+
+	char buffer[4096], *msg = buffer;
+	int msglen, maxlen, trunc = 0;
+	unsigned int need, pad, pos, head, tail;
+
+	va_copy(ap_copy, ap);
+	msglen = vsnprintf(buffer, sizeof(buffer), fmt, ap_copy);
+	va_end(ap_copy);
+	if (unlikely(msglen < 0))
+		return 0;
 
-	spl_mutex_lock(cc->mutex);
-	newstr = strarr_add(&cc->arr_file_name, newname);
-	spl_mutex_unlock(cc->mutex);
+	/* Limit the record size, so the writer can take it in one batch */
+	maxlen = (ring->size < BATCH_SIZE ? ring->size : BATCH_SIZE) / 4;
+	if (msglen > maxlen) {
+		msglen = maxlen;
+		trunc = 1;
+	}
+	if (msglen > sizeof(buffer) - 1) {
+		msg = kmem_alloc(msglen + 1, char);
+		vsnprintf(msg, msglen + 1, fmt, ap);
+	}
+	if (unlikely(trunc)) {
+		memcpy(msg + msglen - (sizeof(TRUNC_MARK) - 1), TRUNC_MARK,
+				sizeof(TRUNC_MARK) - 1);
+		__atomic_add_fetch(&as->truncated, 1, __ATOMIC_RELAXED);
+	}
 
-	free(newname);
+	need = REC_ALIGN(sizeof(klog_rec_s) + msglen + 1);
 
-	return newstr;
-}
-char *klog_modu_name_add(char *name)
+	for (;;) {
+		head = ring->head;
+		tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+		pos = head & (ring->size - 1);
+		pad = (ring->size - pos < need) ? ring->size - pos : 0;
+
+		if (ring->size - (head - tail) >= need + pad)
+			break;
+
+		if (as->policy != KLOG_ASYNC_BLOCK || !as->running) {
+			__atomic_add_fetch(&as->dropped, 1, __ATOMIC_RELAXED);
+			msglen = 0;
+			goto done;
+		}
+
+		spl_sema_rel(as->sem);
+		spl_sleep(1);
+	}
+
+	if (pad) {
+		*(unsigned int*)(ring->buf + pos) = REC_PAD | pad;
+		pos = 0;
+	}
+
+	rec = (klog_rec_s*)(ring->buf + pos);
+	rec->len = need;
+	rec->mask = mask;
+	rec->type = type;
+	rec->ln = ln;
+	rec->msglen = msglen;
+	rec->tid = (unsigned long)spl_thread_current();
+	klog_now(__g_klogcc, mask, &rec->ts);
+	rec->prog = prog;
+	rec->modu = modu;
+	rec->file = file;
+	rec->func = func;
+	memcpy(rec->msg, msg, msglen);
+	rec->msg[msglen] = '\0';
+
+	__atomic_store_n(&ring->head, head + pad + need, __ATOMIC_RELEASE);
+
+	/* Kick the writer when cross half full, else wait the flush timer */
+	if (head - tail <= ring->size / 2 &&
+			head + pad + need - tail > ring->size / 2)
+		spl_sema_rel(as->sem);
+
+done:
+	if (msg != buffer)
+		kmem_free(msg);
+	return msglen;
+}
+
+/* Call logger with the lines it wants, adjacent lines in one call */
+static void batch_call(klog_async_s *as, logger_s *lgr)
+{
+	KNLOGGER fn = (KNLOGGER)lgr->fn;
+	int i, beg = -1, end;
+	char save;
+
+	if ((lgr->mask & KLOG_TYPE_ALL) == KLOG_TYPE_ALL) {
+		fn(as->batch, as->batch_len);
+		return;
+	}
+
+	for (i = 0; i <= as->ent_cnt; i++) {
+		if (i < as->ent_cnt && (as->ents[i].level & lgr->mask)) {
+			if (beg < 0)
+				beg = as->ents[i].ofs;
+			continue;
+		}
+		if (beg < 0)
+			continue;
+
+		end = i < as->ent_cnt ? as->ents[i].ofs : as->batch_len;
+		save = as->batch[end];
+		as->batch[end] = '\0';
+		fn(as->batch + beg, end - beg);
+		as->batch[end] = save;
+		beg = -1;
+	}
+}
+
+static void batch_flush(klog_async_s *as, klogcc_s *cc)
+{
+	loggers_s *nl;
+	int i, e;
+
+	if (!as->batch_len)
+		return;
+
+	as->batch[as->batch_len] = '\0';
+
+	e = loggers_enter(cc);
+	nl = loggers_get(&cc->nloggers);
+	if (nl)
+		for (i = 0; i < nl->cnt; i++)
+			batch_call(as, &nl->arr[i]);
+	loggers_leave(cc, e);
+
+	as->batch_len = 0;
+	as->ent_cnt = 0;
+}
+
+static void batch_add(klog_async_s *as, klogcc_s *cc, klog_rec_s *rec)
+{
+	char *p;
+
+	/* batch has 4K extra room for the prefix */
+	if (as->batch_len + rec->msglen + 2 > BATCH_SIZE ||
+			as->ent_cnt >= BATCH_ENTS)
+		batch_flush(as, cc);
+
+	as->ents[as->ent_cnt].ofs = as->batch_len;
+	as->ents[as->ent_cnt].level = type_level(rec->type);
+	as->ent_cnt++;
+
+	p = as->batch + as->batch_len;
+	p += fmt_prefix(p, rec->type, rec->mask, cc->pid, rec->tid,
+			&rec->ts, rec->prog, rec->modu,
+			rec->file, rec->func, rec->ln);
+	memcpy(p, rec->msg, rec->msglen);
+	p += rec->msglen;
+
+	/* Every line in batch should be ended with a '\n' */
+	if (p == as->batch + as->batch_len || p[-1] != '\n')
+		*p++ = '\n';
+
+	as->batch_len = p - as->batch;
+}
+
+static void async_drain(klog_async_s *as)
+{
+	klogcc_s *cc = __g_klogcc;
+	K_dlist_entry *entry;
+	klog_ring_s *ring;
+	klog_rec_s *rec;
+	unsigned int head, tail;
+	int dead;
+
+	spl_mutex_lock(as->mutex);
+
+	entry = as->rings.next;
+	while (entry != &as->rings) {
+		ring = FIELD_TO_STRUCTURE(entry, klog_ring_s, entry);
+		entry = entry->next;
+
+		dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		tail = ring->tail;
+
+		while (tail != head) {
+			rec = (klog_rec_s*)(ring->buf + (tail & (ring->size - 1)));
+			if (rec->len & REC_PAD) {
+				tail += rec->len & ~REC_PAD;
+				continue;
+			}
+			batch_add(as, cc, rec);
+			tail += rec->len;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		if (dead) {
+			kdlist_remove_entry(&ring->entry);
+			kmem_free(ring->buf);
+			kmem_free(ring);
+		}
+	}
+
+	spl_mutex_unlock(as->mutex);
+
+	batch_flush(as, cc);
+}
+
+static void *async_thread(void *ua)
+{
+	klog_async_s *as = (klog_async_s*)ua;
+
+	__t_async_writer = 1;
+
+	while (!as->quit) {
+		spl_sema_get(as->sem, as->flush_ms);
+		async_drain(as);
+	}
+	async_drain(as);
+
+	return NULL;
+}
+
+/**
+ * \brief Switch klog_vf to asynchronous mode.
+ *
+ * \param ring_size Size of the per-thread ring, rounded up to power of 2,
+ *        0 for 64K.
+ * \param policy KLOG_ASYNC_DROP or KLOG_ASYNC_BLOCK, what to do when the
+ *        ring is full.
+ * \param flush_ms Max delay in ms before a log reaches the nloggers,
+ *        0 for 100ms.
+ *
+ * rloggers are still called synchronously.
+ */
+int klog_async_start(unsigned int ring_size, int policy, unsigned int flush_ms)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
+	klog_async_s *as = cc->async;
+	unsigned int size = 16 * 1024;
+
+	if (!ring_size)
+		ring_size = 64 * 1024;
+	while (size < ring_size)
+		size <<= 1;
+
+	if (!as) {
+		as = (klog_async_s*)kmem_alloz(1, klog_async_s);
+
+		as->sem = spl_sema_new(0);
+		as->mutex = spl_mutex_create();
+		kdlist_init_head(&as->rings);
+		as->batch = kmem_alloc(BATCH_SIZE + 4096, char);
+		as->ents = kmem_alloc(BATCH_ENTS, batch_ent_s);
+		pthread_key_create(&as->key, ring_release);
+
+		cc->async = as;
+	}
+
+	as->policy = policy;
+	as->flush_ms = flush_ms ? flush_ms : 100;
+
+	if (as->running)
+		return 0;
+
+	/* Only for the rings created after now */
+	as->ring_size = size;
+	as->quit = 0;
+
+	as->thread = spl_thread_create(async_thread, (void*)as, 0);
+	if (!as->thread)
+		return -1;
+
+	as->running = 1;
+	return 0;
+}
+
+/**
+ * \brief Drain all the rings, stop the writer thread and back to
+ * synchronous mode.
+ */
+void klog_async_stop(void)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
+	klog_async_s *as = cc->async;
+
+	if (!as || !as->running)
+		return;
+
+	as->running = 0;
+	as->quit = 1;
+	spl_sema_rel(as->sem);
+
+	spl_thread_wait(as->thread);
+	as->thread = NULL;
+}
+
+unsigned long klog_async_dropped(void)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
+
+	return cc->async ? cc->async->dropped : 0;
+}
+
+unsigned long klog_async_truncated(void)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
+
+	return cc->async ? cc->async->truncated : 0;
+}
+
+/*-----------------------------------------------------------------------
+ * Binary mode
+ *
+ * Only the raw arguments are saved, tools/klogbin.py format them offline.
+ * All in native byte order:
+ *
+ * File:   "KLOGBIN1" u32:0x01020304 u32:pid
+ * String: 'S' u64:key u32:len bytes
+ * Log:    'L' u32:len u8:type u32:mask i32:line u64:usec u64:tid
+ *         u64:prog u64:modu u64:file u64:func u64:fmt args...
+ * Arg:    'i' i64 | 'u' u64 | 'f' f64 | 'p' u64 | 's' u32:len bytes
+ *
+ * Keys of prog, modu, file and func are their address, they are interned
+ * or literal. fmt is keyed by its content, it maybe built at runtime.
+ */
+#define BIN_MAGIC       "KLOGBIN1"
+#define BIN_FMT_KEY     0x8000000000000000ULL
+
+typedef struct _binenc_s binenc_s;
+struct _binenc_s {
+	char *buf;
+	int len, size;
+	char sbuf[2048];
+};
+
+static void enc_put(binenc_s *e, const void *dat, int len)
+{
+	int size;
+
+	if (unlikely(e->len + len > e->size)) {
+		size = (e->len + len) * 2;
+		if (e->buf == e->sbuf) {
+			e->buf = kmem_alloc(size, char);
+			memcpy(e->buf, e->sbuf, e->len);
+		} else
+			e->buf = kmem_realloc(e->buf, size);
+		e->size = size;
+	}
+
+	memcpy(e->buf + e->len, dat, len);
+	e->len += len;
+}
+
+static void enc_num(binenc_s *e, char tag, unsigned long long v)
+{
+	enc_put(e, &tag, 1);
+	enc_put(e, &v, 8);
+}
+
+static void enc_dbl(binenc_s *e, double v)
+{
+	enc_put(e, "f", 1);
+	enc_put(e, &v, 8);
+}
+
+static void enc_str(binenc_s *e, const char *str)
+{
+	unsigned int len;
+
+	if (!str)
+		str = "(null)";
+	len = strlen(str);
+
+	enc_put(e, "s", 1);
+	enc_put(e, &len, 4);
+	enc_put(e, str, len);
+}
+
+/* Walk the fmt like printf, and save the arguments by its type */
+static void enc_args(binenc_s *e, const char *fmt, va_list ap)
+{
+	const char *p = fmt;
+	int lm;
+
+	enum { LM_NONE, LM_HH, LM_H, LM_L, LM_LL, LM_LD, LM_J, LM_Z, LM_T };
+
+	while (*p) {
+		if (*p++ != '%')
+			continue;
+
+		/* Flags */
+		while (*p && strchr("-+ #0'", *p))
+			p++;
+
+		/* Width and precision */
+		if (*p == '*') {
+			enc_num(e, 'i', (long long)va_arg(ap, int));
+			p++;
+		} else
+			while (*p >= '0' && *p <= '9')
+				p++;
+		if (*p == '.') {
+			p++;
+			if (*p == '*') {
+				enc_num(e, 'i', (long long)va_arg(ap, int));
+				p++;
+			} else
+				while (*p >= '0' && *p <= '9')
+					p++;
+		}
+
+		/* Length modifier */
+		lm = LM_NONE;
+		switch (*p) {
+		case 'h':
+			lm = (p[1] == 'h') ? LM_HH : LM_H;
+			p += (lm == LM_HH) ? 2 : 1;
+			break;
+		case 'l':
+			lm = (p[1] == 'l') ? LM_LL : LM_L;
+			p += (lm == LM_LL) ? 2 : 1;
+			break;
+		case 'q':
+			lm = LM_LL;
+			p++;
+			break;
+		case 'L':
+			lm = LM_LD;
+			p++;
+			break;
+		case 'j':
+			lm = LM_J;
+			p++;
+			break;
+		case 'z':
+			lm = LM_Z;
+			p++;
+			break;
+		case 't':
+			lm = LM_T;
+			p++;
+			break;
+		}
+
+		switch (*p++) {
+		case '%':
+		case 'm':
+			break;
+
+		case 'd':
+		case 'i':
+			if (lm == LM_LL)
+				enc_num(e, 'i', va_arg(ap, long long));
+			else if (lm == LM_L || lm == LM_J || lm == LM_Z || lm == LM_T)
+				enc_num(e, 'i', va_arg(ap, long));
+			else
+				enc_num(e, 'i', (long long)va_arg(ap, int));
+			break;
+
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+			if (lm == LM_LL)
+				enc_num(e, 'u', va_arg(ap, unsigned long long));
+			else if (lm == LM_L || lm == LM_J || lm == LM_Z || lm == LM_T)
+				enc_num(e, 'u', va_arg(ap, unsigned long));
+			else
+				enc_num(e, 'u', va_arg(ap, unsigned int));
+			break;
+
+		case 'c':
+		case 'C':
+			enc_num(e, 'i', (long long)va_arg(ap, int));
+			break;
+
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'F':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			if (lm == LM_LD)
+				enc_dbl(e, (double)va_arg(ap, long double));
+			else
+				enc_dbl(e, va_arg(ap, double));
+			break;
+
+		case 's':
+			if (lm == LM_L) {
+				va_arg(ap, void*);
+				enc_str(e, "(wstr)");
+			} else
+				enc_str(e, va_arg(ap, const char*));
+			break;
+
+		case 'S':
+			va_arg(ap, void*);
+			enc_str(e, "(wstr)");
+			break;
+
+		case 'p':
+			enc_num(e, 'p', (unsigned long)va_arg(ap, void*));
+			break;
+
+		case 'n':
+			va_arg(ap, void*);
+			break;
+
+		default:
+			/* Unknown conversion, the left arguments can not be known */
+			return;
+		}
+	}
+}
+
+static unsigned long long fmt_key(const char *fmt)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+
+	while (*fmt)
+		h = (h ^ (unsigned char)*fmt++) * 0x100000001b3ULL;
+
+	return h | BIN_FMT_KEY;
+}
+
+/* XXX: should be called within lock. Return 1 if key is new */
+static int bin_key_add(klog_bin_s *bin, unsigned long long key)
+{
+	unsigned long long *old = bin->keys;
+	unsigned int i, size = bin->key_size;
+
+	if (bin->key_cnt * 2 >= bin->key_size) {
+		bin->key_size = size ? size * 2 : 1024;
+		bin->keys = kmem_alloz(bin->key_size, unsigned long long);
+		bin->key_cnt = 0;
+
+		for (i = 0; i < size; i++)
+			if (old[i])
+				bin_key_add(bin, old[i]);
+		kmem_free_s(old);
+	}
+
+	i = (unsigned int)(key ^ (key >> 29)) & (bin->key_size - 1);
+	while (bin->keys[i]) {
+		if (bin->keys[i] == key)
+			return 0;
+		i = (i + 1) & (bin->key_size - 1);
+	}
+
+	bin->keys[i] = key;
+	bin->key_cnt++;
+	return 1;
+}
+
+/* XXX: should be called within lock */
+static void bin_str_def(klog_bin_s *bin, unsigned long long key,
+		const char *str)
+{
+	unsigned int len;
+
+	if (!str || !bin_key_add(bin, key))
+		return;
+
+	len = strlen(str);
+	fputc('S', bin->fp);
+	fwrite(&key, 8, 1, bin->fp);
+	fwrite(&len, 4, 1, bin->fp);
+	fwrite(str, 1, len, bin->fp);
+}
+
+static int klog_bin_put(klog_bin_s *bin, unsigned char type,
+		unsigned int mask, char *prog, char *modu, char *file,
+		char *func, int ln, const char *fmt, va_list ap)
+{
+	binenc_s e;
+	va_list ap_copy;
+	unsigned long long v, key = fmt_key(fmt);
+	unsigned int len;
+
+	e.buf = e.sbuf;
+	e.len = 0;
+	e.size = sizeof(e.sbuf);
+
+	enc_put(&e, "L\0\0\0\0", 5);
+	enc_put(&e, &type, 1);
+	enc_put(&e, &mask, 4);
+	enc_put(&e, &ln, 4);
+	v = spl_time_get_usec();
+	enc_put(&e, &v, 8);
+	v = (unsigned long)spl_thread_current();
+	enc_put(&e, &v, 8);
+	v = (unsigned long)prog;
+	enc_put(&e, &v, 8);
+	v = (unsigned long)modu;
+	enc_put(&e, &v, 8);
+	v = (unsigned long)file;
+	enc_put(&e, &v, 8);
+	v = (unsigned long)func;
+	enc_put(&e, &v, 8);
+	enc_put(&e, &key, 8);
+
+	va_copy(ap_copy, ap);
+	enc_args(&e, fmt, ap_copy);
+	va_end(ap_copy);
+
+	len = e.len - 5;
+	memcpy(e.buf + 1, &len, 4);
+
+	spl_mutex_lock(bin->mutex);
+	if (bin->fp) {
+		bin_str_def(bin, (unsigned long)prog, prog);
+		bin_str_def(bin, (unsigned long)modu, modu);
+		bin_str_def(bin, (unsigned long)file, file);
+		bin_str_def(bin, (unsigned long)func, func);
+		bin_str_def(bin, key, fmt);
+		fwrite(e.buf, 1, e.len, bin->fp);
+	}
+	spl_mutex_unlock(bin->mutex);
+
+	if (e.buf != e.sbuf)
+		kmem_free(e.buf);
+	return len;
+}
+
+/**
+ * \brief Write the logs into a binary file instead of nloggers.
+ *
+ * The file is buffered, it is flushed by klog_bin_flush, klog_bin_stop
+ * or when exit. Use tools/klogbin.py to decode it.
+ */
+int klog_bin_start(const char *path)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
+	klog_bin_s *bin = cc->bin;
+	unsigned int v;
+	FILE *fp;
+
+	fp = fopen(path, "wb");
+	if (!fp) {
+		wlogf("klog_bin_start: fopen '%s' failed: %d\n", path, errno);
+		return -1;
+	}
+	setvbuf(fp, NULL, _IOFBF, 64 * 1024);
+
+	fwrite(BIN_MAGIC, 1, 8, fp);
+	v = 0x01020304;
+	fwrite(&v, 4, 1, fp);
+	v = (unsigned int)cc->pid;
+	fwrite(&v, 4, 1, fp);
+
+	if (!bin) {
+		bin = (klog_bin_s*)kmem_alloz(1, klog_bin_s);
+		bin->mutex = spl_mutex_create();
+		cc->bin = bin;
+	}
+
+	spl_mutex_lock(bin->mutex);
+	if (bin->fp)
+		fclose(bin->fp);
+	bin->fp = fp;
+	kmem_free_sz(bin->keys);
+	bin->key_size = bin->key_cnt = 0;
+	spl_mutex_unlock(bin->mutex);
+
+	return 0;
+}
+
+void klog_bin_flush(void)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
+	klog_bin_s *bin = cc->bin;
+
+	if (!bin)
+		return;
+
+	spl_mutex_lock(bin->mutex);
+	if (bin->fp)
+		fflush(bin->fp);
+	spl_mutex_unlock(bin->mutex);
+}
+
+void klog_bin_stop(void)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
+	klog_bin_s *bin = cc->bin;
+
+	if (!bin)
+		return;
+
+	spl_mutex_lock(bin->mutex);
+	if (bin->fp)
+		fclose(bin->fp);
+	bin->fp = NULL;
+	spl_mutex_unlock(bin->mutex);
+}
+
+static unsigned int str_hash(const char *str)
+{
+	unsigned int h = 2166136261U;
+
+	while (*str)
+		h = (h ^ (unsigned char)*str++) * 16777619U;
+	return h;
+}
+
+static char *strtab_find(strtab_s *tab, const char *str, unsigned int hash)
+{
+	unsigned int i, mask;
+	char *s;
+
+	if (!tab)
+		return NULL;
+
+	mask = tab->size - 1;
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		s = __atomic_load_n(&tab->slots[i].str, __ATOMIC_ACQUIRE);
+		if (!s)
+			return NULL;
+		if (tab->slots[i].hash == hash && !strcmp(s, str))
+			return s;
+	}
+}
+
+/* XXX: should be called within cc->mutex, and str is not in tab */
+static void strtab_put(strtab_s *tab, char *str, unsigned int hash)
+{
+	unsigned int i, mask = tab->size - 1;
+
+	for (i = hash & mask; tab->slots[i].str; i = (i + 1) & mask)
+		;
+
+	tab->slots[i].hash = hash;
+	__atomic_store_n(&tab->slots[i].str, str, __ATOMIC_RELEASE);
+	tab->cnt++;
+}
+
+static char *strtab_add(strtab_s **ptab, char *str)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
+	strtab_s *tab, *ntab;
+	unsigned int i, len, hash;
+	char *s;
+
+	if (unlikely(!str))
+		return NULL;
+
+	hash = str_hash(str);
+
+	s = strtab_find(__atomic_load_n(ptab, __ATOMIC_ACQUIRE), str, hash);
+	if (likely(s))
+		return s;
+
+	spl_mutex_lock(cc->mutex);
+
+	tab = *ptab;
+	s = strtab_find(tab, str, hash);
+	if (s) {
+		spl_mutex_unlock(cc->mutex);
+		return s;
+	}
+
+	if (!tab || (tab->cnt + 1) * 2 > tab->size) {
+		len = tab ? tab->size * 2 : 256;
+		ntab = (strtab_s*)kmem_get_z(sizeof(strtab_s) +
+				len * sizeof(strslot_s));
+		ntab->size = len;
+		ntab->old = tab;
+
+		if (tab)
+			for (i = 0; i < tab->size; i++)
+				if (tab->slots[i].str)
+					strtab_put(ntab, tab->slots[i].str,
+							tab->slots[i].hash);
+
+		__atomic_store_n(ptab, ntab, __ATOMIC_RELEASE);
+		tab = ntab;
+	}
+
+	len = strlen(str);
+	s = kmem_alloc(len + 1, char);
+	memcpy(s, str, len + 1);
+	strtab_put(tab, s, hash);
+
+	spl_mutex_unlock(cc->mutex);
+
+	return s;
+}
+
+static void strtab_free(strtab_s *tab)
+{
+	strtab_s *old;
+	unsigned int i;
+
+	if (tab)
+		for (i = 0; i < tab->size; i++)
+			kmem_free_s(tab->slots[i].str);
+
+	while (tab) {
+		old = tab->old;
+		kmem_free(tab);
+		tab = old;
+	}
+}
+
+char *klog_file_name_add(char *name)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
+	char *newstr, *newname = get_basename(name);
+
+	newstr = strtab_add(&cc->tab_file_name, newname);
+
+	free(newname);
+
+	return newstr;
+}
+char *klog_modu_name_add(char *name)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
+	char *newstr;
+
+	newstr = strtab_add(&cc->tab_modu_name, name);
+	return newstr;
+}
+char *klog_prog_name_add(char *name)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
+	char *newstr, *newname, *progname;
+
+	if (name)
+		newname = get_basename(name);
+	else {
+		progname = get_progname();
+		newname = get_basename(progname);
+	}
+
+	newstr = strtab_add(&cc->tab_prog_name, newname);
+
+	free(newname);
+
+	return newstr;
+}
+char *klog_func_name_add(char *name)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
+	char *newstr;
+
+	newstr = strtab_add(&cc->tab_func_name, name);
+	return newstr;
+}
+
+static int rulearr_add(rulearr_s *ra, char *prog, char *modu,
+		char *file, char *func, int line, int pid,
+		unsigned int fset, unsigned int fclr,
+		int rate, int burst, int dedup)
+{
+	ARR_GROW(ra->arr, ra->size, ra->cnt + 1, rule_s);
+
+	rule_s *rule = &ra->arr[ra->cnt];
+
+	rule->prog = prog;
+	rule->modu = modu;
+	rule->file = file;
+	rule->func = func;
+
+	rule->line = line;
+	rule->pid = pid;
+
+	rule->set = fset;
+	rule->clr = fclr;
+
+	rule->rate = rate;
+	rule->burst = burst;
+	rule->dedup = dedup;
+
+	ra->cnt++;
+
+	/* Return the position been inserted */
+	return ra->cnt - 1;
+}
+
+/*
+ * rule =
+ * prog=xxx,modu=xxx,file=xxx,func=xxx,line=xxx,pid=xxx,mask=left
+ *
+ * Optional, for the matched call sites:
+ * rate=N[/B]: at most N lines per second, burst B, default N, 0 no limit
+ * dedup=1: drop the repeated lines, "last message repeated" is logged
+ * before the next different one, every 30 seconds while it repeats, and
+ * when a rule of the site or the module changed
+ */
+void klog_rule_add(char *rule)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
+	int i_line, i_pid, i_rate = -1, i_burst = -1, i_dedup = -1;
+	char *s_prog, *s_modu, *s_file, *s_func, *s_line, *s_pid, *s_mask;
+	char *s_rate, *s_dedup, *s_burst;
+	char buf[1024];
+	int i, blen;
+	rule_s added;
+
+	unsigned int set = 0, clr = 0;
+
+	if (!rule || rule[0] == '#')
+		return;
+
+	buf[0] = ',';
+	strncpy(buf + 1, rule, sizeof(buf) - 2);
+
+	s_mask = strstr(buf, ",mask=");
+	s_rate = strstr(buf, ",rate=");
+	s_dedup = strstr(buf, ",dedup=");
+	if ((!s_mask || !s_mask[6]) && !s_rate && !s_dedup)
+		return;
+
+	s_prog = strstr(buf, ",prog=");
+	s_modu = strstr(buf, ",modu=");
+	s_file = strstr(buf, ",file=");
+	s_func = strstr(buf, ",func=");
+	s_line = strstr(buf, ",line=");
+	s_pid = strstr(buf, ",pid=");
+
+	blen = strlen(buf);
+	for (i = 0; i < blen; i++)
+		if (buf[i] == ',')
+			buf[i] = '\0';
+
+	if (!s_prog || !s_prog[6])
+		s_prog = NULL;
+	else
+		s_prog = klog_prog_name_add(s_prog + 6);
+
+	if (!s_modu || !s_modu[6])
+		s_modu = NULL;
+	else
+		s_modu = klog_modu_name_add(s_modu + 6);
+
+	if (!s_file || !s_file[6])
+		s_file = NULL;
+	else
+		s_file = klog_file_name_add(s_file + 6);
+
+	if (!s_func || !s_func[6])
+		s_func = NULL;
+	else
+		s_func = klog_func_name_add(s_func + 6);
+
+	if (!s_line || !s_line[6])
+		i_line = -1;
+	else
+		i_line = atoi(s_line + 6);
+
+	if (!s_pid || !s_pid[5])
+		i_pid = -1;
+	else
+		i_pid = atoi(s_pid + 5);
+
+	if (s_rate && s_rate[6]) {
+		i_rate = atoi(s_rate + 6);
+		s_burst = strchr(s_rate + 6, '/');
+		i_burst = s_burst ? atoi(s_burst + 1) : i_rate;
+		if (i_rate < 0 || i_burst <= 0)
+			i_burst = i_rate = i_rate < 0 ? -1 : 0;
+	}
+
+	if (s_dedup && s_dedup[7])
+		i_dedup = !!atoi(s_dedup + 7);
+
+	if (s_mask && s_mask[6])
+		klog_parse_mask(s_mask + 6, &set, &clr);
+
+	if (set || clr || i_rate != -1 || i_dedup != -1) {
+		spl_mutex_lock(cc->mutex);
+		i = rulearr_add(&cc->arr_rule, s_prog, s_modu, s_file, s_func,
+				i_line, i_pid, set, clr, i_rate, i_burst, i_dedup);
+		added = cc->arr_rule.arr[i];
+		spl_mutex_unlock(cc->mutex);
+
+		rule_touch(cc, &added);
+	}
+}
+void klog_rule_del(unsigned int idx)
 {
 	klogcc_s *cc = (klogcc_s*)klog_cc();
-	char *newstr;
+	rule_s deleted;
 
 	spl_mutex_lock(cc->mutex);
-	newstr = strarr_add(&cc->arr_modu_name, name);
+	if (idx >= cc->arr_rule.cnt) {
+		spl_mutex_unlock(cc->mutex);
+		return;
+	}
+
+	deleted = cc->arr_rule.arr[idx];
+	memmove(&cc->arr_rule.arr[idx], &cc->arr_rule.arr[idx + 1],
+			(cc->arr_rule.cnt - idx - 1) * sizeof(rule_s));
+	cc->arr_rule.cnt--;
+	cc->rule_base = cc->touches + 1;
 	spl_mutex_unlock(cc->mutex);
-	return newstr;
+
+	rule_touch(cc, &deleted);
 }
-char *klog_prog_name_add(char *name)
+void klog_rule_clr()
 {
 	klogcc_s *cc = (klogcc_s*)klog_cc();
-	char *newstr, *newname, *progname;
 
-	if (name)
-		newname = get_basename(name);
-	else {
-		progname = get_progname();
-		newname = get_basename(progname);
-	}
+	spl_mutex_lock(cc->mutex);
+	cc->arr_rule.cnt = 0;
+	cc->rule_base = cc->touches + 1;
+	spl_mutex_unlock(cc->mutex);
+
+	klog_touch();
+}
+
+static unsigned int get_mask(char c)
+{
+	unsigned int i;
+
+	static struct {
+		char code;
+		unsigned int bit;
+	} flagmap[] = {
+		{ '0', KLOG_FATAL },
+		{ 'f', KLOG_FATAL },
+
+		{ '1', KLOG_ALERT },
+		{ 'a', KLOG_ALERT },
+
+		{ '2', KLOG_CRIT },
+		{ 'c', KLOG_CRIT },
+
+		{ '3', KLOG_ERR },
+		{ 'e', KLOG_ERR },
+
+		{ '4', KLOG_WARNING },
+		{ 'w', KLOG_WARNING },
+
+		{ '5', KLOG_NOTICE },
+		{ 'n', KLOG_NOTICE },
+
+		{ '6', KLOG_INFO },
+		{ 'i', KLOG_INFO },
+		{ 'l', KLOG_INFO },
+
+		{ '7', KLOG_DEBUG },
+		{ 'd', KLOG_DEBUG },
+		{ 't', KLOG_DEBUG },
+
+		{ 's', KLOG_RTM },
+		{ 'S', KLOG_ATM },
+		{ 'u', KLOG_UTM },
+
+		{ 'j', KLOG_PID },
+		{ 'x', KLOG_TID },
+
+		{ 'N', KLOG_LINE },
+		{ 'F', KLOG_FILE },
+		{ 'M', KLOG_MODU },
+		{ 'H', KLOG_FUNC },
+		{ 'P', KLOG_PROG },
+	};
+
+	for (i = 0; i < sizeof(flagmap) / sizeof(flagmap[0]); i++)
+		if (flagmap[i].code == c)
+			return flagmap[i].bit;
+	return 0;
+}
+
+static void klog_parse_mask(char *mask, unsigned int *set, unsigned int *clr)
+{
+	int i = 0, len = strlen(mask);
+	char c;
+
+	*set = 0;
+	*clr = 0;
+
+	for (i = 0; i < len; i++) {
+		c = mask[i];
+		if (c == '-') {
+			c = mask[++i];
+			*clr |= get_mask(c);
+		} else
+			*set |= get_mask(c);
+	}
+}
+
+static int rule_match(rule_s *rule, char *prog, char *modu,
+		char *file, char *func, int line, int pid)
+{
+	if (rule->prog != NULL && rule->prog != prog)
+		return 0;
+	if (rule->modu != NULL && rule->modu != modu)
+		return 0;
+	if (rule->file != NULL && rule->file != file)
+		return 0;
+	if (rule->func != NULL && rule->func != func)
+		return 0;
+	if (rule->line != -1 && rule->line != line)
+		return 0;
+	if (rule->pid != -1 && rule->pid != pid)
+		return 0;
+	return 1;
+}
+
+static void rule_apply(rule_s *rule, unsigned int *mask, rulelim_s *lim)
+{
+	kflg_clr(*mask, rule->clr);
+	kflg_set(*mask, rule->set);
+
+	if (!lim)
+		return;
+	if (rule->rate != -1) {
+		lim->rate = rule->rate;
+		lim->burst = rule->burst;
+	}
+	if (rule->dedup != -1)
+		lim->dedup = rule->dedup;
+}
+
+static char *rule_key(rule_s *rule)
+{
+	if (rule->func)
+		return rule->func;
+	if (rule->file)
+		return rule->file;
+	if (rule->modu)
+		return rule->modu;
+	return rule->prog;
+}
+
+static ruleslot_s *ruleidx_slot(ruleidx_s *ri, char *key, int add)
+{
+	unsigned int i, mask = ri->size - 1;
+
+	i = (unsigned int)(((unsigned long)key >> 3) * 2654435761U) & mask;
+	while (ri->slots[i].key) {
+		if (ri->slots[i].key == key)
+			return &ri->slots[i];
+		i = (i + 1) & mask;
+	}
+	if (!add)
+		return NULL;
+
+	ri->slots[i].key = key;
+	return &ri->slots[i];
+}
+
+/* XXX: should be called within cc->mutex */
+static void ruleidx_build(klogcc_s *cc)
+{
+	rulearr_s *ra = &cc->arr_rule;
+	ruleidx_s *ri = cc->ridx;
+	ruleslot_s *slot;
+	unsigned int i, pass, ofs, size = 16;
+	int pid = (int)cc->pid;
+	char *key;
+
+	if (!ri) {
+		ri = (ruleidx_s*)kmem_alloz(1, ruleidx_s);
+		cc->ridx = ri;
+	}
+
+	while (size < ra->cnt * 2)
+		size <<= 1;
+
+	kmem_free_s(ri->slots);
+	kmem_free_s(ri->ids);
+	ri->size = size;
+	ri->slots = (ruleslot_s*)kmem_alloz(size, ruleslot_s);
+	ri->ids = (unsigned int*)kmem_alloc(ra->cnt + 1, unsigned int);
+
+	/* pass 0 count the rules of each slot, pass 1 fill them in order */
+	for (pass = 0; pass < 2; pass++) {
+		ri->any_cnt = 0;
+
+		for (i = 0; i < ra->cnt; i++) {
+			rule_s *rule = &ra->arr[i];
+
+			if (rule->pid != -1 && rule->pid != pid)
+				continue;
+
+			key = rule_key(rule);
+			if (!key) {
+				if (pass)
+					ri->ids[ri->any_beg + ri->any_cnt] = i;
+				ri->any_cnt++;
+				continue;
+			}
+
+			slot = ruleidx_slot(ri, key, 1);
+			if (pass)
+				ri->ids[slot->beg + slot->cnt] = i;
+			slot->cnt++;
+		}
+
+		if (pass)
+			break;
+
+		for (ofs = 0, i = 0; i < size; i++) {
+			ri->slots[i].beg = ofs;
+			ofs += ri->slots[i].cnt;
+			ri->slots[i].cnt = 0;
+		}
+		ri->any_beg = ofs;
+	}
+
+	ri->touches = cc->touches;
+}
+
+/* XXX: should be called within cc->mutex */
+static unsigned int ruleidx_calc(klogcc_s *cc, char *prog, char *modu,
+		char *file, char *func, int line, rulelim_s *lim)
+{
+	ruleidx_s *ri = cc->ridx;
+	ruleslot_s *slot;
+	rule_s *rule;
+
+	char *keys[4] = { func, file, modu, prog };
+	unsigned int *lst[5], cnt[5], i, n = 0, best, all = 0;
+	int pid = (int)cc->pid;
+
+	if (!ri || ri->touches != cc->touches) {
+		ruleidx_build(cc);
+		ri = cc->ridx;
+	}
+
+	for (i = 0; i < 4; i++) {
+		if (!keys[i])
+			continue;
+		slot = ruleidx_slot(ri, keys[i], 0);
+		if (slot && slot->cnt) {
+			lst[n] = ri->ids + slot->beg;
+			cnt[n++] = slot->cnt;
+		}
+	}
+	if (ri->any_cnt) {
+		lst[n] = ri->ids + ri->any_beg;
+		cnt[n++] = ri->any_cnt;
+	}
+
+	/* Rules must be applied in order, merge the lists by position */
+	for (;;) {
+		best = n;
+		for (i = 0; i < n; i++)
+			if (cnt[i] && (best == n || lst[i][0] < lst[best][0]))
+				best = i;
+		if (best == n)
+			break;
+
+		rule = &cc->arr_rule.arr[lst[best][0]];
+		lst[best]++;
+		cnt[best]--;
+
+		if (!rule_match(rule, prog, modu, file, func, line, pid))
+			continue;
+
+		rule_apply(rule, &all, lim);
+	}
+
+	return all;
+}
+
+unsigned int klog_calc_mask(char *prog, char *modu, char *file, char *func, int line)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
+	unsigned int all;
+
+	spl_mutex_lock(cc->mutex);
+	all = ruleidx_calc(cc, prog, modu, file, func, line, NULL);
+	spl_mutex_unlock(cc->mutex);
+
+	return all;
+}
+
+/*
+ * The mask was calculated at touches ver with the first *pos rules. If no
+ * rule is deleted since then, only the appended rules are applied on it,
+ * else it is calculated again, and lim too if given.
+ */
+static unsigned int recalc_mask(klogcc_s *cc, char *prog, char *modu,
+		char *file, char *func, int line, int ver, unsigned int mask,
+		unsigned int *pos, rulelim_s *lim)
+{
+	rulearr_s *ra = &cc->arr_rule;
+	unsigned int i;
+	int pid = (int)cc->pid;
+
+	spl_mutex_lock(cc->mutex);
+
+	if (ver < 0 || ver < cc->rule_base || *pos > ra->cnt) {
+		if (lim)
+			memset(lim, 0, sizeof(*lim));
+		mask = ruleidx_calc(cc, prog, modu, file, func, line, lim);
+	} else
+		for (i = *pos; i < ra->cnt; i++)
+			if (rule_match(&ra->arr[i], prog, modu, file, func, line, pid))
+				rule_apply(&ra->arr[i], &mask, lim);
+
+	*pos = ra->cnt;
+
+	spl_mutex_unlock(cc->mutex);
+
+	return mask;
+}
+
+/**
+ * \brief Update the mask of a call site.
+ *
+ * The \c mask was calculated at touches \c ver with the first \c *pos
+ * rules. If no rule is deleted since then, only the appended rules are
+ * applied on it, else it is calculated again.
+ *
+ * \return the new mask, and \c *pos is updated.
+ */
+unsigned int klog_recalc_mask(char *prog, char *modu, char *file, char *func,
+		int line, int ver, unsigned int mask, unsigned int *pos)
+{
+	klogcc_s *cc = (klogcc_s*)klog_cc();
+
+	return recalc_mask(cc, prog, modu, file, func, line, ver, mask, pos, NULL);
+}
+
+/*-----------------------------------------------------------------------
+ * Call sites
+ *
+ * Each module registers the range of its section klog_sites. The mask of
+ * a site is calculated when it is hit first time, and is updated here
+ * when the rules changed, so the disabled site never call into klog.
+ */
+#define MAX_SITE_RANGE  256
+
+static struct {
+	klog_site_s *beg, *end;
+} __site_ranges[MAX_SITE_RANGE];
+static int __site_range_cnt = 0;
+
+/* Not a SPL_HANDLE, the sites are added by constructors */
+static pthread_mutex_t __site_lck = PTHREAD_MUTEX_INITIALIZER;
 
-	spl_mutex_lock(cc->mutex);
-	newstr = strarr_add(&cc->arr_prog_name, newname);
-	spl_mutex_unlock(cc->mutex);
+/* Evaluating a site, striped so the first hits of sites run in parallel */
+#define SITE_LCK_CNT    16
 
-	free(newname);
+static pthread_mutex_t __site_eval_lck[SITE_LCK_CNT] = {
+	[0 ... SITE_LCK_CNT - 1] = PTHREAD_MUTEX_INITIALIZER
+};
 
-	return newstr;
-}
-char *klog_func_name_add(char *name)
+#define site_eval_lck(site) \
+	(&__site_eval_lck[((unsigned long)(site) >> 4) % SITE_LCK_CNT])
+
+void klog_sites_add(klog_site_s *beg, klog_site_s *end)
 {
-	klogcc_s *cc = (klogcc_s*)klog_cc();
-	char *newstr;
+	int i;
 
-	spl_mutex_lock(cc->mutex);
-	newstr = strarr_add(&cc->arr_func_name, name);
-	spl_mutex_unlock(cc->mutex);
-	return newstr;
+	pthread_mutex_lock(&__site_lck);
+
+	for (i = 0; i < __site_range_cnt; i++)
+		if (__site_ranges[i].beg == beg)
+			goto done;
+
+	if (__site_range_cnt >= MAX_SITE_RANGE) {
+		wlogf("klog_sites_add: Only up to %d modules supported.\n", MAX_SITE_RANGE);
+		goto done;
+	}
+
+	__site_ranges[__site_range_cnt].beg = beg;
+	__site_ranges[__site_range_cnt].end = end;
+	__site_range_cnt++;
+
+done:
+	pthread_mutex_unlock(&__site_lck);
 }
 
-static int rulearr_add(rulearr_s *ra, char *prog, char *modu,
-		char *file, char *func, int line, int pid,
-		unsigned int fset, unsigned int fclr)
-{
-	if (unlikely(ra->cnt >= ra->size))
-		ARR_INC(16, ra->arr, ra->size, rule_s);
+/*
+ * Repeated counts taken within __site_lck are logged after it released,
+ * a logger may log by itself and hit a site for the first time.
+ */
+typedef struct _dupflush_s dupflush_s;
+struct _dupflush_s {
+	klog_site_s site;
+	unsigned int cnt;
+};
 
-	rule_s *rule = &ra->arr[ra->cnt];
+typedef struct _dupflushes_s dupflushes_s;
+struct _dupflushes_s {
+	dupflush_s *arr;
+	int cnt, cap;
+};
 
-	rule->prog = prog;
-	rule->modu = modu;
-	rule->file = file;
-	rule->func = func;
+static void site_dup_take(klog_site_s *site, dupflushes_s *fl, int drop);
+static void dup_flush(dupflushes_s *fl);
 
-	rule->line = line;
-	rule->pid = pid;
+void klog_sites_del(klog_site_s *beg)
+{
+	dupflushes_s fl = { NULL, 0, 0 };
+	klog_site_s *site;
+	int i;
 
-	rule->set = fset;
-	rule->clr = fclr;
+	pthread_mutex_lock(&__site_lck);
 
-	ra->cnt++;
+	for (i = 0; i < __site_range_cnt; i++)
+		if (__site_ranges[i].beg == beg) {
+			/* The sites go away with the module */
+			for (site = beg; site < __site_ranges[i].end; site++)
+				if (site->dup_msg)
+					site_dup_take(site, &fl, 1);
 
-	/* Return the position been inserted */
-	return ra->cnt - 1;
+			__site_range_cnt--;
+			__site_ranges[i] = __site_ranges[__site_range_cnt];
+			break;
+		}
+
+	pthread_mutex_unlock(&__site_lck);
+
+	dup_flush(&fl);
 }
 
-/*
- * rule =
- * prog=xxx,modu=xxx,file=xxx,func=xxx,line=xxx,pid=xxx,mask=left
- */
-void klog_rule_add(char *rule)
+/* XXX: should be called within site_eval_lck(site) */
+static void site_eval(klog_site_s *site)
 {
 	klogcc_s *cc = (klogcc_s*)klog_cc();
-	int i_line, i_pid;
-	char *s_prog, *s_modu, *s_file, *s_func, *s_line, *s_pid, *s_mask;
-	char buf[1024];
-	int i, blen;
+	rulelim_s lim;
+	int ver;
+
+	if (unlikely(!site->file_name)) {
+		site->prog_name = klog_prog_name_add(NULL);
+		site->modu_name = klog_modu_name_add((char*)site->modu);
+		site->file_name = klog_file_name_add((char*)site->file);
+		site->func_name = klog_func_name_add((char*)site->func);
+	}
 
-	unsigned int set = 0, clr = 0;
+	lim.rate = site->rate;
+	lim.burst = site->burst;
+	lim.dedup = site->dedup;
 
-	if (!rule || rule[0] == '#')
-		return;
+	ver = klog_touches();
+	site->all_mask = recalc_mask(cc, site->prog_name, site->modu_name,
+			site->file_name, site->func_name, site->line,
+			site->ver, site->all_mask, &site->rule_pos, &lim);
+	__atomic_store_n(&site->ver, ver, __ATOMIC_RELEASE);
 
-	buf[0] = ',';
-	strncpy(buf + 1, rule, sizeof(buf) - 2);
+	site->rate = lim.rate;
+	site->burst = lim.burst;
+	site->dedup = lim.dedup;
 
-	s_mask = strstr(buf, ",mask=");
-	if (!s_mask || !s_mask[6])
+	site->mask = (site->all_mask & site->level) ? site->all_mask : 0;
+}
+
+/*
+ * Evaluate again the hit sites matched by rule, all of them if rule is
+ * NULL. The others keep the mask, the rules skipped here are caught up
+ * by recalc_mask() when they are evaluated later.
+ */
+static void sites_refresh(rule_s *rule)
+{
+	klogcc_s *cc = __g_klogcc;
+	dupflushes_s fl = { NULL, 0, 0 };
+	klog_site_s *site;
+	pthread_mutex_t *lck;
+	int i, pid = cc ? (int)cc->pid : -1;
+
+	if (rule && rule->pid != -1 && rule->pid != pid)
 		return;
-	s_mask += 6;
 
-	s_prog = strstr(buf, ",prog=");
-	s_modu = strstr(buf, ",modu=");
-	s_file = strstr(buf, ",file=");
-	s_func = strstr(buf, ",func=");
-	s_line = strstr(buf, ",line=");
-	s_pid = strstr(buf, ",pid=");
+	pthread_mutex_lock(&__site_lck);
+
+	for (i = 0; i < __site_range_cnt; i++)
+		for (site = __site_ranges[i].beg; site < __site_ranges[i].end; site++) {
+			if (__atomic_load_n(&site->ver, __ATOMIC_ACQUIRE) == -1)
+				continue;
+			if (rule && !rule_match(rule, site->prog_name,
+						site->modu_name, site->file_name,
+						site->func_name, site->line, pid))
+				continue;
+
+			/* The new rule may turn off the dedup or the site */
+			if (site->dup_cnt)
+				site_dup_take(site, &fl, 0);
+
+			lck = site_eval_lck(site);
+			pthread_mutex_lock(lck);
+			site_eval(site);
+			pthread_mutex_unlock(lck);
+		}
 
-	blen = strlen(buf);
-	for (i = 0; i < blen; i++)
-		if (buf[i] == ',')
-			buf[i] = '\0';
+	pthread_mutex_unlock(&__site_lck);
 
-	if (!s_prog || !s_prog[6])
-		s_prog = NULL;
-	else
-		s_prog = klog_prog_name_add(s_prog + 6);
+	dup_flush(&fl);
+}
 
-	if (!s_modu || !s_modu[6])
-		s_modu = NULL;
-	else
-		s_modu = klog_modu_name_add(s_modu + 6);
+/*
+ * Rate limit and dedup.
+ *
+ * Rate is checked before format when no dedup: the site keeps the
+ * theoretical arrival time of next line (GCRA), a line is dropped when it
+ * is more than burst lines ahead. Dedup has to format the line to compare
+ * with the last one logged, a repeat is counted and takes no rate, a line
+ * dropped by rate does not become the last one.
+ *
+ * The repeated count is logged when a different line comes, or when the
+ * repeats last DEDUP_FLUSH_USEC, or when a rule of the site or the
+ * module changed.
+ */
+#define DEDUP_LCK_CNT   16
+#define DEDUP_FLUSH_USEC        (30 * 1000000ULL)
 
-	if (!s_file || !s_file[6])
-		s_file = NULL;
-	else
-		s_file = klog_file_name_add(s_file + 6);
+static pthread_mutex_t __dedup_lck[DEDUP_LCK_CNT] = {
+	[0 ... DEDUP_LCK_CNT - 1] = PTHREAD_MUTEX_INITIALIZER
+};
 
-	if (!s_func || !s_func[6])
-		s_func = NULL;
-	else
-		s_func = klog_func_name_add(s_func + 6);
+#define dedup_lck(site) \
+	(&__dedup_lck[((unsigned long)(site) >> 4) % DEDUP_LCK_CNT])
 
-	if (!s_line || !s_line[6])
-		i_line = -1;
-	else
-		i_line = atoi(s_line + 6);
+static int site_rate_ok(klog_site_s *site)
+{
+	unsigned long long now, tat, ntat, step, span;
+
+	if (!site->rate)
+		return 1;
+
+	step = 1000000ULL / site->rate;
+	if (!step)
+		step = 1;
+	span = step * (site->burst ? site->burst : 1);
+
+	now = mono_usec();
+	tat = __atomic_load_n(&site->tat, __ATOMIC_RELAXED);
+	do {
+		ntat = (tat > now ? tat : now) + step;
+		if (ntat - now > span) {
+			__atomic_add_fetch(&site->dropped, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+	} while (!__atomic_compare_exchange_n(&site->tat, &tat, ntat, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-	if (!s_pid || !s_pid[5])
-		i_pid = -1;
-	else
-		i_pid = atoi(s_pid + 6);
+	return 1;
+}
 
-	klog_parse_mask(s_mask, &set, &clr);
+static int site_log(klog_site_s *site, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
 
-	if (set || clr) {
-		spl_mutex_lock(cc->mutex);
-		rulearr_add(&cc->arr_rule, s_prog, s_modu, s_file, s_func, i_line, i_pid, set, clr);
-		spl_mutex_unlock(cc->mutex);
+	va_start(ap, fmt);
+	ret = klog_vf(site->type, site->mask, site->prog_name,
+			site->modu_name, site->file_name, site->func_name,
+			site->line, fmt, ap);
+	va_end(ap);
 
-		klog_touch();
-	}
+	return ret;
 }
-void klog_rule_del(unsigned int idx)
+
+/* Take the repeated count of site, drop the last line too if the site goes */
+static void site_dup_take(klog_site_s *site, dupflushes_s *fl, int drop)
 {
-	klogcc_s *cc = (klogcc_s*)klog_cc();
+	pthread_mutex_t *lck = dedup_lck(site);
+	unsigned int cnt;
+
+	pthread_mutex_lock(lck);
+	cnt = site->dup_cnt;
+	site->dup_cnt = 0;
+	if (drop) {
+		kmem_free_sz(site->dup_msg);
+		site->dup_len = site->dup_cap = 0;
+	}
+	pthread_mutex_unlock(lck);
 
-	if (idx >= cc->arr_rule.cnt)
+	if (!cnt)
 		return;
 
-	memcpy(&cc->arr_rule.arr[idx], &cc->arr_rule.arr[idx + 1],
-			(cc->arr_rule.cnt - idx - 1) * sizeof(rule_s));
-	klog_touch();
+	ARR_GROW(fl->arr, fl->cap, fl->cnt + 1, dupflush_s);
+	fl->arr[fl->cnt].site = *site;
+	fl->arr[fl->cnt].cnt = cnt;
+	fl->cnt++;
 }
-void klog_rule_clr()
+
+static void dup_flush(dupflushes_s *fl)
 {
-	klogcc_s *cc = (klogcc_s*)klog_cc();
+	int i;
 
-	cc->arr_rule.cnt = 0;
-	klog_touch();
+	for (i = 0; i < fl->cnt; i++)
+		site_log(&fl->arr[i].site, "last message repeated %u times\n",
+				fl->arr[i].cnt);
+	ARR_FREE(fl->arr, fl->cnt, fl->cap);
 }
 
-static unsigned int get_mask(char c)
+/*
+ * Return 1 if msg repeats the last line. Else if it passes the rate, it
+ * becomes the last line and the repeats of the old one are put to *cnt.
+ */
+static int site_dup_check(klog_site_s *site, const char *msg, unsigned int len,
+		unsigned int *cnt, int *rate_ok)
 {
-	unsigned int i;
-
-	static struct {
-		char code;
-		unsigned int bit;
-	} flagmap[] = {
-		{ '0', KLOG_FATAL },
-		{ 'f', KLOG_FATAL },
+	pthread_mutex_t *lck = dedup_lck(site);
 
-		{ '1', KLOG_ALERT },
-		{ 'a', KLOG_ALERT },
+	*cnt = 0;
+	*rate_ok = 1;
 
-		{ '2', KLOG_CRIT },
-		{ 'c', KLOG_CRIT },
+	pthread_mutex_lock(lck);
 
-		{ '3', KLOG_ERR },
-		{ 'e', KLOG_ERR },
+	if (site->dup_msg && site->dup_len == len && !memcmp(site->dup_msg, msg, len)) {
+		if (!site->dup_cnt++)
+			site->dup_time = mono_usec();
+		else if (mono_usec() - site->dup_time >= DEDUP_FLUSH_USEC) {
+			*cnt = site->dup_cnt;
+			site->dup_cnt = 0;
+		}
+		pthread_mutex_unlock(lck);
+		return 1;
+	}
 
-		{ '4', KLOG_WARNING },
-		{ 'w', KLOG_WARNING },
+	*rate_ok = site_rate_ok(site);
+	if (*rate_ok) {
+		*cnt = site->dup_cnt;
+		site->dup_cnt = 0;
 
-		{ '5', KLOG_NOTICE },
-		{ 'n', KLOG_NOTICE },
+		if (len + 1 > site->dup_cap) {
+			kmem_free_s(site->dup_msg);
+			site->dup_cap = len + 1;
+			site->dup_msg = kmem_alloc(site->dup_cap, char);
+		}
+		memcpy(site->dup_msg, msg, len);
+		site->dup_len = len;
+	}
 
-		{ '6', KLOG_INFO },
-		{ 'i', KLOG_INFO },
-		{ 'l', KLOG_INFO },
+	pthread_mutex_unlock(lck);
+	return 0;
+}
 
-		{ '7', KLOG_DEBUG },
-		{ 'd', KLOG_DEBUG },
-		{ 't', KLOG_DEBUG },
+static int site_limit_vf(klog_site_s *site, const char *fmt, va_list ap)
+{
+	va_list ap_copy;
 
-		{ 's', KLOG_RTM },
-		{ 'S', KLOG_ATM },
+	char buffer[1024], *msg = NULL;
+	unsigned int cnt;
+	int ret = 0, len, dup, rate_ok;
 
-		{ 'j', KLOG_PID },
-		{ 'x', KLOG_TID },
+	if (site->dedup) {
+		va_copy(ap_copy, ap);
+		len = vsnprintf(buffer, sizeof(buffer), fmt, ap_copy);
+		va_end(ap_copy);
+		if (len < 0)
+			return 0;
 
-		{ 'N', KLOG_LINE },
-		{ 'F', KLOG_FILE },
-		{ 'M', KLOG_MODU },
-		{ 'H', KLOG_FUNC },
-		{ 'P', KLOG_PROG },
-	};
+		msg = buffer;
+		if (len > sizeof(buffer) - 1) {
+			msg = kmem_alloc(len + 1, char);
+			va_copy(ap_copy, ap);
+			vsnprintf(msg, len + 1, fmt, ap_copy);
+			va_end(ap_copy);
+		}
 
-	for (i = 0; i < sizeof(flagmap) / sizeof(flagmap[0]); i++)
-		if (flagmap[i].code == c)
-			return flagmap[i].bit;
-	return 0;
+		dup = site_dup_check(site, msg, len, &cnt, &rate_ok);
+		if (cnt)
+			site_log(site, "last message repeated %u times\n", cnt);
+		if (dup || !rate_ok)
+			goto done;
+	} else if (!site_rate_ok(site))
+		goto done;
+
+	cnt = __atomic_exchange_n(&site->dropped, 0, __ATOMIC_RELAXED);
+	if (cnt)
+		site_log(site, "%u lines suppressed by rate limit\n", cnt);
+
+	/* The original format and arguments, binary mode wants them */
+	ret = klog_vf(site->type, site->mask, site->prog_name,
+			site->modu_name, site->file_name,
+			site->func_name, site->line, fmt, ap);
+
+done:
+	if (msg && msg != buffer)
+		kmem_free(msg);
+	return ret;
 }
 
-static void klog_parse_mask(char *mask, unsigned int *set, unsigned int *clr)
+int klog_site_vf(klog_site_s *site, const char *fmt, va_list ap)
 {
-	int i = 0, len = strlen(mask);
-	char c;
+	if (unlikely(site->ver == -1)) {
+		/* klog_init calls sites_refresh, so init it out of lock */
+		klog_cc();
 
-	*set = 0;
-	*clr = 0;
+		pthread_mutex_lock(site_eval_lck(site));
+		if (site->ver == -1)
+			site_eval(site);
+		pthread_mutex_unlock(site_eval_lck(site));
 
-	for (i = 0; i < len; i++) {
-		c = mask[i];
-		if (c == '-') {
-			c = mask[++i];
-			*clr |= get_mask(c);
-		} else
-			*set |= get_mask(c);
+		if (!site->mask)
+			return 0;
 	}
-}
 
-unsigned int klog_calc_mask(char *prog, char *modu, char *file, char *func, int line)
-{
-	klogcc_s *cc = (klogcc_s*)klog_cc();
-	unsigned int i, all = 0;
-	int pid = (int)cc->pid;
+	if (unlikely(site->rate || site->dedup))
+		return site_limit_vf(site, fmt, ap);
 
-	for (i = 0; i < cc->arr_rule.cnt; i++) {
-		rule_s *rule = &cc->arr_rule.arr[i];
+	return klog_vf(site->type, site->mask, site->prog_name,
+			site->modu_name, site->file_name, site->func_name,
+			site->line, fmt, ap);
+}
 
-		if (rule->prog != NULL && rule->prog != prog)
-			continue;
-		if (rule->modu != NULL && rule->modu != modu)
-			continue;
-		if (rule->file != NULL && rule->file != file)
-			continue;
-		if (rule->func != NULL && rule->func != func)
-			continue;
-		if (rule->line != -1 && rule->line != line)
-			continue;
-		if (rule->pid != -1 && rule->pid != pid)
-			continue;
+int klog_site_f(klog_site_s *site, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
 
-		kflg_clr(all, rule->clr);
-		kflg_set(all, rule->set);
-	}
+	va_start(ap, fmt);
+	ret = klog_site_vf(site, fmt, ap);
+	va_end(ap);
 
-	return all;
+	return ret;
 }
 
 void klog_bt(const char *fmt, ...)
@@ -1001,3 +2890,83 @@ void klog_bt(const char *fmt, ...)
 	free(strings);
 }
 
+#ifdef KLOG_TEST
+/*
+ * Loggers added and deleted while other threads log through them, build
+ * with -fsanitize=address to catch a logger set freed while in use.
+ */
+#define TEST_THREADS    4
+#define TEST_STEP       100
+#define TEST_WAIT_USEC  (5 * 1000000ULL)
+
+static volatile int __test_quit;
+static int __test_started;
+static unsigned long __test_lines;
+
+static void test_logger(char *content, int len)
+{
+	__atomic_add_fetch(&__test_lines, 1, __ATOMIC_RELAXED);
+}
+
+static void test_logger_tmp(char *content, int len)
+{
+}
+
+static void *test_reader(void *ua)
+{
+	klog_f('E', KLOG_ALL, NULL, NULL, NULL, NULL, 0, "reader %p\n", ua);
+	__atomic_add_fetch(&__test_started, 1, __ATOMIC_RELEASE);
+
+	while (!__test_quit)
+		klog_f('E', KLOG_ALL, NULL, NULL, NULL, NULL, 0, "reader %p\n", ua);
+	return NULL;
+}
+
+/* Readers must go on while the loggers change, else they are stuck */
+static int test_lines_wait(unsigned long mark)
+{
+	unsigned long long end = mono_usec() + TEST_WAIT_USEC;
+
+	while (__atomic_load_n(&__test_lines, __ATOMIC_RELAXED) == mark) {
+		if (mono_usec() > end)
+			return -1;
+		sched_yield();
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t thd[TEST_THREADS];
+	unsigned long mark = 0;
+	int i, ret = 0, loop = argc > 1 ? atoi(argv[1]) : 1000;
+
+	klog_init(argc, argv);
+	klog_add_logger(test_logger);
+
+	for (i = 0; i < TEST_THREADS; i++)
+		pthread_create(&thd[i], NULL, test_reader, (void*)(long)i);
+	while (__atomic_load_n(&__test_started, __ATOMIC_ACQUIRE) < TEST_THREADS)
+		sched_yield();
+
+	for (i = 0; i < loop && !ret; i++) {
+		if (i % TEST_STEP == 0)
+			mark = __atomic_load_n(&__test_lines, __ATOMIC_RELAXED);
+
+		klog_add_logger(test_logger_tmp);
+		klog_del_logger(test_logger_tmp);
+
+		if (i % TEST_STEP == TEST_STEP - 1 || i == loop - 1)
+			ret = test_lines_wait(mark);
+	}
+
+	__test_quit = 1;
+	for (i = 0; i < TEST_THREADS; i++)
+		pthread_join(thd[i], NULL);
+
+	printf("%d logger replaces, %lu lines: %s\n", loop * 2,
+			__atomic_load_n(&__test_lines, __ATOMIC_RELAXED),
+			ret ? "FAIL" : "ok");
+	return ret ? 1 : 0;
+}
+#endif /* KLOG_TEST */
@@ -8,8 +8,14 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <spawn.h>
 
 #include <hilda/helper.h>
+#include <hilda/kmem.h>
 #include <hilda/xtcool.h>
 #include <hilda/klog.h>
 #include <hilda/klogger.h>
@@ -53,9 +59,9 @@ void klog_del_stderr_logger()
  */
 #include <pwd.h>
 
-struct _filelog_info_s {
-	char user[256];
+static char __user[256];
 
+struct _filelog_info_s {
 	/*
 	 * /tmp/xxlog-%U-%P_%N%Y%R%S%F%M.log
 	 *
@@ -98,20 +104,25 @@ static void get_user_name()
 
 	pass = getpwuid(geteuid());
 	if (pass)
-		strcpy(__fi.user, pass->pw_name);
+		strcpy(__user, pass->pw_name);
 	else
-		strcpy(__fi.user, "(zbd)");
+		strcpy(__user, "(zbd)");
 }
 
-static void set_file_path()
+/*
+ * Convert pathfmt to path, *index is updated if %I used.
+ * Return 1 if %I in pathfmt.
+ */
+static int build_file_path(const char *pathfmt, unsigned int *pindex, char *path)
 {
 #define APPEND(fmt, val) bpos += sprintf(buf + bpos, fmt, val);
 
-	char c, *p, buf[sizeof(__fi.path)];
+	char c, buf[256];
+	const char *p;
 	int percent, bpos;
 
 	int use_index = 0;
-	unsigned int index = __fi.index;
+	unsigned int index = *pindex;
 
 	time_t now = time(NULL);
 	struct tm tm;
@@ -125,7 +136,7 @@ try:
 	percent = 0;
 	bpos = 0;
 
-	for (p = __fi.pathfmt; *p; p++) {
+	for (p = pathfmt; *p; p++) {
 		c = *p;
 
 		if (percent) {
@@ -152,7 +163,7 @@ try:
 				APPEND("%d", getpid());
 				break;
 			case 'U':
-				APPEND("%s", __fi.user);
+				APPEND("%s", __user);
 				break;
 			case 'I':
 				APPEND("%04d", index);
@@ -162,7 +173,7 @@ try:
 				APPEND("%s", "%");
 				break;
 			default:
-				fprintf(stderr, "Bad fmt: '%s'\n", __fi.pathfmt);
+				fprintf(stderr, "Bad fmt: '%s'\n", pathfmt);
 				break;
 			}
 			percent = 0;
@@ -180,10 +191,16 @@ try:
 			index++;
 			goto try;
 		} else
-			__fi.index = index + 1;
+			*pindex = index + 1;
 	}
 
-	strcpy(__fi.path, buf);
+	strcpy(path, buf);
+	return use_index;
+}
+
+static void set_file_path()
+{
+	build_file_path(__fi.pathfmt, &__fi.index, __fi.path);
 }
 
 static void next_file(int append)
@@ -269,30 +286,345 @@ void klog_del_file_logger()
 }
 
 
+/*-----------------------------------------------------------------------
+ * Log to mmap'd file segments
+ *
+ * A segment is a file preallocated to the full size and mapped, a log is
+ * only a memcpy. When it is full, it is swapped with the spare one made by
+ * the background thread, which then truncates the old one to the real
+ * size, compresses it and prepares the next spare.
+ */
+typedef struct _mseg_s mseg_s;
+struct _mseg_s {
+	mseg_s *next;
+
+	char path[256];
+	int fd;
+	char *map;
+	unsigned int size, ofs;
+};
+
+struct _mmaplog_info_s {
+	char pathfmt[256];
+	unsigned int index;
+
+	unsigned int segsize;
+	unsigned int flush_ms;
+
+	/* Program and arguments, the path of segment is appended */
+	char *compress[9];
+	char compress_buf[256];
+
+	/* Protect cur, spare and retired */
+	SPL_HANDLE lck;
+	mseg_s *cur, *spare, *retired;
+
+	SPL_HANDLE sem;
+	SPL_HANDLE thread;
+	int quit;
+};
+
+static struct _mmaplog_info_s __mi;
+
+static mseg_s *mseg_open(void)
+{
+	mseg_s *seg = (mseg_s*)kmem_alloz(1, mseg_s);
+	unsigned int dup = 0;
+	int len;
+
+	/* Never overwrite an old segment, lock it for the spare and swap */
+	spl_lck_get(__mi.lck);
+	build_file_path(__mi.pathfmt, &__mi.index, seg->path);
+	len = strlen(seg->path);
+	while (kvfs_exist(seg->path) && len < sizeof(seg->path) - 12)
+		sprintf(seg->path + len, ".%u", ++dup);
+
+	seg->fd = open(seg->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	spl_lck_rel(__mi.lck);
+	if (seg->fd < 0) {
+		fprintf(stderr, "mseg_open: open '%s' error: %d\n", seg->path, errno);
+		goto fail;
+	}
+
+	if (posix_fallocate(seg->fd, 0, __mi.segsize) &&
+			ftruncate(seg->fd, __mi.segsize)) {
+		fprintf(stderr, "mseg_open: fallocate '%s' error: %d\n", seg->path, errno);
+		goto fail;
+	}
+
+	seg->map = mmap(NULL, __mi.segsize, PROT_READ | PROT_WRITE,
+			MAP_SHARED, seg->fd, 0);
+	if (seg->map == MAP_FAILED) {
+		fprintf(stderr, "mseg_open: mmap '%s' error: %d\n", seg->path, errno);
+		goto fail;
+	}
+
+	seg->size = __mi.segsize;
+	return seg;
+
+fail:
+	if (seg->fd >= 0) {
+		close(seg->fd);
+		unlink(seg->path);
+	}
+	kmem_free(seg);
+	return NULL;
+}
+
+static void mseg_compress(const char *path)
+{
+	extern char **environ;
+	char *argv[10];
+	pid_t pid;
+	int i, status;
+
+	for (i = 0; __mi.compress[i]; i++)
+		argv[i] = __mi.compress[i];
+	argv[i++] = (char*)path;
+	argv[i] = NULL;
+
+	if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ)) {
+		fprintf(stderr, "mseg_compress: spawn '%s' error: %d\n", argv[0], errno);
+		return;
+	}
+	waitpid(pid, &status, 0);
+}
+
+/* Close the segment, the unused tail is cut off */
+static void mseg_close(mseg_s *seg, int compress)
+{
+	munmap(seg->map, seg->size);
+	if (ftruncate(seg->fd, seg->ofs))
+		fprintf(stderr, "mseg_close: ftruncate '%s' error: %d\n", seg->path, errno);
+	close(seg->fd);
+
+	if (!seg->ofs)
+		unlink(seg->path);
+	else if (compress && __mi.compress[0])
+		mseg_compress(seg->path);
+
+	kmem_free(seg);
+}
+
+static void *mmap_logger_thread(void *ua)
+{
+	mseg_s *seg, *retired;
+	int need_spare;
+
+	while (!__mi.quit) {
+		spl_sema_get(__mi.sem, __mi.flush_ms);
+
+		spl_lck_get(__mi.lck);
+		retired = __mi.retired;
+		__mi.retired = NULL;
+		need_spare = !__mi.spare;
+
+		/* Only this thread unmaps segments, so cur is safe after unlock */
+		seg = __mi.cur;
+		spl_lck_rel(__mi.lck);
+
+		if (seg)
+			msync(seg->map, seg->ofs, MS_ASYNC);
+
+		while (retired) {
+			seg = retired;
+			retired = retired->next;
+			mseg_close(seg, 1);
+		}
+
+		if (need_spare && !__mi.quit) {
+			seg = mseg_open();
+
+			spl_lck_get(__mi.lck);
+			if (!__mi.spare) {
+				__mi.spare = seg;
+				seg = NULL;
+			}
+			spl_lck_rel(__mi.lck);
+
+			if (seg)
+				mseg_close(seg, 0);
+		}
+	}
+
+	return NULL;
+}
+
+/* XXX: should be called within __mi.lck */
+static void mmap_logger_swap(void)
+{
+	mseg_s *seg = __mi.spare;
+
+	if (!seg)
+		seg = mseg_open();
+	__mi.spare = NULL;
+
+	if (__mi.cur) {
+		__mi.cur->next = __mi.retired;
+		__mi.retired = __mi.cur;
+	}
+	__mi.cur = seg;
+
+	spl_sema_rel(__mi.sem);
+}
+
+static void builtin_logger_mmap(char *content, int len)
+{
+	mseg_s *seg;
+	int nl = (len > 0 && content[len - 1] != '\n');
+
+	spl_lck_get(__mi.lck);
+
+	seg = __mi.cur;
+	if (!seg || seg->ofs + len + nl > seg->size) {
+		mmap_logger_swap();
+		seg = __mi.cur;
+	}
+
+	if (seg) {
+		if (len + nl > seg->size)
+			len = seg->size - nl;
+
+		memcpy(seg->map + seg->ofs, content, len);
+		seg->ofs += len;
+		if (nl)
+			seg->map[seg->ofs++] = '\n';
+	}
+
+	spl_lck_rel(__mi.lck);
+}
+
+/**
+ * \brief Log to preallocated, mmap'd file segments.
+ *
+ * \param pathfmt Same as klog_add_file_logger, a suffix is added if the
+ *        path already exists.
+ * \param size Size of each segment, 0 for 16M.
+ * \param flush_ms Interval to msync the current segment, 0 for 1000.
+ * \param compress Command to compress a full segment, e.g. "gzip -f",
+ *        NULL for no compression.
+ */
+void klog_add_mmap_logger(const char *pathfmt, unsigned int size,
+		unsigned int flush_ms, const char *compress)
+{
+	char *p;
+	int i;
+
+	klog_del_mmap_logger();
+
+	get_user_name();
+
+	strncpy(__mi.pathfmt, pathfmt, sizeof(__mi.pathfmt) - 1);
+	__mi.segsize = size ? size : 16 * 1024 * 1024;
+	__mi.flush_ms = flush_ms ? flush_ms : 1000;
+
+	memset(__mi.compress, 0, sizeof(__mi.compress));
+	if (compress) {
+		strncpy(__mi.compress_buf, compress, sizeof(__mi.compress_buf) - 1);
+		p = strtok(__mi.compress_buf, " \t");
+		for (i = 0; p && i < 8; i++) {
+			__mi.compress[i] = p;
+			p = strtok(NULL, " \t");
+		}
+	}
+
+	if (!__mi.lck) {
+		__mi.lck = spl_lck_new();
+		__mi.sem = spl_sema_new(0);
+	}
+
+	__mi.quit = 0;
+	__mi.thread = spl_thread_create(mmap_logger_thread, NULL, 0);
+
+	klog_add_logger(builtin_logger_mmap);
+}
+
+void klog_del_mmap_logger(void)
+{
+	mseg_s *seg;
+
+	if (!__mi.thread)
+		return;
+
+	klog_del_logger(builtin_logger_mmap);
+
+	__mi.quit = 1;
+	spl_sema_rel(__mi.sem);
+	spl_thread_wait(__mi.thread);
+	__mi.thread = NULL;
+
+	spl_lck_get(__mi.lck);
+	while (__mi.retired) {
+		seg = __mi.retired;
+		__mi.retired = seg->next;
+		mseg_close(seg, 1);
+	}
+	if (__mi.cur)
+		mseg_close(__mi.cur, 1);
+	if (__mi.spare)
+		mseg_close(__mi.spare, 0);
+	__mi.cur = __mi.spare = NULL;
+	spl_lck_rel(__mi.lck);
+}
+
+
 /*-----------------------------------------------------------------------
  * Log to network
+ *
+ * The logger only copies the line into a bounded ring, a background thread
+ * connects, sends in batch and reconnects with backoff. Lines are dropped
+ * and counted when the ring is full, the caller is never blocked.
  */
-static int __sock = -1;
+#include <poll.h>
+#include <sys/uio.h>
+
+#define NET_BACKOFF_MIN         100
+#define NET_BACKOFF_MAX         30000
+#define NET_CONNECT_TIMEOUT     3000
+
+struct _netlog_info_s {
+	char addr[128];
+	unsigned short port;
+	int udp;
+
+	int sock;
+
+	/* Ring, size is power of 2. head and tail are protected by lck */
+	char *buf;
+	unsigned int size, head, tail;
+	SPL_HANDLE lck;
+
+	unsigned long dropped;
+
+	SPL_HANDLE sem;
+	SPL_HANDLE thread;
+	int quit;
+};
 
-static char __addr[128];
-static unsigned short __port;
+static struct _netlog_info_s __ni = { .sock = -1 };
 
 static void config_socket(int s)
 {
 	int yes = 1;
 	struct linger lin;
+	struct timeval tv = { 1, 0 };
 
 	lin.l_onoff = 0;
 	lin.l_linger = 0;
 	setsockopt(s, SOL_SOCKET, SO_LINGER, (const char *) &lin, sizeof(lin));
 	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+
+	/* So the thread can see quit */
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 }
 
-static int connect_to_serv(const char *server, unsigned short port, int *retfd)
+static int connect_to_serv(const char *server, unsigned short port, int udp, int *retfd)
 {
-	int sockfd;
+	int sockfd, flags, err = 0;
+	socklen_t errlen = sizeof(err);
 	struct hostent *he;
 	struct sockaddr_in their_addr;
+	struct pollfd pfd;
 
 	fprintf(stderr, "connect_to_serv: server:<%s>, port:%d\n", server, port);
 
@@ -300,7 +632,7 @@ static int connect_to_serv(const char *server, unsigned short port, int *retfd)
 		fprintf(stderr, "connect_to_serv: gethostbyname error: %s.\n", strerror(errno));
 		return -1;
 	}
-	if ((sockfd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
+	if ((sockfd = socket(PF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0)) == -1) {
 		fprintf(stderr, "connect_to_serv: socket error: %s.\n", strerror(errno));
 		return -1;
 	}
@@ -310,53 +642,239 @@ static int connect_to_serv(const char *server, unsigned short port, int *retfd)
 	memcpy((char*)&their_addr.sin_addr, he->h_addr, he->h_length);
 	their_addr.sin_port = htons(port);
 
+	/* Connect with timeout */
+	flags = fcntl(sockfd, F_GETFL, 0);
+	fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+
 	if (connect(sockfd, (struct sockaddr *)&their_addr,
 				sizeof their_addr) == -1) {
-		fprintf(stderr, "connect_to_serv: connect error: %s.\n", strerror(errno));
-		close(sockfd);
-		return -1;
+		if (errno != EINPROGRESS)
+			goto fail;
+
+		pfd.fd = sockfd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, NET_CONNECT_TIMEOUT) != 1) {
+			errno = ETIMEDOUT;
+			goto fail;
+		}
+		getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+		if (err) {
+			errno = err;
+			goto fail;
+		}
 	}
 
+	fcntl(sockfd, F_SETFL, flags);
 	config_socket(sockfd);
 
 	*retfd = sockfd;
 	fprintf(stderr, "connect_to_serv: retfd: %d\n", sockfd);
 	return 0;
+
+fail:
+	fprintf(stderr, "connect_to_serv: connect error: %s.\n", strerror(errno));
+	close(sockfd);
+	return -1;
+}
+
+/* Data in ring from ofs, at most len bytes, wrap is handled */
+static int ring_iov(unsigned int ofs, unsigned int len, struct iovec *iov)
+{
+	unsigned int pos = ofs & (__ni.size - 1);
+
+	iov[0].iov_base = __ni.buf + pos;
+	if (pos + len <= __ni.size) {
+		iov[0].iov_len = len;
+		return 1;
+	}
+
+	iov[0].iov_len = __ni.size - pos;
+	iov[1].iov_base = __ni.buf;
+	iov[1].iov_len = len - iov[0].iov_len;
+	return 2;
+}
+
+/* Like writev, but no SIGPIPE when peer closed */
+static int net_send_tcp(unsigned int tail, unsigned int len)
+{
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = ring_iov(tail, len, iov);
+
+	n = sendmsg(__ni.sock, &msg, MSG_NOSIGNAL);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	return n;
+}
+
+/* One datagram for one line */
+static int net_send_udp(unsigned int tail, unsigned int len)
+{
+	struct iovec iov[2];
+	struct msghdr msg;
+	unsigned int i, sent = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+
+	for (i = 0; i < len; i++) {
+		if (__ni.buf[(tail + i) & (__ni.size - 1)] != '\n')
+			continue;
+
+		msg.msg_iovlen = ring_iov(tail + sent, i + 1 - sent, iov);
+		if (sendmsg(__ni.sock, &msg, MSG_NOSIGNAL) < 0 && errno != EMSGSIZE)
+			return sent ? sent : -1;
+		sent = i + 1;
+	}
+
+	return sent;
+}
+
+static void *network_logger_thread(void *ua)
+{
+	unsigned int tail, len, backoff = NET_BACKOFF_MIN;
+	int n;
+
+	while (!__ni.quit) {
+		if (__ni.sock == -1) {
+			if (connect_to_serv(__ni.addr, __ni.port, __ni.udp, &__ni.sock)) {
+				spl_sema_get(__ni.sem, backoff);
+				backoff = backoff * 2 > NET_BACKOFF_MAX ? NET_BACKOFF_MAX : backoff * 2;
+				continue;
+			}
+			backoff = NET_BACKOFF_MIN;
+		}
+
+		spl_lck_get(__ni.lck);
+		tail = __ni.tail;
+		len = __ni.head - __ni.tail;
+		spl_lck_rel(__ni.lck);
+
+		if (!len) {
+			spl_sema_get(__ni.sem, 1000);
+			continue;
+		}
+
+		/* Only this thread moves tail, [tail, head) is stable */
+		n = __ni.udp ? net_send_udp(tail, len) : net_send_tcp(tail, len);
+		if (n < 0) {
+			close(__ni.sock);
+			__ni.sock = -1;
+			continue;
+		}
+
+		spl_lck_get(__ni.lck);
+		__ni.tail += n;
+		spl_lck_rel(__ni.lck);
+	}
+
+	return NULL;
 }
 
 static void builtin_logger_network(char *content, int len)
 {
-	if (__sock == -1)
-		connect_to_serv(__addr, __port, &__sock);
-	if (__sock == -1)
+	unsigned int pos, part, used;
+	int nl;
+
+	if (len <= 0)
 		return;
+	nl = (content[len - 1] != '\n');
+
+	spl_lck_get(__ni.lck);
+
+	used = __ni.head - __ni.tail;
+	if (__ni.size - used < len + nl) {
+		__ni.dropped++;
+		spl_lck_rel(__ni.lck);
+		return;
+	}
 
-	if (len != send(__sock, content, len, 0)) {
-		if (__sock != -1)
-			close(__sock);
-		__sock = -1;
-	} else if (content[len - 1] != '\n')
-		send(__sock, "\n", 1, 0);
+	pos = __ni.head & (__ni.size - 1);
+	part = __ni.size - pos;
+	if (part > len)
+		part = len;
+	memcpy(__ni.buf + pos, content, part);
+	memcpy(__ni.buf, content + part, len - part);
+	__ni.head += len;
+
+	if (nl) {
+		__ni.buf[__ni.head & (__ni.size - 1)] = '\n';
+		__ni.head++;
+	}
+
+	spl_lck_rel(__ni.lck);
+
+	if (!used)
+		spl_sema_rel(__ni.sem);
 }
 
-void klog_add_network_logger(const char *addr, unsigned short port)
+/**
+ * \brief Log to a TCP or UDP collector.
+ *
+ * \param bufsize Size of the ring, rounded up to power of 2, 0 for 1M.
+ *        Lines are dropped when the ring is full, see
+ *        klog_network_dropped.
+ */
+void klog_add_network_logger_ex(const char *addr, unsigned short port,
+		int udp, unsigned int bufsize)
 {
-	strncpy(__addr, addr, sizeof(__addr));
-	__port = port;
+	unsigned int size = 4096;
+
+	klog_del_network_logger();
+
+	if (!bufsize)
+		bufsize = 1024 * 1024;
+	while (size < bufsize)
+		size <<= 1;
+
+	strncpy(__ni.addr, addr, sizeof(__ni.addr) - 1);
+	__ni.port = port;
+	__ni.udp = udp;
+
+	if (!__ni.lck) {
+		__ni.lck = spl_lck_new();
+		__ni.sem = spl_sema_new(0);
+	}
+
+	__ni.buf = kmem_alloc(size, char);
+	__ni.size = size;
+	__ni.head = __ni.tail = 0;
 
-	if (__sock != -1)
-		close(__sock);
-	__sock = -1;
+	__ni.quit = 0;
+	__ni.thread = spl_thread_create(network_logger_thread, NULL, 0);
 
 	klog_add_logger(builtin_logger_network);
 }
 
+void klog_add_network_logger(const char *addr, unsigned short port)
+{
+	klog_add_network_logger_ex(addr, port, 0, 0);
+}
+
 void klog_del_network_logger(void)
 {
+	if (!__ni.thread)
+		return;
+
 	klog_del_logger(builtin_logger_network);
 
-	if (__sock != -1)
-		close(__sock);
-	__sock = -1;
+	__ni.quit = 1;
+	spl_sema_rel(__ni.sem);
+	spl_thread_wait(__ni.thread);
+	__ni.thread = NULL;
+
+	if (__ni.sock != -1)
+		close(__ni.sock);
+	__ni.sock = -1;
+
+	kmem_free_z(__ni.buf);
 }
 
+unsigned long klog_network_dropped(void)
+{
+	return __ni.dropped;
+}
@@ -4,6 +4,12 @@
 #include <stdio.h>
 #include <memory.h>
 
+#if !(defined(__WIN32__) || defined(__WINCE__))
+#define KMEM_HAS_POOL
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
 #include <hilda/kmem.h>
 #include <hilda/klog.h>
 #include <hilda/xtcool.h>
@@ -11,120 +17,534 @@
 #include <hilda/kbuf.h>
 
 #ifdef MEM_STAT
-static kuint __g_mempeak = 0;
-static kuint __g_memusage = 0;
-static kuint __g_alloc_cnt = 0;
-static kuint __g_free_cnt = 0;
+/*
+ * Counters are sharded, a thread only touches its own shard and kmem_rpt
+ * sums them. The usage is pushed to __g_memusage when a shard drifted
+ * over STAT_SYNC, so the peak is exact to STAT_SHARDS * STAT_SYNC.
+ */
+#define STAT_SHARDS     64
+#define STAT_SYNC       (64 * 1024)
+
+typedef struct _stat_shard_s stat_shard_s;
+struct _stat_shard_s {
+	long alloc_cnt, free_cnt;
+	long usage, drift;
+} __attribute__((aligned(64)));
+
+static stat_shard_s __g_shards[STAT_SHARDS];
+static kthread_local stat_shard_s *__t_shard = NULL;
+static kuint __g_shard_next = 0;
+
+static long __g_memusage = 0;
+static long __g_mempeak = 0;
 
 static kuint __g_dump_loop = (kuint)-1;
+
+/* Blocks still alive of each kmem_alloc call site, see kmem_stat_dump */
+#define SITE_CNT        4096
+
+typedef struct _mem_site_s mem_site_s;
+struct _mem_site_s {
+	const char *file;
+	int line;
+
+	/* 0: empty, 1: being filled, 2: ready */
+	int state;
+
+	long cnt, bytes;
+};
+
+static mem_site_s __g_sites[SITE_CNT];
+
+/* Before every block, keep the usrptr 16 bytes aligned */
+typedef struct _mem_hdr_s mem_hdr_s;
+struct _mem_hdr_s {
+	mem_site_s *site;
+	size_t size;
+};
+
+static stat_shard_s *shard_get(void)
+{
+	kuint i;
+
+	if (unlikely(!__t_shard)) {
+		i = __atomic_fetch_add(&__g_shard_next, 1, __ATOMIC_RELAXED);
+		__t_shard = &__g_shards[i % STAT_SHARDS];
+	}
+	return __t_shard;
+}
+
+/* cnt is 1 for alloc, -1 for free and 0 for resize */
+static stat_shard_s *stat_add(mem_site_s *site, long bytes, int cnt)
+{
+	stat_shard_s *ss = shard_get();
+	long drift, usage, peak;
+
+	if (cnt > 0)
+		__atomic_add_fetch(&ss->alloc_cnt, 1, __ATOMIC_RELAXED);
+	else if (cnt < 0)
+		__atomic_add_fetch(&ss->free_cnt, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ss->usage, bytes, __ATOMIC_RELAXED);
+
+	drift = __atomic_add_fetch(&ss->drift, bytes, __ATOMIC_RELAXED);
+	if (drift > STAT_SYNC || drift < -STAT_SYNC) {
+		drift = __atomic_exchange_n(&ss->drift, 0, __ATOMIC_RELAXED);
+		usage = __atomic_add_fetch(&__g_memusage, drift, __ATOMIC_RELAXED);
+		peak = __atomic_load_n(&__g_mempeak, __ATOMIC_RELAXED);
+		while (usage > peak && !__atomic_compare_exchange_n(&__g_mempeak,
+					&peak, usage, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+	}
+
+	if (site) {
+		__atomic_add_fetch(&site->cnt, cnt, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&site->bytes, bytes, __ATOMIC_RELAXED);
+	}
+	return ss;
+}
+
+/* NULL if no file or the table is full */
+static mem_site_s *site_get(const char *file, int line)
+{
+	mem_site_s *site;
+	kuint i, h;
+	int state, empty;
+
+	if (!file)
+		return NULL;
+
+	h = (kuint)((unsigned long)file >> 3) ^ ((kuint)line * 2654435761U);
+	for (i = 0; i < SITE_CNT; i++) {
+		site = &__g_sites[(h + i) & (SITE_CNT - 1)];
+
+		state = __atomic_load_n(&site->state, __ATOMIC_ACQUIRE);
+		if (state == 0) {
+			empty = 0;
+			if (__atomic_compare_exchange_n(&site->state, &empty, 1, 0,
+						__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+				site->file = file;
+				site->line = line;
+				__atomic_store_n(&site->state, 2, __ATOMIC_RELEASE);
+				return site;
+			}
+			state = empty;
+		}
+		while (state == 1)
+			state = __atomic_load_n(&site->state, __ATOMIC_ACQUIRE);
+
+		if (site->file == file && site->line == line)
+			return site;
+	}
+	return NULL;
+}
+
+static int site_cmp(const void *a, const void *b)
+{
+	long x = (*(mem_site_s**)a)->bytes, y = (*(mem_site_s**)b)->bytes;
+
+	return x < y ? 1 : (x > y ? -1 : 0);
+}
 #endif
+/*-----------------------------------------------------------------------
+ * Pool, enabled by kmem_init(KMEM_POOL)
+ *
+ * Small blocks are carved from slabs in one reserved address range, so a
+ * block is known by its address, and the size class is kept per slab.
+ * Each thread caches the free blocks of every class, and exchanges them
+ * with the depot in batches of POOL_BATCH.
+ */
+#ifdef KMEM_HAS_POOL
+#define POOL_RESERVE    (sizeof(void*) == 8 ? (4UL << 30) : (256UL << 20))
+#define SLAB_SHIFT      16
+#define SLAB_SIZE       (1UL << SLAB_SHIFT)
+#define POOL_MAX        2048
+#define POOL_BATCH      32
+#define CLASS_CNT       16
 
-#ifdef MEM_STAT
-static void mem_set_size(void *usrptr, kuint size)
+static const kuint __cls_size[CLASS_CNT] = {
+	16, 32, 48, 64, 80, 96, 128, 160,
+	192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+typedef struct _pool_blk_s pool_blk_s;
+struct _pool_blk_s {
+	pool_blk_s *next;
+
+	/* Next batch, only for the first block of a batch in depot */
+	pool_blk_s *next_batch;
+};
+
+typedef struct _pool_cache_s pool_cache_s;
+struct _pool_cache_s {
+	pool_blk_s *head[CLASS_CNT];
+	kuint cnt[CLASS_CNT];
+};
+
+static struct {
+	int on;
+
+	char *base;
+	unsigned long size, used;
+
+	/* Size class of each slab */
+	unsigned char *slab_cls;
+
+	/* Index by (size + 15) >> 4 */
+	unsigned char cls_of[POOL_MAX / 16 + 1];
+
+	pthread_mutex_t lck[CLASS_CNT];
+	pool_blk_s *depot[CLASS_CNT];
+
+	pthread_key_t key;
+} __pool;
+
+static kthread_local pool_cache_s *__t_cache = NULL;
+
+static kinline int pool_own(void *p)
+{
+	return (char*)p >= __pool.base && (char*)p < __pool.base + __pool.size;
+}
+
+static kinline int pool_cls(void *p)
+{
+	return __pool.slab_cls[((char*)p - __pool.base) >> SLAB_SHIFT];
+}
+
+static void depot_put(int cls, pool_blk_s *batch)
+{
+	pthread_mutex_lock(&__pool.lck[cls]);
+	batch->next_batch = __pool.depot[cls];
+	__pool.depot[cls] = batch;
+	pthread_mutex_unlock(&__pool.lck[cls]);
+}
+
+static pool_blk_s *depot_get(int cls)
+{
+	pool_blk_s *batch;
+
+	pthread_mutex_lock(&__pool.lck[cls]);
+	batch = __pool.depot[cls];
+	if (batch)
+		__pool.depot[cls] = batch->next_batch;
+	pthread_mutex_unlock(&__pool.lck[cls]);
+
+	return batch;
+}
+
+/* Give all the cached blocks back to depot */
+static void cache_flush(pool_cache_s *pc)
+{
+	pool_blk_s *batch, *blk;
+	int cls, i;
+
+	for (cls = 0; cls < CLASS_CNT; cls++)
+		while ((batch = pc->head[cls])) {
+			for (blk = batch, i = 1; blk->next && i < POOL_BATCH; i++)
+				blk = blk->next;
+			pc->head[cls] = blk->next;
+			blk->next = NULL;
+			depot_put(cls, batch);
+		}
+	memset(pc->cnt, 0, sizeof(pc->cnt));
+}
+
+static void cache_release(void *ua)
+{
+	pool_cache_s *pc = (pool_cache_s*)ua;
+
+	cache_flush(pc);
+	free(pc);
+	__t_cache = NULL;
+}
+
+static pool_cache_s *cache_get(void)
 {
-	kuint *p = (kuint*)usrptr;
+	pool_cache_s *pc = __t_cache;
+
+	if (likely(pc))
+		return pc;
 
-	p--;
-	*p = size;
+	pc = (pool_cache_s*)calloc(1, sizeof(pool_cache_s));
+	if (pc) {
+		pthread_setspecific(__pool.key, pc);
+		__t_cache = pc;
+	}
+	return pc;
 }
 
-static kuint mem_get_size(void *usrptr)
+static int cache_refill(pool_cache_s *pc, int cls)
 {
-	kuint *p = (kuint*)usrptr;
+	pool_blk_s *blk, *batch;
+	unsigned long ofs;
+	kuint i, n, sz = __cls_size[cls];
+
+	batch = depot_get(cls);
+	if (batch) {
+		for (n = 1, blk = batch; blk->next; n++)
+			blk = blk->next;
+		pc->head[cls] = batch;
+		pc->cnt[cls] = n;
+		return 0;
+	}
+
+	ofs = __atomic_fetch_add(&__pool.used, SLAB_SIZE, __ATOMIC_RELAXED);
+	if (ofs + SLAB_SIZE > __pool.size)
+		return -1;
 
-	p--;
-	return *p;
+	__pool.slab_cls[ofs >> SLAB_SHIFT] = (unsigned char)cls;
+
+	n = SLAB_SIZE / sz;
+	for (i = 0; i < n; i++) {
+		blk = (pool_blk_s*)(__pool.base + ofs + i * sz);
+		blk->next = i + 1 < n ? (pool_blk_s*)((char*)blk + sz) : NULL;
+	}
+	pc->head[cls] = (pool_blk_s*)(__pool.base + ofs);
+	pc->cnt[cls] = n;
+	return 0;
 }
 
-static void *mem_usr_to_raw(void *usrptr)
+static void *pool_get(kuint size)
 {
-	kuint *p = (kuint*)usrptr;
+	pool_cache_s *pc = cache_get();
+	pool_blk_s *blk;
+	int cls = __pool.cls_of[(size + 15) >> 4];
+
+	if (unlikely(!pc))
+		return NULL;
 
-	p--;
-	return (void*)p;
+	blk = pc->head[cls];
+	if (unlikely(!blk)) {
+		if (cache_refill(pc, cls))
+			return NULL;
+		blk = pc->head[cls];
+	}
+
+	pc->head[cls] = blk->next;
+	pc->cnt[cls]--;
+	return (void*)blk;
 }
 
-static void *mem_raw_to_usr(void *rawptr)
+static void pool_rel(void *p)
 {
-	kuint *p = (kuint*)rawptr;
+	pool_cache_s *pc = cache_get();
+	pool_blk_s *blk = (pool_blk_s*)p, *batch;
+	int i, cls = pool_cls(p);
+
+	if (unlikely(!pc)) {
+		blk->next = NULL;
+		depot_put(cls, blk);
+		return;
+	}
 
-	p++;
-	return (void*)p;
+	blk->next = pc->head[cls];
+	pc->head[cls] = blk;
+
+	/* Keep at most 2 batches, give the newest one to depot */
+	if (unlikely(++pc->cnt[cls] >= 2 * POOL_BATCH)) {
+		batch = pc->head[cls];
+		for (i = 1; i < POOL_BATCH; i++)
+			blk = blk->next;
+		pc->head[cls] = blk->next;
+		pc->cnt[cls] -= POOL_BATCH;
+		blk->next = NULL;
+		depot_put(cls, batch);
+	}
 }
+
+static int pool_init(void)
+{
+	void *base;
+	kuint i, cls;
+
+	if (__pool.base)
+		return 0;
+
+	base = mmap(NULL, POOL_RESERVE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+		return -1;
+
+	__pool.slab_cls = (unsigned char*)calloc(POOL_RESERVE >> SLAB_SHIFT, 1);
+	if (!__pool.slab_cls) {
+		munmap(base, POOL_RESERVE);
+		return -1;
+	}
+
+	for (i = 0, cls = 0; i <= POOL_MAX / 16; i++) {
+		while (__cls_size[cls] < i * 16)
+			cls++;
+		__pool.cls_of[i] = (unsigned char)cls;
+	}
+
+	for (i = 0; i < CLASS_CNT; i++)
+		pthread_mutex_init(&__pool.lck[i], NULL);
+	pthread_key_create(&__pool.key, cache_release);
+
+	__pool.size = POOL_RESERVE;
+	__atomic_store_n(&__pool.base, (char*)base, __ATOMIC_RELEASE);
+	return 0;
+}
+#endif
+
+/* Backend, the pool or the system allocator */
+static kinline void *raw_get(kuint size)
+{
+#ifdef KMEM_HAS_POOL
+	void *p;
+
+	if (__pool.on && size <= POOL_MAX && (p = pool_get(size)))
+		return p;
+#endif
+	return malloc(size);
+}
+
+static kinline void raw_rel(void *p)
+{
+#ifdef KMEM_HAS_POOL
+	if (pool_own(p)) {
+		pool_rel(p);
+		return;
+	}
 #endif
+	free(p);
+}
 
+static void *raw_reget(void *p, kuint size)
+{
+#ifdef KMEM_HAS_POOL
+	void *np;
+	kuint osz;
+
+	if (p && pool_own(p)) {
+		osz = __cls_size[pool_cls(p)];
+		if (size <= osz)
+			return p;
+
+		np = raw_get(size);
+		if (np) {
+			memcpy(np, p, osz);
+			pool_rel(p);
+		}
+		return np;
+	}
+	if (!p)
+		return raw_get(size);
+#endif
+	return realloc(p, size);
+}
+
+/**
+ * \brief Setup kmem.
+ *
+ * \param a_flg KMEM_POOL to get the small blocks from the pool.
+ */
 kint kmem_init(kuint a_flg)
 {
+#ifdef KMEM_HAS_POOL
+	if (a_flg & KMEM_POOL) {
+		if (pool_init())
+			return -1;
+		__pool.on = 1;
+	}
+#endif
 	return 0;
 }
 
+/**
+ * \brief Stop allocating from the pool, the blocks already there are
+ * still released to it.
+ */
 kint kmem_final(kvoid)
 {
+#ifdef KMEM_HAS_POOL
+	__pool.on = 0;
+	if (__t_cache)
+		cache_flush(__t_cache);
+#endif
 	return 0;
 }
 
-kvoid *kmem_get(kuint size)
+kvoid *kmem_get_at(kuint size, const char *file, kint line)
 {
 #ifdef MEM_STAT
-	kuint *rawptr = malloc(size + sizeof(kuint));
-	kvoid *usrptr = mem_raw_to_usr(rawptr);
+	mem_hdr_s *hdr = (mem_hdr_s*)raw_get(size + sizeof(mem_hdr_s));
 
-	mem_set_size(usrptr, size);
+	if (!hdr)
+		return NULL;
 
-	__g_memusage += size;
-	__g_alloc_cnt++;
+	hdr->site = site_get(file, line);
+	hdr->size = size;
+	stat_add(hdr->site, size, 1);
 
-	if (__g_memusage > __g_mempeak)
-		__g_mempeak = __g_memusage;
+	return (kvoid*)(hdr + 1);
 #else
-	kvoid *usrptr = malloc(size);
+	return raw_get(size);
 #endif
-	return usrptr;
 }
 
-kvoid *kmem_get_z(kuint size)
+kvoid *kmem_get(kuint size)
 {
-	kvoid *usrptr = kmem_get(size);
+	return kmem_get_at(size, NULL, 0);
+}
+
+kvoid *kmem_get_z_at(kuint size, const char *file, kint line)
+{
+	kvoid *usrptr = kmem_get_at(size, file, line);
 
 	if (usrptr)
 		memset(usrptr, 0, size);
 	return usrptr;
 }
 
-kvoid *kmem_reget(kvoid *usrptr, kuint size)
+kvoid *kmem_get_z(kuint size)
+{
+	return kmem_get_z_at(size, NULL, 0);
+}
+
+kvoid *kmem_reget_at(kvoid *usrptr, kuint size, const char *file, kint line)
 {
 #ifdef MEM_STAT
-	kvoid *old_usrptr = usrptr, *new_usrptr;
-	kuint old_size;
+	mem_hdr_s *hdr;
+	mem_site_s *site;
+	size_t old_size;
 
-	if (!old_usrptr)
-		return kmem_get(size);
+	if (!usrptr)
+		return kmem_get_at(size, file, line);
 
-	old_size = mem_get_size(old_usrptr);
+	hdr = (mem_hdr_s*)usrptr - 1;
+	site = hdr->site;
+	old_size = hdr->size;
 
-	new_usrptr = kmem_get(size);
-	if (size > old_size)
-		kmem_move(new_usrptr, old_usrptr, old_size);
-	else
-		kmem_move(new_usrptr, old_usrptr, size);
-	kmem_rel(old_usrptr);
-#else
-	kvoid *new_usrptr;
+	/* Header moves with the block, only the size changes */
+	hdr = (mem_hdr_s*)raw_reget(hdr, size + sizeof(mem_hdr_s));
+	if (!hdr)
+		return NULL;
 
-	new_usrptr = realloc(usrptr, size);
+	hdr->size = size;
+	stat_add(site, (long)size - (long)old_size, 0);
+
+	return (kvoid*)(hdr + 1);
+#else
+	return raw_reget(usrptr, size);
 #endif
-	return new_usrptr;
+}
+
+kvoid *kmem_reget(kvoid *usrptr, kuint size)
+{
+	return kmem_reget_at(usrptr, size, NULL, 0);
 }
 
 kvoid kmem_rel(kvoid *usrptr)
 {
 #ifdef MEM_STAT
-	kvoid *old_usrptr = usrptr;
-	kvoid *old_rawptr = mem_usr_to_raw(old_usrptr);
-	kuint old_size = mem_get_size(old_usrptr);
+	mem_hdr_s *hdr;
+	stat_shard_s *ss;
 
-	__g_free_cnt++;
-	__g_memusage -= old_size;
+	if (!usrptr)
+		return;
+
+	hdr = (mem_hdr_s*)usrptr - 1;
+	ss = stat_add(hdr->site, -(long)hdr->size, -1);
 
 	if (__g_dump_loop == (kuint)-1) {
 		char *env = getenv("KMEM_DUMP_LOOP");
@@ -137,27 +557,44 @@ kvoid kmem_rel(kvoid *usrptr)
 			__g_dump_loop = (kuint)-2;
 	}
 
-	if (!(__g_free_cnt % __g_dump_loop))
-		klogs("\n\n#### MEMORY ####: ac:%d, fc:%d, now:%d\n\n\n",
-				__g_alloc_cnt, __g_free_cnt, __g_memusage);
+	/* Count of this shard, not the total */
+	if (!(ss->free_cnt % __g_dump_loop)) {
+		kint ac, fc, now;
+
+		kmem_rpt(&ac, &fc, &now, NULL);
+		klogs("\n\n#### MEMORY ####: ac:%d, fc:%d, now:%d\n\n\n", ac, fc, now);
+	}
 
-	free(old_rawptr);
+	raw_rel(hdr);
 #else
-	free(usrptr);
+	if (usrptr)
+		raw_rel(usrptr);
 #endif
 }
 
 kint kmem_rpt(kint *alloc_cnt, kint *free_cnt, kint *memusage, kint *mempeak)
 {
 #ifdef MEM_STAT
+	long ac = 0, fc = 0, usage = 0, peak;
+	int i;
+
+	for (i = 0; i < STAT_SHARDS; i++) {
+		ac += __atomic_load_n(&__g_shards[i].alloc_cnt, __ATOMIC_RELAXED);
+		fc += __atomic_load_n(&__g_shards[i].free_cnt, __ATOMIC_RELAXED);
+		usage += __atomic_load_n(&__g_shards[i].usage, __ATOMIC_RELAXED);
+	}
+	peak = __atomic_load_n(&__g_mempeak, __ATOMIC_RELAXED);
+	if (usage > peak)
+		peak = usage;
+
 	if (alloc_cnt)
-		*alloc_cnt = __g_alloc_cnt;
+		*alloc_cnt = (kint)ac;
 	if (free_cnt)
-		*free_cnt = __g_free_cnt;
+		*free_cnt = (kint)fc;
 	if (memusage)
-		*memusage = __g_memusage;
+		*memusage = (kint)usage;
 	if (mempeak)
-		*mempeak = __g_mempeak;
+		*mempeak = (kint)peak;
 	return 0;
 #else
 	if (alloc_cnt)
@@ -172,75 +609,397 @@ kint kmem_rpt(kint *alloc_cnt, kint *free_cnt, kint *memusage, kint *mempeak)
 #endif
 }
 
-kvoid* kmem_move(kvoid *to, kvoid *fr, kuint num)
+/**
+ * \brief Log the call sites which have the most bytes not freed.
+ *
+ * Only for MEM_STAT build, and only the blocks from kmem_alloc,
+ * kmem_alloz and kmem_realloc know their call sites.
+ *
+ * \param top How many sites to log, 0 for all.
+ */
+kvoid kmem_stat_dump(kint top)
+{
+#ifdef MEM_STAT
+	mem_site_s **arr;
+	kint i, cnt = 0;
+
+	arr = (mem_site_s**)malloc(SITE_CNT * sizeof(mem_site_s*));
+	if (!arr)
+		return;
+
+	for (i = 0; i < SITE_CNT; i++)
+		if (__atomic_load_n(&__g_sites[i].state, __ATOMIC_ACQUIRE) == 2 &&
+				__g_sites[i].cnt)
+			arr[cnt++] = &__g_sites[i];
+
+	qsort(arr, cnt, sizeof(mem_site_s*), site_cmp);
+	if (top <= 0 || top > cnt)
+		top = cnt;
+
+	klogs("#### MEMORY SITES ####: %d of %d\n", top, cnt);
+	for (i = 0; i < top; i++)
+		klogs("%10ld %8ld %s:%d\n", arr[i]->bytes, arr[i]->cnt,
+				arr[i]->file, arr[i]->line);
+
+	free(arr);
+#endif
+}
+
+/*-----------------------------------------------------------------------
+ * Arena
+ */
+#define ARENA_ALIGN(x)  (((x) + 15) & ~(unsigned long)15)
+#define ARENA_BLK       4096
+
+/* Heap block, the data follows */
+typedef struct _arena_blk_s arena_blk_s;
+struct _arena_blk_s {
+	arena_blk_s *next;
+	unsigned long pad;
+};
+
+/**
+ * \brief Setup an arena.
+ *
+ * \param buf First block, e.g. a buffer on stack, can be NULL.
+ * \param size Size of buf.
+ */
+kvoid kmem_arena_init(kmem_arena_s *ar, kvoid *buf, kuint size)
 {
-	kchar *s1, *s2;
+	ar->blks = NULL;
+	ar->buf = (char*)buf;
+	ar->size = buf ? size : 0;
+	ar->cur = ar->buf;
+	ar->end = ar->buf + ar->size;
+	ar->blk_size = ARENA_BLK;
+}
 
-	s1 = to;
-	s2 = fr;
-	if ((s2 < s1) && (s2 + num > s1))
-		goto back;
+/**
+ * \brief Free all the blocks, and back to the first block.
+ *
+ * The arena is reused after it, e.g. once per loop. The cost is by the
+ * count of blocks, not the allocations.
+ */
+kvoid kmem_arena_reset(kmem_arena_s *ar)
+{
+	arena_blk_s *blk = (arena_blk_s*)ar->blks, *next;
 
-	while (num > 0) {
-		*s1++ = *s2++;
-		num--;
+	while (blk) {
+		next = blk->next;
+		kmem_rel(blk);
+		blk = next;
 	}
-	return to;
 
-back:
-	s1 += num;
-	s2 += num;
-	while (num > 0) {
-		*--s1 = *--s2;
-		num--;
+	ar->blks = NULL;
+	ar->cur = ar->buf;
+	ar->end = ar->buf + ar->size;
+}
+
+/**
+ * \brief Free all the blocks, and forget the first block.
+ *
+ * The end of an arena from kmem_arena_init, the first block may be a
+ * buffer on stack which is gone after. An allocation after it does not
+ * touch the buffer, it comes from a new block and needs another release.
+ */
+kvoid kmem_arena_release(kmem_arena_s *ar)
+{
+	kmem_arena_reset(ar);
+
+	ar->buf = ar->cur = ar->end = NULL;
+	ar->size = 0;
+}
+
+/**
+ * \brief Create an arena on heap, the first block is with it.
+ */
+kmem_arena_s *kmem_arena_new(kuint blk_size)
+{
+	kmem_arena_s *ar;
+
+	if (!blk_size)
+		blk_size = ARENA_BLK;
+
+	ar = (kmem_arena_s*)kmem_get(ARENA_ALIGN(sizeof(kmem_arena_s)) + blk_size);
+	if (!ar)
+		return NULL;
+
+	kmem_arena_init(ar, (char*)ar + ARENA_ALIGN(sizeof(kmem_arena_s)), blk_size);
+	ar->blk_size = blk_size;
+	return ar;
+}
+
+kvoid kmem_arena_del(kmem_arena_s *ar)
+{
+	if (ar) {
+		kmem_arena_reset(ar);
+		kmem_rel(ar);
+	}
+}
+
+static kvoid *arena_grow(kmem_arena_s *ar, kuint size)
+{
+	arena_blk_s *blk;
+	kuint bsz = ar->blk_size;
+
+	/* Big one has its own block, keep filling the current block */
+	if (size > bsz / 4) {
+		blk = (arena_blk_s*)kmem_get(sizeof(arena_blk_s) + size);
+		if (!blk)
+			return NULL;
+		blk->next = (arena_blk_s*)ar->blks;
+		ar->blks = blk;
+		return (kvoid*)(blk + 1);
+	}
+
+	blk = (arena_blk_s*)kmem_get(sizeof(arena_blk_s) + bsz);
+	if (!blk)
+		return NULL;
+	blk->next = (arena_blk_s*)ar->blks;
+	ar->blks = blk;
+
+	ar->cur = (char*)(blk + 1) + size;
+	ar->end = (char*)(blk + 1) + bsz;
+	return (kvoid*)(blk + 1);
+}
+
+/**
+ * \brief Allocate from arena, 16 bytes aligned, never freed alone.
+ */
+kvoid *kmem_arena_get(kmem_arena_s *ar, kuint size)
+{
+	char *p = (char*)ARENA_ALIGN((unsigned long)ar->cur);
+
+	size = ARENA_ALIGN(size ? size : 1);
+	if (unlikely(!ar->cur || p + size > ar->end))
+		return arena_grow(ar, size);
+
+	ar->cur = p + size;
+	return (kvoid*)p;
+}
+
+kvoid *kmem_arena_get_z(kmem_arena_s *ar, kuint size)
+{
+	kvoid *p = kmem_arena_get(ar, size);
+
+	if (p)
+		memset(p, 0, size);
+	return p;
+}
+
+char *kmem_arena_strdup(kmem_arena_s *ar, const char *str)
+{
+	kuint len;
+	char *p;
+
+	if (!str)
+		return NULL;
+
+	len = strlen(str);
+	p = (char*)kmem_arena_get(ar, len + 1);
+	if (p)
+		memcpy(p, str, len + 1);
+	return p;
+}
+
+/*-----------------------------------------------------------------------
+ * Move
+ *
+ * The overlapped move loads a whole group before storing it, forward when
+ * to is lower, backward when higher, so a store never hits the bytes not
+ * loaded yet. The implementation is selected by CPU at the first call.
+ */
+typedef kvoid *(*move_fn)(kvoid *to, const kvoid *fr, kuint num);
+
+static kvoid *move_word(kvoid *to, const kvoid *fr, kuint num)
+{
+	unsigned char *d = (unsigned char*)to;
+	const unsigned char *s = (const unsigned char*)fr;
+	unsigned long w0, w1, w2, w3;
+	const kuint ws = sizeof(unsigned long);
+
+	if (d < s || d >= s + num) {
+		for (; num >= 4 * ws; num -= 4 * ws, s += 4 * ws, d += 4 * ws) {
+			memcpy(&w0, s, ws);
+			memcpy(&w1, s + ws, ws);
+			memcpy(&w2, s + 2 * ws, ws);
+			memcpy(&w3, s + 3 * ws, ws);
+			memcpy(d, &w0, ws);
+			memcpy(d + ws, &w1, ws);
+			memcpy(d + 2 * ws, &w2, ws);
+			memcpy(d + 3 * ws, &w3, ws);
+		}
+		for (; num >= ws; num -= ws, s += ws, d += ws) {
+			memcpy(&w0, s, ws);
+			memcpy(d, &w0, ws);
+		}
+		while (num--)
+			*d++ = *s++;
+	} else if (d != s) {
+		d += num;
+		s += num;
+		for (; num >= 4 * ws; num -= 4 * ws) {
+			s -= 4 * ws;
+			d -= 4 * ws;
+			memcpy(&w0, s, ws);
+			memcpy(&w1, s + ws, ws);
+			memcpy(&w2, s + 2 * ws, ws);
+			memcpy(&w3, s + 3 * ws, ws);
+			memcpy(d, &w0, ws);
+			memcpy(d + ws, &w1, ws);
+			memcpy(d + 2 * ws, &w2, ws);
+			memcpy(d + 3 * ws, &w3, ws);
+		}
+		for (; num >= ws; num -= ws) {
+			s -= ws;
+			d -= ws;
+			memcpy(&w0, s, ws);
+			memcpy(d, &w0, ws);
+		}
+		while (num--)
+			*--d = *--s;
 	}
 	return to;
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define MOVE_SIMD(name, isa, vec, load, store) \
+__attribute__((target(isa))) \
+static kvoid *name(kvoid *to, const kvoid *fr, kuint num) \
+{ \
+	unsigned char *d = (unsigned char*)to; \
+	const unsigned char *s = (const unsigned char*)fr; \
+	const kuint vs = sizeof(vec); \
+	vec v0, v1, v2, v3; \
+	\
+	if (d < s || d >= s + num) { \
+		for (; num >= 4 * vs; num -= 4 * vs, s += 4 * vs, d += 4 * vs) { \
+			v0 = load((const vec*)s); \
+			v1 = load((const vec*)(s + vs)); \
+			v2 = load((const vec*)(s + 2 * vs)); \
+			v3 = load((const vec*)(s + 3 * vs)); \
+			store((vec*)d, v0); \
+			store((vec*)(d + vs), v1); \
+			store((vec*)(d + 2 * vs), v2); \
+			store((vec*)(d + 3 * vs), v3); \
+		} \
+		for (; num >= vs; num -= vs, s += vs, d += vs) \
+			store((vec*)d, load((const vec*)s)); \
+		move_word(d, s, num); \
+		return to; \
+	} \
+	if (d == s) \
+		return to; \
+	\
+	d += num; \
+	s += num; \
+	for (; num >= 4 * vs; num -= 4 * vs) { \
+		s -= 4 * vs; \
+		d -= 4 * vs; \
+		v0 = load((const vec*)s); \
+		v1 = load((const vec*)(s + vs)); \
+		v2 = load((const vec*)(s + 2 * vs)); \
+		v3 = load((const vec*)(s + 3 * vs)); \
+		store((vec*)d, v0); \
+		store((vec*)(d + vs), v1); \
+		store((vec*)(d + 2 * vs), v2); \
+		store((vec*)(d + 3 * vs), v3); \
+	} \
+	for (; num >= vs; num -= vs) { \
+		s -= vs; \
+		d -= vs; \
+		store((vec*)d, load((const vec*)s)); \
+	} \
+	move_word(d - num, s - num, num); \
+	return to; \
+}
+
+MOVE_SIMD(move_sse2, "sse2", __m128i, _mm_loadu_si128, _mm_storeu_si128)
+MOVE_SIMD(move_avx2, "avx2", __m256i, _mm256_loadu_si256, _mm256_storeu_si256)
+#endif
+
+static kvoid *move_init(kvoid *to, const kvoid *fr, kuint num);
+static move_fn __move = move_init;
+
+static kvoid *move_init(kvoid *to, const kvoid *fr, kuint num)
+{
+	move_fn fn = move_word;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		fn = move_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		fn = move_sse2;
+#endif
+
+	__atomic_store_n(&__move, fn, __ATOMIC_RELAXED);
+	return fn(to, fr, num);
+}
+
+kvoid* kmem_move(kvoid *to, kvoid *fr, kuint num)
+{
+	return __move(to, fr, num);
+}
+
+/*-----------------------------------------------------------------------
+ * Dump
+ */
+static const char __hex_lo[] = "0123456789abcdef";
+
+#define DUMP_PUTS(p, s) do { memcpy((p), (s), sizeof(s) - 1); (p) += sizeof(s) - 1; } while (0)
+
 void kmem_dump(const char *banner, char *dat, int len, int width)
 {
-	int i, line, offset = 0, blen;
-	char cache[2048], *pbuf, *p;
+	int i, line, offset = 0;
+	unsigned char c;
+	char *p;
 
 	kbuf_s kb;
 
 	if (width <= 0)
 		width = 16;
 
-	/* 6 => "%04x  "; 3 => "%02x ", 1 => "%c", 2 => " |", 2 => "|\n" */
-	blen = 6 + (3 + 1) * width + 2 + 2;
-	if (blen > sizeof(cache))
-		pbuf = (char*)kmem_alloc(blen, char);
-	else
-		pbuf = cache;
-
-	kbuf_init(&kb, (blen + 2) * (len / width + 1) + 1024 + strlen(banner));
+	kbuf_init(&kb, (6 + 4 * width + 64) * (len / width + 1) + 1024 + strlen(banner));
 
 	kbuf_addf(&kb, "\n\x1b[91;40m%s\x1b[0m\n", banner);
 	kbuf_addf(&kb, "\x1b[1;32;40mData:%p, Length:%d\x1b[0m\n", dat, len);
 
 	while (offset < len) {
-		p = pbuf;
-
-		p += sprintf(p, "\x1b[1;31;40m%04x  \x1b[0m", offset);
 		line = len - offset;
-
 		if (line > width)
 			line = width;
 
-		for (i = 0; i < line; i++)
-			p += sprintf(p, "%02x ", (kuchar)dat[i]);
-		for (; i < width; i++)
-			p += sprintf(p, "   ");
+		/* offset may be longer than 4 digits */
+		kbuf_grow(&kb, 4 * width + 64);
+		p = kb.buf + kb.len;
+
+		DUMP_PUTS(p, "\x1b[1;31;40m");
+		p += sprintf(p, "%04x  ", offset);
+		DUMP_PUTS(p, "\x1b[0m");
 
-		p += sprintf(p, " \x1b[1;33;40m|");
-		for (i = 0; i < line; i++)
-			if ((kuchar)dat[i] >= 0x20 && (kuchar)dat[i] < 0x7f)
-				p += sprintf(p, "%c",  (kuchar)dat[i]);
-			else
-				p += sprintf(p, ".");
-		p += sprintf(p, "|\x1b[0m\n");
-		kbuf_addf(&kb, "%s", pbuf);
+		for (i = 0; i < line; i++) {
+			c = (unsigned char)dat[i];
+			*p++ = __hex_lo[c >> 4];
+			*p++ = __hex_lo[c & 0x0f];
+			*p++ = ' ';
+		}
+		for (; i < width; i++) {
+			*p++ = ' ';
+			*p++ = ' ';
+			*p++ = ' ';
+		}
+
+		DUMP_PUTS(p, " \x1b[1;33;40m|");
+		for (i = 0; i < line; i++) {
+			c = (unsigned char)dat[i];
+			*p++ = (c >= 0x20 && c < 0x7f) ? (char)c : '.';
+		}
+		DUMP_PUTS(p, "|\x1b[0m\n");
+
+		kbuf_setlen(&kb, p - kb.buf);
 
 		offset += line;
 		dat += width;
@@ -248,8 +1007,100 @@ void kmem_dump(const char *banner, char *dat, int len, int width)
 
 	klogs("%s", kb.buf);
 	kbuf_release(&kb);
+}
+
+#ifdef KMEM_TEST
+#include <time.h>
+
+static kvoid *move_byte(kvoid *to, kvoid *fr, kuint num)
+{
+	kchar *s1 = to, *s2 = fr;
+
+	if ((s2 < s1) && (s2 + num > s1)) {
+		s1 += num;
+		s2 += num;
+		while (num-- > 0)
+			*--s1 = *--s2;
+	} else
+		while (num-- > 0)
+			*s1++ = *s2++;
+	return to;
+}
+
+static double now_sec(void)
+{
+	struct timespec tp;
 
-	if (pbuf != cache)
-		kmem_free(pbuf);
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec / 1e9;
 }
 
+static int move_check(char *a, char *b, int size)
+{
+	int i, fo, to, n;
+
+	for (i = 0; i < 2000; i++) {
+		fo = rand() % size;
+		to = rand() % size;
+		n = rand() % (size - (fo > to ? fo : to));
+		kmem_move(a + to, a + fo, n);
+		memmove(b + to, b + fo, n);
+		if (memcmp(a, b, size))
+			return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static kuint sizes[] = { 16, 100, 4096, 1 << 20 };
+	char *buf, *ref;
+	double t, mb;
+	int i, j, loop, size = 4 << 20;
+
+	buf = malloc(size + 64);
+	ref = malloc(size + 64);
+	for (i = 0; i < size + 64; i++)
+		buf[i] = ref[i] = (char)rand();
+
+	printf("check: %s\n", move_check(buf, ref, 4096) ? "FAIL" : "ok");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		loop = (256 << 20) / sizes[i];
+		mb = (double)loop * sizes[i] / (1 << 20);
+
+		t = now_sec();
+		for (j = 0; j < loop; j++)
+			move_byte(buf + 1 + (j & 1), buf + 2 - (j & 1), sizes[i]);
+		printf("%8u bytes: byte %8.0f MB/s", sizes[i], mb / (now_sec() - t));
+
+		t = now_sec();
+		for (j = 0; j < loop; j++)
+			kmem_move(buf + 1 + (j & 1), buf + 2 - (j & 1), sizes[i]);
+		printf(", kmem_move %8.0f MB/s", mb / (now_sec() - t));
+
+		t = now_sec();
+		for (j = 0; j < loop; j++)
+			memmove(buf + 1 + (j & 1), buf + 2 - (j & 1), sizes[i]);
+		printf(", memmove %8.0f MB/s\n", mb / (now_sec() - t));
+	}
+
+	/* The old dumper did one sprintf for every byte */
+	t = now_sec();
+	for (j = 0, i = 0; i < (1 << 20); i++)
+		j += sprintf(ref + (i % 1024) * 3, "%02x ", (kuchar)buf[i]);
+	printf("hex sprintf %8.0f MB/s\n", 1.0 / (now_sec() - t));
+
+	t = now_sec();
+	for (i = 0; i < (1 << 20); i++) {
+		ref[(i % 1024) * 3] = __hex_lo[(kuchar)buf[i] >> 4];
+		ref[(i % 1024) * 3 + 1] = __hex_lo[(kuchar)buf[i] & 0x0f];
+		ref[(i % 1024) * 3 + 2] = ' ';
+	}
+	printf("hex table   %8.0f MB/s\n", 1.0 / (now_sec() - t));
+
+	free(buf);
+	free(ref);
+	return 0;
+}
+#endif /* KMEM_TEST */
@@ -9,6 +9,9 @@
 
 #include <hilda/klog.h>
 #include <hilda/kmem.h>
+#include <hilda/kstr.h>
+#include <hilda/kopt.h>
+#include <hilda/kbuf.h>
 
 #include <hilda/xtcool.h>
 #include <hilda/kmque.h>
@@ -16,25 +19,49 @@
 static int kmque_cleanup(kmque_s *mque);
 static void mentry_do(mentry_s *me);
 static void mentry_done(mentry_s *me);
+static void mentry_send_done(mentry_s *me, int state);
+
+/* Completion semaphore of current thread, used by mentry_send */
+static kthread_local SPL_HANDLE __t_snd_sem = NULL;
+
+/* Only for delete __t_snd_sem when the thread exits */
+static SPL_HANDLE __snd_sem_key = NULL;
+
+/* Default weight of each lane for KMQUE_SCHED_WEIGHTED */
+static unsigned int __dft_weight[KMQUE_PRIO_MAX] = { 8, 4, 1 };
 
 kmque_s *kmque_new()
 {
 	kmque_s *mque = (kmque_s*)kmem_alloz(1, kmque_s);
+	int i;
 
-	kdlist_init_head(&mque->msg_qhdr);
+	for (i = 0; i < KMQUE_PRIO_MAX; i++) {
+		kdlist_init_head(&mque->lane[i].qhdr);
+		mque->lane[i].weight = __dft_weight[i];
+		mque->lane[i].credit = __dft_weight[i];
+	}
+	mque->sched = KMQUE_SCHED_WEIGHTED;
 	kdlist_init_head(&mque->dpc_qhdr);
 	mque->qhdr_lck = spl_lck_new();
 
 	mque->msg_new_sem = spl_sema_new(0);
-	mque->msg_snt_sem = spl_sema_new(0);
 
 	return mque;
 }
 
 int kmque_del(kmque_s *mque)
 {
+	char path[1024];
+
+	if (mque->diag_name) {
+		sprintf(path, "s:/k/mque/%s/diag/dump", mque->diag_name);
+		kopt_del(path);
+		sprintf(path, "b:/k/mque/%s/diag/enable", mque->diag_name);
+		kopt_del(path);
+		kmem_free_sz(mque->diag_name);
+	}
+
 	spl_sema_del(mque->msg_new_sem);
-	spl_sema_del(mque->msg_snt_sem);
 	spl_lck_del(mque->qhdr_lck);
 	kmem_free(mque);
 
@@ -43,29 +70,240 @@ int kmque_del(kmque_s *mque)
 
 void kmque_set_quit(kmque_s *mque)
 {
+	/* Set quit first, so no sender can queue after cleanup */
+	mque->quit = 1;
+
+	/* Waiting senders are woke up with ME_SND_ABORT */
 	kmque_cleanup(mque);
 
-	mque->quit = 1;
 	spl_sema_rel(mque->msg_new_sem);
-	/* FIXME: What if when a send waiting? rel(msg_snt_sem)? */
+}
+
+int kmque_set_sched(kmque_s *mque, int sched)
+{
+	if (!mque || (sched != KMQUE_SCHED_STRICT &&
+				sched != KMQUE_SCHED_WEIGHTED))
+		return -1;
+
+	spl_lck_get(mque->qhdr_lck);
+	mque->sched = sched;
+	spl_lck_rel(mque->qhdr_lck);
+	return 0;
+}
+
+/**
+ * \brief How many entries of the lane can be picked in a round before
+ * the less urgent lanes get a chance, for KMQUE_SCHED_WEIGHTED.
+ *
+ * \param weight 0 is taken as 1.
+ */
+int kmque_set_weight(kmque_s *mque, int prio, unsigned int weight)
+{
+	if (!mque || prio < 0 || prio >= KMQUE_PRIO_MAX)
+		return -1;
+
+	if (!weight)
+		weight = 1;
+
+	spl_lck_get(mque->qhdr_lck);
+	mque->lane[prio].weight = weight;
+	mque->lane[prio].credit = weight;
+	spl_lck_rel(mque->qhdr_lck);
+	return 0;
+}
+
+/**
+ * \brief Return how many entries pending in the lane, -1 for error.
+ */
+int kmque_depth(kmque_s *mque, int prio)
+{
+	if (!mque || prio < 0 || prio >= KMQUE_PRIO_MAX)
+		return -1;
+	return (int)mque->lane[prio].depth;
+}
+
+/*-----------------------------------------------------------------------
+ * Statistics, everything is skipped when stat.enable is 0
+ */
+
+/* Monotonic, a step of the wall clock must not go into the histograms */
+#define stat_usec()     spl_time_get_mono_usec()
+
+static int hist_index(unsigned long long int usec)
+{
+	int i = 0;
+
+	while (usec && i < KMQUE_HIST_MAX - 1) {
+		usec >>= 1;
+		i++;
+	}
+	return i;
+}
+
+/* XXX: should be called within lock */
+static void stat_queued(kmque_s *mque, mentry_s *me)
+{
+	unsigned int i, depth = 0;
+
+	me->queue_time = stat_usec();
+
+	for (i = 0; i < KMQUE_PRIO_MAX; i++)
+		depth += mque->lane[i].depth;
+	if (depth > mque->stat.depth_max)
+		mque->stat.depth_max = depth;
+}
+
+/* XXX: only called in kmque_run thread, so no lock for the counters */
+static void stat_done(kmque_s *mque, void *func,
+		unsigned long long int queue_time, unsigned long long int beg)
+{
+	kmque_stat_s *st = &mque->stat;
+	unsigned long long int run = stat_usec() - beg;
+
+	st->done_cnt++;
+	if (queue_time && beg > queue_time)
+		st->wait_hist[hist_index(beg - queue_time)]++;
+	st->run_hist[hist_index(run)]++;
+
+	if (run >= st->run_max) {
+		st->run_max = run;
+		st->run_max_func = func;
+	}
+}
+
+/**
+ * \brief Start or stop recording the statistics.
+ *
+ * Old statistics are cleared when start.
+ */
+int kmque_stat_enable(kmque_s *mque, int enable)
+{
+	if (!mque)
+		return -1;
+
+	if (!enable) {
+		mque->stat.enable = 0;
+		return 0;
+	}
+	if (mque->stat.enable)
+		return 0;
+
+	spl_lck_get(mque->qhdr_lck);
+	memset(&mque->stat, 0, sizeof(mque->stat));
+	mque->stat.enable = 1;
+	spl_lck_rel(mque->qhdr_lck);
+	return 0;
+}
+
+void kmque_stat_dump(kmque_s *mque, kbuf_s *kb)
+{
+	kmque_stat_s *st = &mque->stat;
+	int i;
+
+	kbuf_addf(kb, "mque:%p, sched:%s, stat:%s\r\n", mque,
+			mque->sched == KMQUE_SCHED_STRICT ? "strict" : "weighted",
+			st->enable ? "on" : "off");
+
+	for (i = 0; i < KMQUE_PRIO_MAX; i++) {
+		kbuf_adds(kb, "  lane[");
+		kbuf_addi(kb, i, 0);
+		kbuf_adds(kb, "]: depth:");
+		kbuf_addu(kb, mque->lane[i].depth, 0);
+		kbuf_adds(kb, ", weight:");
+		kbuf_addu(kb, mque->lane[i].weight, 0);
+		kbuf_add(kb, "\r\n", 2);
+	}
+
+	kbuf_addf(kb, "  done:%u, depth_max:%u\r\n",
+			st->done_cnt, st->depth_max);
+	kbuf_addf(kb, "  run_max:%lluus, func:%p\r\n",
+			st->run_max, st->run_max_func);
+
+	kbuf_addf(kb, "  %10s %10s %10s\r\n", "usec<", "wait", "run");
+	for (i = 0; i < KMQUE_HIST_MAX; i++) {
+		if (!st->wait_hist[i] && !st->run_hist[i])
+			continue;
+		kbuf_add(kb, "  ", 2);
+		kbuf_addu(kb, 1UL << i, 10);
+		kbuf_add8(kb, ' ');
+		kbuf_addu(kb, st->wait_hist[i], 10);
+		kbuf_add8(kb, ' ');
+		kbuf_addu(kb, st->run_hist[i], 10);
+		kbuf_add(kb, "\r\n", 2);
+	}
+}
+
+static int og_kmque_diag_dump(void *opt, void *pa, void *pb)
+{
+	kmque_s *mque = (kmque_s*)kopt_ua(opt);
+	kbuf_s kb;
+
+	kbuf_init(&kb, 4096);
+	kmque_stat_dump(mque, &kb);
+	kopt_set_cur_str(opt, kb.buf);
+	kbuf_release(&kb);
+
+	return EC_OK;
+}
+
+static int os_kmque_diag_enable(int ses, void *opt, void *pa, void *pb)
+{
+	kmque_stat_enable((kmque_s*)kopt_ua(opt), kopt_get_new_int(opt));
+	return EC_OK;
+}
+
+/**
+ * \brief Export the statistics of mque as opt:
+ * s:/k/mque/<name>/diag/dump and b:/k/mque/<name>/diag/enable
+ *
+ * \return 0 for success, -1 for error
+ */
+int kmque_diag_add(kmque_s *mque, const char *name)
+{
+	char path[1024];
+
+	if (!mque || !name || mque->diag_name || !kopt_cc())
+		return -1;
+
+	mque->diag_name = kstr_dup(name);
+
+	sprintf(path, "s:/k/mque/%s/diag/dump", name);
+	kopt_add(path, NULL, OA_GET, NULL, og_kmque_diag_dump,
+			NULL, (void*)mque, NULL);
+	sprintf(path, "b:/k/mque/%s/diag/enable", name);
+	kopt_add(path, NULL, OA_DFT, os_kmque_diag_enable, NULL,
+			NULL, (void*)mque, NULL);
+
+	return 0;
 }
 
 static int kmque_cleanup(kmque_s *mque)
 {
 	mentry_s *me;
 	K_dlist_entry *entry;
+	kmque_lane_s *lane;
+	int i;
 
 	spl_lck_get(mque->qhdr_lck);
-	entry = mque->msg_qhdr.next;
-	while (entry != &mque->msg_qhdr) {
-		me = FIELD_TO_STRUCTURE(entry, mentry_s, entry);
-		entry = entry->next;
-		mentry_done(me);
+	for (i = 0; i < KMQUE_PRIO_MAX; i++) {
+		lane = &mque->lane[i];
+		entry = lane->qhdr.next;
+		while (entry != &lane->qhdr) {
+			me = FIELD_TO_STRUCTURE(entry, mentry_s, entry);
+			entry = entry->next;
+			kdlist_remove_entry(&me->entry);
+			lane->depth--;
+			if (me->is_send)
+				mentry_send_done(me, ME_SND_ABORT);
+			else
+				mentry_done(me);
+		}
 	}
 	entry = mque->dpc_qhdr.next;
 	while (entry != &mque->dpc_qhdr) {
 		me = FIELD_TO_STRUCTURE(entry, mentry_s, entry);
 		entry = entry->next;
+		kdlist_remove_entry(&me->entry);
 		mentry_done(me);
 	}
 	spl_lck_rel(mque->qhdr_lck);
@@ -73,16 +311,57 @@ static int kmque_cleanup(kmque_s *mque)
 	return 0;
 }
 
+/*
+ * XXX: should be called within lock
+ *
+ * STRICT: the most urgent non-empty lane.
+ * WEIGHTED: the most urgent non-empty lane still has credit, when all the
+ * non-empty lanes used up their credits, start a new round.
+ */
+static kmque_lane_s *pick_lane(kmque_s *mque)
+{
+	kmque_lane_s *lane, *first = NULL;
+	int i;
+
+	for (i = 0; i < KMQUE_PRIO_MAX; i++) {
+		lane = &mque->lane[i];
+		if (kdlist_is_empty(&lane->qhdr))
+			continue;
+
+		if (mque->sched == KMQUE_SCHED_STRICT)
+			return lane;
+
+		if (lane->credit) {
+			lane->credit--;
+			return lane;
+		}
+		if (!first)
+			first = lane;
+	}
+
+	if (first) {
+		for (i = 0; i < KMQUE_PRIO_MAX; i++)
+			mque->lane[i].credit = mque->lane[i].weight;
+		first->credit--;
+	}
+	return first;
+}
+
 static mentry_s *get_ready_me(kmque_s *mque)
 {
 	mentry_s *me = NULL;
 	K_dlist_entry *entry;
+	kmque_lane_s *lane;
 	unsigned int now = spl_get_ticks();
 
 	spl_lck_get(mque->qhdr_lck);
-	if (!kdlist_is_empty(&mque->msg_qhdr)) {
-		entry = kdlist_remove_head_entry(&mque->msg_qhdr);
+	lane = pick_lane(mque);
+	if (lane) {
+		entry = kdlist_remove_head_entry(&lane->qhdr);
+		lane->depth--;
 		me = FIELD_TO_STRUCTURE(entry, mentry_s, entry);
+		if (me->is_send)
+			me->snd.state = ME_SND_RUNNING;
 	} else if (!kdlist_is_empty(&mque->dpc_qhdr)) {
 		me = FIELD_TO_STRUCTURE(mque->dpc_qhdr.next, mentry_s, entry);
 		if (me->dpc.due_time < now)
@@ -159,10 +438,91 @@ int kmque_peek(kmque_s *mque, mentry_s **retme, int timeout)
 	return 0;
 }
 
+static void snd_sem_release(void *ua)
+{
+	spl_sema_del((SPL_HANDLE)ua);
+	__t_snd_sem = NULL;
+}
+
+static SPL_HANDLE snd_sem_key(void)
+{
+	SPL_HANDLE key = __atomic_load_n(&__snd_sem_key, __ATOMIC_ACQUIRE), exp = NULL;
+
+	if (likely(key))
+		return key;
+
+	/* The first senders race, the loser drops its own */
+	key = spl_tls_new(snd_sem_release);
+	if (!__atomic_compare_exchange_n(&__snd_sem_key, &exp, key, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		spl_tls_del(key);
+		key = exp;
+	}
+	return key;
+}
+
+static SPL_HANDLE snd_sem_get(void)
+{
+	/* Created once for each sender thread, reused by every send */
+	if (unlikely(!__t_snd_sem)) {
+		__t_snd_sem = spl_sema_new(0);
+		spl_tls_set(snd_sem_key(), __t_snd_sem);
+	}
+	return __t_snd_sem;
+}
+
+/**
+ * \brief Queue a stack allocated entry and wait it be done.
+ *
+ * \return 0:OK, -1:TIMEOUT, -3:Quit
+ */
+static int mentry_send_wait(kmque_s *mque, mentry_s *me, int timeout)
+{
+	me->is_send = ktrue;
+	me->mque = mque;
+	me->snd.sem = snd_sem_get();
+	me->snd.state = ME_SND_QUEUED;
+
+	spl_lck_get(mque->qhdr_lck);
+	if (mque->quit) {
+		spl_lck_rel(mque->qhdr_lck);
+		return -3;
+	}
+	kdlist_insert_tail_entry(&mque->lane[me->prio].qhdr, &me->entry);
+	mque->lane[me->prio].depth++;
+	if (unlikely(mque->stat.enable))
+		stat_queued(mque, me);
+	spl_lck_rel(mque->qhdr_lck);
+
+	spl_sema_rel(mque->msg_new_sem);
+
+	if (spl_sema_get(me->snd.sem, timeout)) {
+		/* Take it back if kmque_run not pick it yet */
+		spl_lck_get(mque->qhdr_lck);
+		if (me->snd.state == ME_SND_QUEUED) {
+			kdlist_remove_entry(&me->entry);
+			mque->lane[me->prio].depth--;
+			spl_lck_rel(mque->qhdr_lck);
+			return -1;
+		}
+		spl_lck_rel(mque->qhdr_lck);
+
+		/*
+		 * XXX: Worker already running and \c me is in our
+		 * stack, must wait it done. It also eats the pending
+		 * release to keep the semaphore balanced.
+		 */
+		spl_sema_get(me->snd.sem, -1);
+	}
+
+	if (me->snd.state != ME_SND_DONE)
+		return -3;
+	return 0;
+}
+
 int mentry_send(kmque_s *mque, ME_WORKER worker, void *ua, void *ub)
 {
-	mentry_s *me;
-	SPL_HANDLE caller_thread;
+	mentry_s me;
 
 	if (!mque || mque->quit) {
 		kerror("!mque || mque->quit");
@@ -174,33 +534,77 @@ int mentry_send(kmque_s *mque, ME_WORKER worker, void *ua, void *ub)
 		return -1;
 	}
 
-	caller_thread = spl_thread_current();
-	if (mque->main_task == caller_thread) {
+	if (mque->main_task == spl_thread_current()) {
 		if (worker)
 			worker(ua, ub);
-	} else {
-		me = kmem_alloz(1, mentry_s);
-		me->worker = worker;
-		me->ua = ua;
-		me->ub = ub;
-		me->is_send = ktrue;
-		me->mque = mque;
+		return 0;
+	}
 
-		spl_lck_get(mque->qhdr_lck);
-		kdlist_insert_tail_entry(&mque->msg_qhdr, &me->entry);
-		spl_lck_rel(mque->qhdr_lck);
+	memset(&me, 0, sizeof(me));
+	me.prio = KMQUE_PRIO_NORMAL;
+	me.worker = worker;
+	me.ua = ua;
+	me.ub = ub;
 
-		spl_sema_rel(mque->msg_new_sem);
+	if (mentry_send_wait(mque, &me, -1))
+		return -1;
+	return 0;
+}
 
-		spl_sema_get(mque->msg_snt_sem, -1);
-		if (mque->quit)
-			return -1;
+/**
+ * \brief Run caller in mque's thread and wait for its return value
+ *
+ * \param mque
+ * \param caller
+ * \param ua
+ * \param ub
+ * \param retval Return value of caller, can be NULL.
+ * \param timeout -1 = NOTIMEOUT. Only covers the time waiting in queue,
+ * once the caller started, wait till it returned.
+ *
+ * \return 0:OK, -1:TIMEOUT, -2:NG, -3:Quit
+ */
+int mentry_call(kmque_s *mque, ME_CALLER caller, void *ua, void *ub,
+		int *retval, int timeout)
+{
+	mentry_s me;
+	int ret;
+
+	if (!mque || !mque->main_task) {
+		kerror("!mque || !mque->main_task\n");
+		return -2;
 	}
-	return 0;
+	if (mque->quit)
+		return -3;
+
+	if (mque->main_task == spl_thread_current()) {
+		ret = caller ? caller(ua, ub) : 0;
+		if (retval)
+			*retval = ret;
+		return 0;
+	}
+
+	memset(&me, 0, sizeof(me));
+	me.prio = KMQUE_PRIO_NORMAL;
+	me.caller = caller;
+	me.ua = ua;
+	me.ub = ub;
+
+	ret = mentry_send_wait(mque, &me, timeout);
+	if (!ret && retval)
+		*retval = me.snd.ret;
+	return ret;
 }
 
 int mentry_post(kmque_s *mque, ME_WORKER worker, ME_DESTORYER destoryer,
 		void *ua, void *ub)
+{
+	return mentry_post_prio(mque, KMQUE_PRIO_NORMAL,
+			worker, destoryer, ua, ub);
+}
+
+int mentry_post_prio(kmque_s *mque, int prio, ME_WORKER worker,
+		ME_DESTORYER destoryer, void *ua, void *ub)
 {
 	mentry_s *me;
 
@@ -209,7 +613,13 @@ int mentry_post(kmque_s *mque, ME_WORKER worker, ME_DESTORYER destoryer,
 		return -1;
 	}
 
+	if (prio < 0 || prio >= KMQUE_PRIO_MAX) {
+		kerror("Bad prio: %d\n", prio);
+		return -1;
+	}
+
 	me = kmem_alloz(1, mentry_s);
+	me->prio = prio;
 	me->worker = worker;
 	me->destoryer = destoryer;
 	me->ua = ua;
@@ -217,7 +627,10 @@ int mentry_post(kmque_s *mque, ME_WORKER worker, ME_DESTORYER destoryer,
 	me->mque = mque;
 
 	spl_lck_get(mque->qhdr_lck);
-	kdlist_insert_tail_entry(&mque->msg_qhdr, &me->entry);
+	kdlist_insert_tail_entry(&mque->lane[prio].qhdr, &me->entry);
+	mque->lane[prio].depth++;
+	if (unlikely(mque->stat.enable))
+		stat_queued(mque, me);
 	spl_lck_rel(mque->qhdr_lck);
 
 	spl_sema_rel(mque->msg_new_sem);
@@ -312,7 +725,9 @@ int mentry_dpc_kill(kmque_s *mque, unsigned int dpcid)
 
 static void mentry_do(mentry_s *me)
 {
-	if (me->worker)
+	if (me->caller)
+		me->snd.ret = me->caller(me->ua, me->ub);
+	else if (me->worker)
 		me->worker(me->ua, me->ub);
 }
 
@@ -323,14 +738,34 @@ static void mentry_done(mentry_s *me)
 	kmem_free(me);
 }
 
+/* XXX: me is in sender's stack, don't touch it after this */
+static void mentry_send_done(mentry_s *me, int state)
+{
+	me->snd.state = state;
+	spl_sema_rel(me->snd.sem);
+}
+
 static void mentry_do_all(mentry_s *me)
 {
-	kbool is_send = me->is_send;
+	kmque_s *mque = me->mque;
+	unsigned long long int beg = 0, queue_time = 0;
+	void *func = NULL;
+
+	if (unlikely(mque->stat.enable)) {
+		/* me maybe gone after done, save them first */
+		queue_time = me->queue_time;
+		func = me->caller ? (void*)me->caller : (void*)me->worker;
+		beg = stat_usec();
+	}
 
 	mentry_do(me);
-	mentry_done(me);
-	if (is_send)
-		spl_sema_rel(me->mque->msg_snt_sem);
+	if (me->is_send)
+		mentry_send_done(me, ME_SND_DONE);
+	else
+		mentry_done(me);
+
+	if (unlikely(beg))
+		stat_done(mque, func, queue_time, beg);
 }
 
 int kmque_run(kmque_s *mque)
@@ -21,6 +21,7 @@ typedef struct _knodecc_s knodecc_s;
 struct _knodecc_s {
 	knode_s **arr;
 	int cnt;
+	int cap;
 };
 
 static knodecc_s *__g_knodecc = NULL;
@@ -70,7 +71,7 @@ int knode_link_add(knode_s *unode, knode_s *dnode, void *link_dat)
 			return 0;
 		}
 
-	ARR_INC(1, unode->dstr.arr, unode->dstr.cnt, dstr_node_s);
+	ARR_ADD(1, unode->dstr.arr, unode->dstr.cnt, unode->dstr.cap, dstr_node_s);
 	unode->dstr.arr[i].node = dnode;
 	unode->dstr.arr[i].link_dat = link_dat;
 
@@ -120,6 +121,7 @@ int knode_reg(knode_s *node)
 
 	node->dstr.arr = 0;
 	node->dstr.cnt = 0;
+	node->dstr.cap = 0;
 	node->flg = KNFL_STOP;
 	node->attr &= 0xffff;
 
@@ -137,7 +139,7 @@ int knode_reg(knode_s *node)
 			return 0;
 		}
 
-	ARR_INC(1, cc->arr, cc->cnt, knode_s*);
+	ARR_ADD(1, cc->arr, cc->cnt, cc->cap, knode_s*);
 	cc->arr[i] = node;
 	klog("%s success.\n", node->name);
 	return 0;
@@ -290,13 +292,29 @@ static int do_dump(knode_s *node, void *ua, void *ub)
 	int i;
 	kbuf_s *kb = (kbuf_s*)ua;
 
-	kbuf_addf(kb, "\r\nT:%08x A:%08x F:%08x push:%p name:%s\r\n",
-			node->type, node->attr, node->flg, node->push,
-			node->name);
+	kbuf_adds(kb, "\r\nT:");
+	kbuf_addx(kb, node->type, 8);
+	kbuf_adds(kb, " A:");
+	kbuf_addx(kb, node->attr, 8);
+	kbuf_adds(kb, " F:");
+	kbuf_addx(kb, node->flg, 8);
+	kbuf_adds(kb, " push:");
+	kbuf_addp(kb, (void*)node->push);
+	kbuf_adds(kb, " name:");
+	kbuf_adds(kb, node->name);
+	kbuf_add(kb, "\r\n", 2);
 
-	for (i = 0; i < node->dstr.cnt; i++)
-		kbuf_addf(kb, "\t%02d: %s\r\n", i,
-				node->dstr.arr[i].node->name);
+	for (i = 0; i < node->dstr.cnt; i++) {
+		if (!node->dstr.arr[i].node)
+			continue;
+		kbuf_add8(kb, '\t');
+		if (i < 10)
+			kbuf_add8(kb, '0');
+		kbuf_addi(kb, i, 0);
+		kbuf_add(kb, ": ", 2);
+		kbuf_adds(kb, node->dstr.arr[i].node->name);
+		kbuf_add(kb, "\r\n", 2);
+	}
 
 	return 0;
 }
@@ -427,7 +445,7 @@ int knode_foreach_start()
 	knode_s *tmp;
 	knodecc_s *cc = __g_knodecc;
 
-	for (i = cc->cnt; i >= 0; i--) {
+	for (i = cc->cnt - 1; i >= 0; i--) {
 		tmp = cc->arr[i];
 		if (tmp)
 			knode_call_start(tmp);
@@ -520,7 +538,7 @@ int knode_foreach_resume()
 	knode_s *tmp;
 	knodecc_s *cc = __g_knodecc;
 
-	for (i = cc->cnt; i >= 0; i--) {
+	for (i = cc->cnt - 1; i >= 0; i--) {
 		tmp = cc->arr[i];
 		if (tmp)
 			knode_call_resume(tmp);
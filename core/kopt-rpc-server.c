@@ -37,6 +37,7 @@
 
 #include <hilda/xtcool.h>
 #include <hilda/kbuf.h>
+#include <hilda/kchain.h>
 
 #include <hilda/kopt-rpc-common.h>
 #include <hilda/kopt-rpc-server.h>
@@ -60,6 +61,7 @@ struct _rpc_client_s {
 	struct {
 		rpc_wch_s *arr;
 		int cnt;
+		int cap;
 	} opts;			/* only these opt can be accessed */
 };
 
@@ -69,7 +71,7 @@ struct _rpc_client_s {
 #define CRLF "\r\n"
 #define PROMPT "$ "
 
-static int send_watch_message(rpc_client_s *c, const char *buf);
+static int send_watch_message(rpc_client_s *c, kchain_s *kc);
 static void config_socket(int s);
 static void ignore_pipe();
 static int process_connect(int new_fd);
@@ -193,7 +195,7 @@ static int rpc_client_wch_add(rpc_client_s *c, char *path, void *wch)
 			return 0;
 		}
 
-	ARR_INC(2, c->opts.arr, c->opts.cnt, rpc_wch_s);
+	ARR_ADD(2, c->opts.arr, c->opts.cnt, c->opts.cap, rpc_wch_s);
 	c->opts.arr[i].path = kstr_dup(path);
 	c->opts.arr[i].wch = wch;
 
@@ -230,8 +232,7 @@ static int rpc_client_wch_clr(rpc_client_s *c)
 			kopt_wch_del(c->opts.arr[i].wch);
 		c->opts.arr[i].wch = NULL;
 	}
-	kmem_free_sz(c->opts.arr);
-	c->opts.cnt = 0;
+	ARR_FREE(c->opts.arr, c->opts.cnt, c->opts.cap);
 
 	return 0;
 }
@@ -239,23 +240,29 @@ static int rpc_client_wch_clr(rpc_client_s *c)
 static void rpc_watch(int ses, void *opt, void *wch)
 {
 	void *ua = kopt_wch_ua(wch);
-	char *ini;
-	kbuf_s kb;
+	char *ini, stk[1024];
+	kchain_s kc;
+	kmem_arena_s ar;
 	char *path = kopt_path(opt);
 
 	klog("path:%s\n", path);
 
-	if (kopt_getini_by_opt(opt, &ini))
+	kmem_arena_init(&ar, stk, sizeof(stk));
+	if (kopt_getini_by_opt_ex(opt, &ar, &ini)) {
+		kmem_arena_release(&ar);
 		return;
+	}
 
-	kbuf_init(&kb, 4096);
+	/* The peer reads till NUL */
+	kchain_init(&kc, 0);
+	kchain_addf(&kc, "wchnotify %s\r\n", path);
+	kchain_add(&kc, ini, strlen(ini) + 1);
+	kmem_arena_release(&ar);
 
-	kbuf_addf(&kb, "wchnotify %s\r\n%s", path, ini);
-	if (send_watch_message((rpc_client_s*)ua, kb.buf))
+	if (send_watch_message((rpc_client_s*)ua, &kc))
 		close_client((rpc_client_s*)ua);
 
-	kmem_free(ini);
-	kbuf_release(&kb);
+	kchain_release(&kc);
 }
 
 /*-----------------------------------------------------------------------
@@ -264,9 +271,15 @@ static void rpc_watch(int ses, void *opt, void *wch)
 static int do_opt_command(int s, char *buf, int cmdlen)
 {
 	rpc_client_s *c;
-	char *para, ebuf[256], *errmsg;
+	char *para, ebuf[256], *errmsg, stk[2048];
 	int ret, errnum;
 
+	/* Temporaries of this command, released when return */
+	kmem_arena_s ar;
+
+	/* Response, the ini of og can be large, not copied to buf */
+	kchain_s kc;
+
 	/* XXX: some client won't append NUL to end of input */
 	buf[cmdlen] = '\0';
 	kstr_trim(buf);
@@ -278,10 +291,16 @@ static int do_opt_command(int s, char *buf, int cmdlen)
 		return 1;
 	}
 
+	if (!strncmp("bye", buf, 3))
+		return 1;
+
+	kmem_arena_init(&ar, stk, sizeof(stk));
+	kchain_init(&kc, 0);
+
 	if (!strncmp("wa ", buf, 3)) {
 		para = buf + 3;
 		if (-1 != rpc_client_wch_find(c, para))
-			sprintf(buf, "%s%s", mk_errline(EC_EXIST, ebuf), c->prompt);
+			kchain_adds(&kc, mk_errline(EC_EXIST, ebuf));
 		else {
 			void *wch = NULL;
 			if ((c->wch_socket != -1))
@@ -289,50 +308,52 @@ static int do_opt_command(int s, char *buf, int cmdlen)
 			else
 				kerror("wchadd while on wfunc set in c side\n");
 			if (!wch)
-				sprintf(buf, "%s%s", mk_errline(EC_NG, ebuf), c->prompt);
+				kchain_adds(&kc, mk_errline(EC_NG, ebuf));
 			else {
 				ret = rpc_client_wch_add(c, para, wch);
-				sprintf(buf, "%s%s", mk_errline(ret, ebuf), c->prompt);
+				kchain_adds(&kc, mk_errline(ret, ebuf));
 			}
 		}
 	} else if (!strncmp("wd ", buf, 3)) {
 		para = buf + 3;
 		ret = rpc_client_wch_del(c, para);
-		sprintf(buf, "%s%s", mk_errline(ret, ebuf), c->prompt);
+		kchain_adds(&kc, mk_errline(ret, ebuf));
 	} else if (!strncmp("os ", buf, 3)) {
 		para = buf + 3;
 		ret = kopt_setbat(para, 1, 0);
 		if (ret && !kopt_get_err(&errnum, &errmsg))
-			sprintf(buf, "%x %s%s%s", errnum, errmsg, CRLF, c->prompt);
+			kchain_addf(&kc, "%x %s%s", errnum, errmsg, CRLF);
 		else
-			sprintf(buf, "%s%s", mk_errline(ret, ebuf), c->prompt);
-		klog("optset: ret:%d, buf:%s\n", ret, buf);
+			kchain_adds(&kc, mk_errline(ret, ebuf));
+		klog("optset: ret:%d, para:%s\n", ret, para);
 	} else if (!strncmp("og ", buf, 3)) {
 		para = buf + 3;
 		char *iniret = NULL;
-		ret = kopt_getini(para, &iniret);
+		ret = kopt_getini_ex(para, &ar, &iniret);
 		if (ret && !kopt_get_err(&errnum, &errmsg))
-			sprintf(buf, "%x %s%s%s", errnum, errmsg, CRLF, c->prompt);
-		else
-			sprintf(buf, "%s%s%s", mk_errline(ret, ebuf), iniret ? iniret : "", c->prompt);
-		kmem_free_s(iniret);
-		klog("optget: ret:%d, buf:%s\n", ret, buf);
-	} else if (!strncmp("bye", buf, 3)) {
-		return 1;
+			kchain_addf(&kc, "%x %s%s", errnum, errmsg, CRLF);
+		else {
+			kchain_adds(&kc, mk_errline(ret, ebuf));
+			if (iniret)
+				kchain_adds(&kc, iniret);
+		}
+		klog("optget: ret:%d, para:%s\n", ret, para);
 	} else if (!strncmp("help", buf, 4)) {
-		sprintf(buf, "help(), hey(mode<o|w>, client, connhash, user, pass), bye(), wa(opt), wd(opt), os(ini), og(opt)%s",
-				c->prompt);
+		kchain_adds(&kc, "help(), hey(mode<o|w>, client, connhash, user, pass), bye(), wa(opt), wd(opt), os(ini), og(opt)");
 	} else {
-		sprintf(buf, "%s%s", mk_errline(EC_NOTHING, ebuf), c->prompt);
+		kchain_adds(&kc, mk_errline(EC_NOTHING, ebuf));
 	}
 
-	ret = send(c->opt_socket, buf, strlen(buf) + 1, 0);
-	if (ret < 0) {
+	kmem_arena_release(&ar);
+
+	/* Prompt and the NUL */
+	kchain_add(&kc, c->prompt, strlen(c->prompt) + 1);
+
+	ret = kchain_send(&kc, c->opt_socket, MSG_NOSIGNAL);
+	kchain_release(&kc);
+	if (ret) {
 		klog("send resp: s: %d, err %s\n", s, strerror(errno));
 		return 1;
-	} else if (ret == 0) {
-		klog("send resp: Remote close socket: %d\n", s);
-		return 1;
 	}
 
 	return 0;
@@ -488,23 +509,20 @@ int kopt_rpc_server_final()
 	return 0;
 }
 
-static int send_watch_message(rpc_client_s *c, const char *buf)
+static int send_watch_message(rpc_client_s *c, kchain_s *kc)
 {
 	int ret;
+	char ack[64];
 
-	klog("s:<%d>, buf:<%s>\n", c->wch_socket, buf);
+	klog("s:<%d>, len:<%zu>\n", c->wch_socket, kchain_len(kc));
 
-	ret = send(c->wch_socket, buf, strlen(buf) + 1, 0);
-	if (0 == ret || (-1 == c->wch_socket)) {
+	if (-1 == c->wch_socket || kchain_send(kc, c->wch_socket, MSG_NOSIGNAL)) {
 		/* socket disconnected */
 		kerror("c:%s, e:%s\n", "send", strerror(errno));
 		return -1;
-	} else if (-1 == ret) {
-		kerror("c:%s, e:%s\n", "send", strerror(errno));
-		return -1;
 	}
 
-	ret = recv(c->wch_socket, (void*)buf, sizeof(buf), 0);
+	ret = recv(c->wch_socket, (void*)ack, sizeof(ack), 0);
 	if (0 == ret) {
 		kerror("c:%s, e:%s\n", "recv", strerror(errno));
 		return -1;
@@ -56,6 +56,7 @@ struct _rpc_client_s {
 	struct {
 		rpc_wch_s *arr;
 		int cnt;
+		int cap;
 	} opts;			/* only these opt can be accessed */
 };
 
@@ -237,7 +238,7 @@ static int rpc_client_wch_add(rpc_client_s *c, char *path, void *wch)
 			return 0;
 		}
 
-	ARR_INC(2, c->opts.arr, c->opts.cnt, rpc_wch_s);
+	ARR_ADD(2, c->opts.arr, c->opts.cnt, c->opts.cap, rpc_wch_s);
 	c->opts.arr[i].path = kstr_dup(path);
 	c->opts.arr[i].wch = wch;
 
@@ -274,8 +275,7 @@ static int rpc_client_wch_clr(rpc_client_s *c)
 			kopt_wch_del(c->opts.arr[i].wch);
 		c->opts.arr[i].wch = NULL;
 	}
-	kmem_free_sz(c->opts.arr);
-	c->opts.cnt = 0;
+	ARR_FREE(c->opts.arr, c->opts.cnt, c->opts.cap);
 
 	return 0;
 }
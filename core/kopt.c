@@ -15,6 +15,7 @@
 
 #include <hilda/xtcool.h>
 #include <hilda/kbuf.h>
+#include <hilda/helper.h>
 
 #include <hilda/kopt.h>
 
@@ -210,10 +211,21 @@ int kopt_get_err(int *no, char **msg)
 	return -1;
 }
 
+static char *kv_dup(const char *s, size_t len)
+{
+	char *ret = (char*)kmem_alloc(len + 1, char);
+
+	memcpy(ret, s, len);
+	ret[len] = '\0';
+	return ret;
+}
 
 /**
  * \brief Convert the config buffer come from config file to KV pair
  *
+ * One "key=value" each line. The spaces in key are removed, the value is
+ * kept as it is. Line without '=' or with empty key is skipped.
+ *
  * \param buffer Read from config file etc
  * \param blen len of the buffer
  * \param okv k=okv[2n], v=okv[2n+1]
@@ -225,57 +237,36 @@ int kopt_get_err(int *no, char **msg)
  */
 int kopt_make_kv(const char *buffer, int blen, char ***okv, int *ocnt)
 {
-	char kbuf[2048], vbuf[2048], *tmpkv[2 * 2000];
-	int i, ki = 0, vi = 0, km, vm, kvcnt = 0; /* index and mode */
-	char **kvarr = 0, c;
+	const char *line, *eq;
+	char **kvarr = NULL, *k;
+	size_t pos = 0, len, i, ki;
+	int kvcnt = 0, kvcap = 0;
 
 	if (!buffer)
 		return EC_BAD_PARAM;
 
-	km = 1;
-	vm = 0;
-	for (i = 0; (i < blen) && (c = buffer[i]); i++) {
-		if (km) {
-			if (c == '=') {
-				kbuf[ki] = '\0';
-				km = 0;
-				vm = 1;
-			} else if (c == '\n' || c == '\r') {
-				/* error! no = when hit end */
-			} else if (c != ' ') {
-				kbuf[ki++] = c;
-			}
-		} else if (vm) {
-			if (c == '\n' || c == '\r') {
-				/* end of kv, push them to queue */
-				vbuf[vi] = '\0';
-				if (kbuf[0] != '\0') {
-					tmpkv[(kvcnt << 1) + 0] = kbuf[0] ? kstr_dup(kbuf) : NULL;
-					tmpkv[(kvcnt << 1) + 1] = vbuf[0] ? kstr_dup(vbuf) : kstr_dup("");
-					kvcnt++;
-					/* printf("'%s'='%s'\n", kbuf, vbuf); */
-				}
-
-				km = 1;
-				vm = 0;
-				ki = vi = 0;
-			} else {
-				vbuf[vi++] = c;
-			}
+	/* Stop at NUL as before */
+	blen = strnlen(buffer, blen);
+
+	while ((line = kbuf_getline(buffer, blen, &pos, &len))) {
+		eq = (const char*)memchr(line, '=', len);
+		if (!eq)
+			continue;
+
+		k = kv_dup(line, eq - line);
+		for (i = ki = 0; k[i]; i++)
+			if (k[i] != ' ')
+				k[ki++] = k[i];
+		k[ki] = '\0';
+		if (!ki) {
+			kmem_free(k);
+			continue;
 		}
-	}
 
-	if (vm && (kbuf[0] != '\0')) {
-		vbuf[vi] = '\0';
-		tmpkv[(kvcnt << 1) + 0] = kbuf[0] ? kstr_dup(kbuf) : NULL;
-		tmpkv[(kvcnt << 1) + 1] = vbuf[0] ? kstr_dup(vbuf) : kstr_dup("");
+		ARR_GROW(kvarr, kvcap, 2 * (kvcnt + 1), char*);
+		kvarr[(kvcnt << 1) + 0] = k;
+		kvarr[(kvcnt << 1) + 1] = kv_dup(eq + 1, line + len - eq - 1);
 		kvcnt++;
-		/* printf("'%s'='%s'\n", kbuf, vbuf); */
-	}
-
-	if (kvcnt > 0) {
-		kvarr = kmem_alloz(2 * kvcnt, char*);
-		memcpy(kvarr, tmpkv, (2 * kvcnt * sizeof(char*)));
 	}
 
 	*okv = kvarr;
@@ -343,21 +334,15 @@ static kopt_entry_s *entry_find(const char *path)
 int kopt_setfile(const char *path)
 {
 	kbuf_s kb;
-	FILE *fp;
-	int err = 0;
-
-	fp = fopen(path, "rt");
-	if (!fp)
-		return -1;
 
 	kbuf_init(&kb, 0);
-	while (kbuf_fread(&kb, 1024, fp, &err) > 0 && !err)
-		;
-	fclose(fp);
+	if (kbuf_load_file(&kb, path)) {
+		kbuf_release(&kb);
+		return -1;
+	}
 
-	kb.buf[kb.len] = '\0';
 	if (kb.len)
-		kopt_setbat(kbuf_detach(&kb, NULL), 0, 1);
+		kopt_setbat(kb.buf, 0, 1);
 
 	kbuf_release(&kb);
 	return 0;
@@ -397,7 +382,15 @@ int kopt_setbat(const char *inibuf, int errbrk, int add)
 	return kopt_ret | ses_ret | reterr;
 }
 
-static char *dat_to_str(char *dat, int len)
+/* From arena if given, else from kmem */
+static char *ini_alloc(kmem_arena_s *ar, int size)
+{
+	if (ar)
+		return (char*)kmem_arena_get(ar, size);
+	return (char*)kmem_alloc(size, char);
+}
+
+static char *dat_to_str(kmem_arena_s *ar, char *dat, int len)
 {
 	static char map[16] = { '0', '1', '2', '3', '4', '5', '6', '7', '8',
 		'9', 'a', 'b', 'c', 'd', 'e', 'f' };
@@ -405,7 +398,7 @@ static char *dat_to_str(char *dat, int len)
 	int i;
 	unsigned char c;
 
-	p = ret = (char*)kmem_alloc(len * 2 + 1, char);
+	p = ret = ini_alloc(ar, len * 2 + 1);
 	for (i = 0; i < len; i++) {
 		c = (unsigned char)dat[i];
 		*p++ = map[c >> 4];
@@ -415,7 +408,13 @@ static char *dat_to_str(char *dat, int len)
 	return ret;
 }
 
-int kopt_getini_by_opt(void *opt, char **ret)
+/**
+ * \brief Get opt's in ini format, the result is from arena.
+ *
+ * \param ar Where the result from, NULL for kmem, then free it by
+ *        kmem_free.
+ */
+int kopt_getini_by_opt_ex(void *opt, kmem_arena_s *ar, char **ret)
 {
 	kopt_entry_s *oe = (kopt_entry_s*)opt;
 	int err = EC_NG, v_int, dlen;
@@ -431,15 +430,15 @@ int kopt_getini_by_opt(void *opt, char **ret)
 		err = getint(oe, NULL, NULL, &v_int);
 		if (err != EC_OK)
 			break;
-		*ret = (char*)kmem_alloz(20, char);
-		sprintf(*ret, "%d", v_int);
+		*ret = ini_alloc(ar, KBUF_NUM_MAX + 1);
+		(*ret)[kbuf_fmt_i(*ret, v_int)] = '\0';
 		break;
 	case 'd':
 		/* TODO */
 		err = getdat(oe, NULL, NULL, &v_dat, &dlen);
 		if (err != EC_OK)
 			break;
-		*ret = dat_to_str(v_dat, dlen);
+		*ret = dat_to_str(ar, v_dat, dlen);
 		break;
 	case 'e':
 		/* XXX, can not get a event */
@@ -448,14 +447,14 @@ int kopt_getini_by_opt(void *opt, char **ret)
 		err = getstr(oe, NULL, NULL, &v_str);
 		if (err != EC_OK)
 			break;
-		*ret = kstr_dup(v_str);
+		*ret = ar ? kmem_arena_strdup(ar, v_str) : kstr_dup(v_str);
 		break;
 	case 'p':
 		err = getptr(oe, NULL, NULL, &v_ptr);
 		if (err != EC_OK)
 			break;
-		*ret = (char*)kmem_alloz(10, char);
-		sprintf(*ret, "%p", v_ptr);
+		*ret = ini_alloc(ar, KBUF_NUM_MAX + 1);
+		(*ret)[kbuf_fmt_p(*ret, v_ptr)] = '\0';
 		break;
 	default:
 		kassert(0, "should not be here");
@@ -465,15 +464,21 @@ int kopt_getini_by_opt(void *opt, char **ret)
 	return err;
 }
 
+int kopt_getini_by_opt(void *opt, char **ret)
+{
+	return kopt_getini_by_opt_ex(opt, NULL, ret);
+}
+
 /**
  * \brief Get opt's in ini format.
  *
  * \param path
+ * \param ar Where the result from, NULL for kmem.
  * \param ret
  *
  * \return
  */
-int kopt_getini(const char *path, char **ret)
+int kopt_getini_ex(const char *path, kmem_arena_s *ar, char **ret)
 {
 	kopt_entry_s *oe = entry_find(path);
 	int err = EC_NG;
@@ -488,12 +493,17 @@ int kopt_getini(const char *path, char **ret)
 	}
 
 	kopt_set_err(0, NULL);
-	err = kopt_getini_by_opt(oe, ret);
+	err = kopt_getini_by_opt_ex(oe, ar, ret);
 
 	/* spl_lck_rel(__g_optcc->lck); */
 	return err;
 }
 
+int kopt_getini(const char *path, char **ret)
+{
+	return kopt_getini_ex(path, NULL, ret);
+}
+
 static void sync_from_nylist(kopt_entry_s *oe)
 {
 	K_dlist_entry *entry;
@@ -1514,7 +1524,8 @@ static void diag_list_foreach(void *opt, const char *path, void *userdata)
 {
 	kbuf_s *kb = (kbuf_s*)userdata;
 
-	kbuf_addf(kb, "%s\r\n", path);
+	kbuf_adds(kb, path);
+	kbuf_add(kb, "\r\n", 2);
 }
 
 static int og_diag_list(void *opt, void *pa, void *pb)
@@ -1541,43 +1552,63 @@ static void diag_dump_foreach(void *opt, const char *path, void *userdata)
 	if (!strcmp("s:/k/opt/diag/dump", path))
 		return;
 
-	kbuf_addf(kb, "%1d:%1d:%1d %4d:%4d:%4d:%4d %2d:%2d %-30s\t",
-			!!oe->setter, !!oe->getter, !!oe->delter,
-			oe->set_called, oe->get_called,
-			oe->awch_called, oe->bwch_called,
-			oe->awch_cnt, oe->bwch_cnt, path);
+	/* "%1d:%1d:%1d %4d:%4d:%4d:%4d %2d:%2d %-30s\t" */
+	kbuf_add8(kb, '0' + !!oe->setter);
+	kbuf_add8(kb, ':');
+	kbuf_add8(kb, '0' + !!oe->getter);
+	kbuf_add8(kb, ':');
+	kbuf_add8(kb, '0' + !!oe->delter);
+	kbuf_add8(kb, ' ');
+	kbuf_addu(kb, oe->set_called, 4);
+	kbuf_add8(kb, ':');
+	kbuf_addu(kb, oe->get_called, 4);
+	kbuf_add8(kb, ':');
+	kbuf_addu(kb, oe->awch_called, 4);
+	kbuf_add8(kb, ':');
+	kbuf_addu(kb, oe->bwch_called, 4);
+	kbuf_add8(kb, ' ');
+	kbuf_addu(kb, oe->awch_cnt, 2);
+	kbuf_add8(kb, ':');
+	kbuf_addu(kb, oe->bwch_cnt, 2);
+	kbuf_add8(kb, ' ');
+	kbuf_addpad(kb, path, strlen(path), -30);
+	kbuf_add8(kb, '\t');
 
 	switch (KOPT_TYPE(oe)) {
 	case 'a':
-		kbuf_addf(kb, "a:%p, l:%d", oe->v.cur.a.v, oe->v.cur.a.l);
+	case 'd':
+		kbuf_add(kb, "a:", 2);
+		kbuf_addp(kb, oe->v.cur.a.v);
+		kbuf_add(kb, ", l:", 4);
+		kbuf_addi(kb, oe->v.cur.a.l, 0);
 		break;
 	case 'b':
 	case 'e':
 	case 'i':
 		reti = 0;
 		err = getint(oe, NULL, NULL, &reti);
-		kbuf_addf(kb, "%d", err ? -1 : reti);
-		break;
-	case 'd':
-		kbuf_addf(kb, "a:%p, l:%d", oe->v.cur.a.v, oe->v.cur.a.l);
+		kbuf_addi(kb, err ? -1 : reti, 0);
 		break;
 	case 's':
 		rets = NULL;
 		err = getstr(oe, NULL, NULL, &rets);
 		if (err)
-			kbuf_addf(kb, "(err)");
+			kbuf_adds(kb, "(err)");
 		else if (!rets)
-			kbuf_addf(kb, "(null)");
-		else
-			kbuf_addf(kb, "\"%s\"", rets);
+			kbuf_adds(kb, "(null)");
+		else {
+			kbuf_add8(kb, '"');
+			kbuf_addesc(kb, rets, strlen(rets));
+			kbuf_add8(kb, '"');
+		}
 		break;
 	case 'p':
 		retp = 0;
 		err = getptr(oe, NULL, NULL, &retp);
-		kbuf_addf(kb, "%p", err ? NULL : retp);
+		kbuf_addp(kb, err ? NULL : retp);
 		break;
 	}
-	kbuf_addf(kb, "\r\n");
+	kbuf_add(kb, "\r\n", 2);
 }
 
 static int og_diag_dump(void *opt, void *pa, void *pb)
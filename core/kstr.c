@@ -66,7 +66,382 @@ char *kstr_subs(char *a_str, char a_from, char a_to)
 	return a_str;
 }
 
+/*-----------------------------------------------------------------------
+ * XML escape
+ *
+ * Clean runs are found 16 or 32 bytes a time and copied by memcpy, only
+ * the special chars go through the entity table.
+ */
+typedef struct _xml_ent_s xml_ent_s;
+struct _xml_ent_s {
+	const char *str;
+	int len;
+};
+
+static const xml_ent_s __xml_ent[256] = {
+	['&'] = { "&amp;", 5 },
+	['<'] = { "&lt;", 4 },
+	['>'] = { "&gt;", 4 },
+	['"'] = { "&quot;", 6 },
+	[9] = { "&#9;", 4 },
+	[10] = { "&#10;", 5 },
+	[13] = { "&#13;", 5 },
+};
+
+/* Count of leading bytes need not escape */
+typedef size_t (*xml_span_fn)(const char *s, size_t len);
+
+static size_t xml_span_byte(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (__xml_ent[(unsigned char)s[i]].len)
+			break;
+	return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define XML_SPAN_SIMD(name, isa, vec, load, set1, cmpeq, or, movemask) \
+__attribute__((target(isa))) \
+static size_t name(const char *s, size_t len) \
+{ \
+	const size_t vs = sizeof(vec); \
+	const vec amp = set1('&'), lt = set1('<'), gt = set1('>'); \
+	const vec quot = set1('"'), tab = set1(9), lf = set1(10), cr = set1(13); \
+	vec v, m; \
+	unsigned int mask; \
+	size_t i; \
+	\
+	for (i = 0; i + vs <= len; i += vs) { \
+		v = load((const vec*)(s + i)); \
+		m = or(or(or(cmpeq(v, amp), cmpeq(v, lt)), or(cmpeq(v, gt), cmpeq(v, quot))), \
+				or(or(cmpeq(v, tab), cmpeq(v, lf)), cmpeq(v, cr))); \
+		mask = (unsigned int)movemask(m); \
+		if (mask) \
+			return i + __builtin_ctz(mask); \
+	} \
+	return i + xml_span_byte(s + i, len - i); \
+}
+
+XML_SPAN_SIMD(xml_span_sse2, "sse2", __m128i, _mm_loadu_si128,
+		_mm_set1_epi8, _mm_cmpeq_epi8, _mm_or_si128, _mm_movemask_epi8)
+XML_SPAN_SIMD(xml_span_avx2, "avx2", __m256i, _mm256_loadu_si256,
+		_mm256_set1_epi8, _mm256_cmpeq_epi8, _mm256_or_si256, _mm256_movemask_epi8)
+#endif
+
+static size_t xml_span_init(const char *s, size_t len);
+static xml_span_fn __xml_span = xml_span_init;
+
+static size_t xml_span_init(const char *s, size_t len)
+{
+	xml_span_fn fn = xml_span_byte;
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		fn = xml_span_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		fn = xml_span_sse2;
+#endif
+
+	__atomic_store_n(&__xml_span, fn, __ATOMIC_RELAXED);
+	return fn(s, len);
+}
+
+/* Short runs are common in dense text, check some bytes before SIMD */
+static kinline size_t xml_clean(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < 16 && i < len; i++)
+		if (__xml_ent[(unsigned char)s[i]].len)
+			return i;
+	if (i == len)
+		return i;
+	return i + __xml_span(s + i, len - i);
+}
+
+/**
+ * \brief Escape &, <, >, ", tab, CR and LF for XML.
+ *
+ * \param a_os NULL *a_os to allocate by kmem_alloc, else the buffer to use.
+ * \param a_ol IN size of *a_os if given, OUT length of the output.
+ *
+ * \return 0 for success, 1 for buffer too small and the output truncated.
+ */
 int kstr_escxml(const char *a_is, char **a_os, int *a_ol)
+{
+	const char *s, *end;
+	const xml_ent_s *ent;
+	size_t ilen, n, olen;
+	char *o, *oend;
+
+	if (!a_is)
+		return -1;
+
+	ilen = strlen(a_is);
+	end = a_is + ilen;
+
+	if (!*a_os) {
+		/* caller not provide buffer, allocate here */
+		olen = ilen;
+		for (s = a_is; s < end; s++) {
+			s += xml_clean(s, end - s);
+			if (s < end)
+				olen += __xml_ent[(unsigned char)*s].len - 1;
+		}
+
+		*a_os = (char*)kmem_alloc(olen + 1, char);
+		if (!*a_os)
+			return -1;
+		*a_ol = olen + 1;
+	}
+	if (*a_ol <= 0)
+		return 1;
+
+	o = *a_os;
+	oend = o + *a_ol - 1;
+
+	for (s = a_is; s < end; s++) {
+		n = xml_clean(s, end - s);
+		if (n > oend - o)
+			goto trunc;
+		if (n < 16) {
+			while (n--)
+				*o++ = *s++;
+		} else {
+			memcpy(o, s, n);
+			o += n;
+			s += n;
+		}
+		if (s == end)
+			break;
+
+		ent = &__xml_ent[(unsigned char)*s];
+		if (ent->len > oend - o)
+			goto trunc;
+		memcpy(o, ent->str, ent->len);
+		o += ent->len;
+	}
+
+	*o = '\0';
+	*a_ol = o - *a_os;
+	return 0;
+
+trunc:
+	*o = '\0';
+	*a_ol = o - *a_os;
+	return 1;
+}
+
+static int put_utf8(char *o, unsigned int c)
+{
+	if (c < 0x80) {
+		o[0] = c;
+		return 1;
+	}
+	if (c < 0x800) {
+		o[0] = 0xc0 | (c >> 6);
+		o[1] = 0x80 | (c & 0x3f);
+		return 2;
+	}
+	if (c < 0x10000) {
+		o[0] = 0xe0 | (c >> 12);
+		o[1] = 0x80 | ((c >> 6) & 0x3f);
+		o[2] = 0x80 | (c & 0x3f);
+		return 3;
+	}
+	o[0] = 0xf0 | (c >> 18);
+	o[1] = 0x80 | ((c >> 12) & 0x3f);
+	o[2] = 0x80 | ((c >> 6) & 0x3f);
+	o[3] = 0x80 | (c & 0x3f);
+	return 4;
+}
+
+/* Decode the entity at s, return length of it in s, 0 if not known */
+static int xml_unent(const char *s, size_t len, char *o, int *olen)
+{
+	static const struct { const char *str; int len; char c; } named[] = {
+		{ "&amp;", 5, '&' }, { "&lt;", 4, '<' }, { "&gt;", 4, '>' },
+		{ "&quot;", 6, '"' }, { "&apos;", 6, '\'' },
+	};
+	unsigned long c = 0;
+	size_t i;
+	int hex;
+
+	if (len > 1 && s[1] == '#') {
+		hex = (len > 2 && (s[2] == 'x' || s[2] == 'X'));
+		for (i = hex ? 3 : 2; i < len && i < 12; i++) {
+			if (s[i] >= '0' && s[i] <= '9')
+				c = c * (hex ? 16 : 10) + s[i] - '0';
+			else if (hex && isxdigit((unsigned char)s[i]))
+				c = c * 16 + (tolower((unsigned char)s[i]) - 'a' + 10);
+			else
+				break;
+		}
+		if (i < len && s[i] == ';' && i > (hex ? 3 : 2) && c && c <= 0x10ffff) {
+			*olen = put_utf8(o, c);
+			return i + 1;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < sizeof(named) / sizeof(named[0]); i++)
+		if (len >= named[i].len && !memcmp(s, named[i].str, named[i].len)) {
+			*o = named[i].c;
+			*olen = 1;
+			return named[i].len;
+		}
+	return 0;
+}
+
+/**
+ * \brief Undo kstr_escxml, also &apos; and &#N;, &#xH; as UTF-8.
+ *
+ * Unknown entity is kept as it is. Parameters and return as kstr_escxml,
+ * the output is never longer than input.
+ */
+int kstr_unescxml(const char *a_is, char **a_os, int *a_ol)
+{
+	const char *s, *amp, *end;
+	char *o, *oend, tmp[4];
+	size_t n;
+	int elen, olen;
+
+	if (!a_is)
+		return -1;
+
+	n = strlen(a_is);
+	end = a_is + n;
+
+	if (!*a_os) {
+		*a_os = (char*)kmem_alloc(n + 1, char);
+		if (!*a_os)
+			return -1;
+		*a_ol = n + 1;
+	}
+	if (*a_ol <= 0)
+		return 1;
+
+	o = *a_os;
+	oend = o + *a_ol - 1;
+
+	for (s = a_is; s < end; ) {
+		amp = (const char*)memchr(s, '&', end - s);
+		n = (amp ? amp : end) - s;
+		if (n > oend - o)
+			goto trunc;
+		memcpy(o, s, n);
+		o += n;
+		s += n;
+		if (!amp)
+			break;
+
+		elen = xml_unent(s, end - s, tmp, &olen);
+		if (!elen) {
+			elen = olen = 1;
+			tmp[0] = '&';
+		}
+		if (olen > oend - o)
+			goto trunc;
+		memcpy(o, tmp, olen);
+		o += olen;
+		s += elen;
+	}
+
+	*o = '\0';
+	*a_ol = o - *a_os;
+	return 0;
+
+trunc:
+	*o = '\0';
+	*a_ol = o - *a_os;
+	return 1;
+}
+
+int kstr_toint(const char *s, int *ret)
+{
+	int val;
+	int i, c, num_start = 0;
+
+	if (s[0] == '+' || s[0] == '-')
+		num_start = 1;
+
+	if (s[num_start] == '0' && (s[num_start + 1] == 'x' ||
+				s[num_start + 1] == 'X')) {
+		for (i = num_start + 2; (c = s[i]); i++)
+			if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')
+						|| (c >= 'A' && c <= 'F'))) {
+				return -1;
+			}
+		errno = 0;
+		val = strtol(s, 0, 16);
+	} else {
+		for (i = num_start; (c = s[i]); i++)
+			if (!(c >= '0' && c <= '9')) {
+				return -1;
+			}
+		errno = 0;
+		val = strtol(s, 0, 10);
+	}
+
+	if (errno != 0)
+		return -1;
+	*ret = val;
+	return 0;
+}
+
+char *kstr_trim_left(char *str)
+{
+	char *p, *po;
+
+	for (p = str; *p; p++) {
+		if (isspace(*p))
+			continue;
+
+		if (p == str)
+			break;
+
+		for (po = str; *p; p++)
+			*po++ = *p;
+		*po++ = '\0';
+		break;
+	}
+
+	return str;
+}
+
+char *kstr_trim_right(char *str)
+{
+	int i, len = strlen(str);
+
+	for (i = len - 1; i >= 0; i--) {
+		if (isspace(str[i]))
+			continue;
+		str[i + 1] = '\0';
+		break;
+	}
+
+	return str;
+}
+
+char *kstr_trim(char *str)
+{
+	kstr_trim_right(str);
+	kstr_trim_left(str);
+	return str;
+}
+
+
+#ifdef KSTR_TEST
+#include <stdio.h>
+#include <time.h>
+
+/* The one before the span scan, for compare */
+static int escxml_strcat(const char *a_is, char **a_os, int *a_ol)
 {
 	const char *s;
 	char *end;
@@ -162,76 +537,107 @@ int kstr_escxml(const char *a_is, char **a_os, int *a_ol)
 	return 0;
 }
 
-int kstr_toint(const char *s, int *ret)
+static double now_sec(void)
 {
-	int val;
-	int i, c, num_start = 0;
+	struct timespec tp;
 
-	if (s[0] == '+' || s[0] == '-')
-		num_start = 1;
-
-	if (s[num_start] == '0' && (s[num_start + 1] == 'x' ||
-				s[num_start + 1] == 'X')) {
-		for (i = num_start + 2; (c = s[i]); i++)
-			if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')
-						|| (c >= 'A' && c <= 'F'))) {
-				return -1;
-			}
-		errno = 0;
-		val = strtol(s, 0, 16);
-	} else {
-		for (i = num_start; (c = s[i]); i++)
-			if (!(c >= '0' && c <= '9')) {
-				return -1;
-			}
-		errno = 0;
-		val = strtol(s, 0, 10);
-	}
-
-	if (errno != 0)
-		return -1;
-	*ret = val;
-	return 0;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec / 1e9;
 }
 
-char *kstr_trim_left(char *str)
+/* 1 special every `every' bytes, 0 for none */
+static char *make_text(int size, int every)
 {
-	char *p, *po;
-
-	for (p = str; *p; p++) {
-		if (isspace(*p))
-			continue;
-
-		if (p == str)
-			break;
-
-		for (po = str; *p; p++)
-			*po++ = *p;
-		*po++ = '\0';
-		break;
-	}
-
-	return str;
+	static const char special[] = "&<>\"\t\n\r";
+	char *s = (char*)malloc(size + 1);
+	int i;
+
+	for (i = 0; i < size; i++)
+		s[i] = 'a' + (i * 7) % 26;
+	if (every)
+		for (i = every - 1; i < size; i += every)
+			s[i] = special[(i / every) % 7];
+	s[size] = '\0';
+	return s;
 }
 
-char *kstr_trim_right(char *str)
+static int check(const char *in)
 {
-	int i, len = strlen(str);
-
-	for (i = len - 1; i >= 0; i--) {
-		if (isspace(str[i]))
-			continue;
-		str[i + 1] = '\0';
-		break;
-	}
-
-	return str;
+	char *a = NULL, *b = NULL, *c = NULL, small[64], *sp = small;
+	int alen, blen, clen, slen = sizeof(small), err = 0;
+
+	escxml_strcat(in, &a, &alen);
+	kstr_escxml(in, &b, &blen);
+	if (alen != blen || strcmp(a, b))
+		err = 1;
+
+	kstr_unescxml(b, &c, &clen);
+	if (strcmp(c, in))
+		err = 2;
+
+	/* Truncated at entity boundary, still NUL terminated */
+	if (kstr_escxml(in, &sp, &slen) == 0 && blen >= (int)sizeof(small))
+		err = 3;
+	if (slen >= (int)sizeof(small) || strncmp(small, b, slen) || small[slen])
+		err = 4;
+
+	kmem_free_s(a);
+	kmem_free_s(b);
+	kmem_free_s(c);
+	return err;
 }
 
-char *kstr_trim(char *str)
+int main(int argc, char *argv[])
 {
-	kstr_trim_right(str);
-	kstr_trim_left(str);
-	return str;
-}
+	static const int every[] = { 0, 4, 64, 1024 };
+	const int size = 8 << 20;
+	char *in, *out, *p;
+	double t, t0, t1;
+	int i, k, olen, err;
+
+	for (i = 0; i < 1000; i++) {
+		in = make_text(i, i % 9);
+		err = check(in);
+		free(in);
+		if (err) {
+			printf("check failed, len %d, err %d\n", i, err);
+			return 1;
+		}
+	}
+	in = "&#65;&#x4e2d;&bad;&amp&apos;";
+	out = NULL;
+	kstr_unescxml(in, &out, &olen);
+	printf("unesc: %s -> %s\n", in, out);
+	kmem_free(out);
+
+	for (k = 0; k < sizeof(every) / sizeof(every[0]); k++) {
+		in = make_text(size, every[k]);
+
+		out = NULL;
+		t = now_sec();
+		escxml_strcat(in, &out, &olen);
+		t0 = now_sec() - t;
+		kmem_free(out);
+
+		out = NULL;
+		t = now_sec();
+		kstr_escxml(in, &out, &olen);
+		t1 = now_sec() - t;
+
+		p = NULL;
+		t = now_sec();
+		kstr_unescxml(out, &p, &olen);
+		t = now_sec() - t;
+
+		printf("1/%-5d strcat %8.0f MB/s, span %8.0f MB/s, unesc %8.0f MB/s\n",
+				every[k], size / t0 / 1e6, size / t1 / 1e6, size / t / 1e6);
+
+		kmem_free(out);
+		kmem_free(p);
+		free(in);
+	}
 
+	printf("check ok\n");
+	return 0;
+}
+#endif /* KSTR_TEST */
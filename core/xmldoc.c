@@ -18,6 +18,33 @@
  * @{
  */
 
+/**
+ * @brief Append the pending character data to the current node
+ *
+ * @param doc KXmlDoc
+ */
+static void text_flush(KXmlDoc *doc)
+{
+	KXmlNode *node = doc->cur_node;
+	kint osl;
+	kchar *nbuf;
+
+	if (!doc->text_len)
+		return;
+
+	osl = node->text ? strlen(node->text) : 0;
+	nbuf = kmem_alloc(osl + doc->text_len + 1, char);
+	if (osl)
+		memcpy(nbuf, node->text, osl);
+	memcpy(nbuf + osl, doc->text, doc->text_len);
+	nbuf[osl + doc->text_len] = 0;
+
+	kmem_free_s(node->text);
+	node->text = nbuf;
+
+	doc->text_len = 0;
+}
+
 /**
  * @brief Start a XML element
  *
@@ -29,9 +56,13 @@ static void onStartElement(void *userData, const XML_Char *name, const XML_Char
 {
 	kint i;
 	KXmlDoc *doc = (KXmlDoc*)userData;
-	KXmlNode *node = xmlnode_new(knil, (kchar*)name, knil);
+	KXmlNode *node;
 	KXmlAttr *attr;
 
+	text_flush(doc);
+
+	node = xmlnode_new(knil, (kchar*)name, knil);
+
 	xmldoc_add_node(doc, node, doc->cur_node);
 	doc->cur_node = node;
 
@@ -52,8 +83,10 @@ static void onEndElement(void *userData, const XML_Char *name)
 {
 	KXmlDoc *doc = (KXmlDoc*)userData;
 
-	if (doc)
+	if (doc) {
+		text_flush(doc);
 		xmldoc_goto_node(doc, "..", 0);
+	}
 }
 
 #define ISSPACE(c) (((c) == 0x20) || ((c) == 0x0D) || ((c) == 0x0A) || ((c) == 0x09))
@@ -66,28 +99,30 @@ static void onEndElement(void *userData, const XML_Char *name)
  * @param len strlen(s)
  *
  * @warning This function will called for every line for every element, and DO NOT strip any white spaces
+ *
+ * The pieces are gathered in the arena of xmldoc_parse, and set to the node
+ * once by text_flush.
  */
 static void onCharacterData(void *userData, const XML_Char *s, int len)
 {
-	kint osl, nsl;
+	KXmlDoc *doc = (KXmlDoc*)userData;
 	kchar *nbuf;
-	KXmlNode *node = ((KXmlDoc*)userData)->cur_node;
-
-	if ((node->text)) {
-		osl = strlen((node->text));
-		nsl = len;
-		nbuf = kmem_alloc(osl + nsl + 1, char);
-		memcpy(nbuf, (node->text), osl);
-		memcpy(nbuf + osl, (s), nsl);
-		nbuf[osl + nsl] = 0;
-		kmem_free_sz(node->text);
-	} else {
-		nsl = len;
-		nbuf = kmem_alloc(nsl + 1, char);
-		memcpy(nbuf, (s), nsl + 1);
-		nbuf[nsl] = 0;
+	kint cap;
+
+	if (doc->text_len + len > doc->text_cap) {
+		cap = doc->text_cap ? doc->text_cap * 2 : 256;
+		while (cap < doc->text_len + len)
+			cap *= 2;
+
+		nbuf = (kchar*)kmem_arena_get(doc->tmp, cap);
+		if (doc->text_len)
+			memcpy(nbuf, doc->text, doc->text_len);
+		doc->text = nbuf;
+		doc->text_cap = cap;
 	}
-	(node->text) = nbuf;
+
+	memcpy(doc->text + doc->text_len, s, len);
+	doc->text_len += len;
 }
 
 /** @} */
@@ -163,6 +198,14 @@ kint xmldoc_del(KXmlDoc *doc)
  */
 kvoid xmldoc_parse(KXmlDoc *doc, const kchar *buffer, kint buflen)
 {
+	kchar stk[2048];
+	kmem_arena_s ar;
+
+	kmem_arena_init(&ar, stk, sizeof(stk));
+	doc->tmp = &ar;
+	doc->text = knil;
+	doc->text_len = doc->text_cap = 0;
+
 	XML_SetUserData(doc->parser, doc);
 	XML_SetElementHandler(doc->parser, onStartElement, onEndElement);
 	XML_SetCharacterDataHandler(doc->parser, onCharacterData);
@@ -170,6 +213,12 @@ kvoid xmldoc_parse(KXmlDoc *doc, const kchar *buffer, kint buflen)
 	XML_Parse(doc->parser, buffer, buflen, 1);
 	doc->parsedOffset = XML_GetCurrentByteIndex(doc->parser);
 
+	text_flush(doc);
+	doc->tmp = knil;
+	doc->text = knil;
+	doc->text_cap = 0;
+	kmem_arena_release(&ar);
+
 	/* reset current node to root */
 	doc->cur_node = doc->root;
 }
@@ -9,10 +9,17 @@
 #ifndef __K_FTFS_H__
 #define __K_FTFS_H__
 
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Bytes of v1 header, same as ftfs_header_length() */
+#define FTFS_HDR_LEN            40
+
 /**
  * \brief Pack the raw data bo FTFS format.
  * Giving data, wrap the data with FTFS header. Caller should
@@ -26,6 +33,25 @@ extern "C" {
  */
 void *ftfs_pack(const char *dat, int len, int *packlen);
 
+/**
+ * \brief Header of dat to hdr, iov[0] and iov[1] point to hdr and dat.
+ * Write the two iov out, e.g. by writev, is same as write ftfs_pack()
+ * result, but payload is not copied.
+ *
+ * \param hdr Space for header, live as long as iov is used.
+ * \param dat Raw data.
+ * \param len Raw data length.
+ * \param iov Return the header and data.
+ */
+void ftfs_pack_iov(char hdr[FTFS_HDR_LEN], const char *dat, int len, struct iovec iov[2]);
+
+/**
+ * \brief Write header and data to fd by writev.
+ *
+ * \return 0 for success, -1 for write error.
+ */
+int ftfs_write(int fd, const char *dat, int len);
+
 /**
  * \brief Peek the raw data form ftfs_s struct.
  *
@@ -38,6 +64,22 @@ void *ftfs_pack(const char *dat, int len, int *packlen);
  */
 int ftfs_unpack(void *pack, char **md5sum, char **dat, int *len);
 
+/**
+ * \brief Verify a package of size bytes, e.g. mapped by kbuf_map_file().
+ * Same as ftfs_unpack() but never read beyond size.
+ *
+ * \return 0 for success, -1 for bad magic, -2 for bad md5sum, -3 for otherwise
+ */
+int ftfs_check(const void *pack, size_t size, char **dat, int *len);
+
+/**
+ * \brief Read one package from fd, verify while reading.
+ * The data returned should be freed by \c kmem_free.
+ *
+ * \return 0 for success, -1 for bad magic, -2 for bad md5sum, -3 for otherwise
+ */
+int ftfs_read(int fd, char **dat, int *len);
+
 /**
  * \brief Get the rest data length of the whole ftfs package.
  *
@@ -55,6 +97,80 @@ int ftfs_rest_length(void *pack, int length);
  */
 int ftfs_header_length();
 
+/*-----------------------------------------------------------------------
+ * FTFS v2, payload cut to chunks with a md5 for each chunk. The header
+ * and the chunk digest table are checked when open, a chunk is checked
+ * when read, so part of a big image can be used without check all, and
+ * threads can read different chunks by one ftfs2_s at the same time.
+ *
+ *   ftfs2_s f2;
+ *
+ *   ftfs2_write(fd, dat, len, 0);
+ *   ...
+ *   lseek(fd, 0, SEEK_SET);
+ *   if (!ftfs2_open_fd(&f2, fd)) {
+ *           n = ftfs2_read_chunk(&f2, 3, buf);
+ *           ftfs2_close(&f2);
+ *   }
+ */
+#define FTFS2_CHUNK_SIZE        (64 * 1024)
+#define FTFS2_CHUNK_MAX         (16 * 1024 * 1024)
+#define FTFS2_CHUNK_CNT_MAX     (16 * 1024 * 1024)
+
+typedef struct _ftfs2_s ftfs2_s;
+struct _ftfs2_s {
+	unsigned int chunk_size;
+	unsigned int nchunk;
+	unsigned long long len;                 /** payload length */
+	const unsigned char (*sums)[16];        /** digest of each chunk */
+
+	const char *dat;                        /** payload, opened from memory */
+	int fd;                                 /** -1 if opened from memory */
+	off_t dofs;                             /** payload offset in fd */
+	unsigned char (*own)[16];
+};
+
+/**
+ * \brief Write v2 package to fd, payload not copied.
+ *
+ * \param chunk_size 0 for FTFS2_CHUNK_SIZE.
+ *
+ * \return 0 for success, -1 for bad size or write error.
+ */
+int ftfs2_write(int fd, const char *dat, unsigned long long len, unsigned int chunk_size);
+
+/**
+ * \brief Open a v2 package in memory, e.g. mapped by kbuf_map_file().
+ *
+ * \return 0 for success, -1 for bad magic, -2 for bad md5sum, -3 for otherwise
+ */
+int ftfs2_open_mem(ftfs2_s *f2, const void *pack, size_t size);
+
+/**
+ * \brief Open a v2 package at the current offset of fd.
+ * The chunks are read by pread, the fd offset is not changed.
+ *
+ * \return 0 for success, -1 for bad magic, -2 for bad md5sum, -3 for otherwise
+ */
+int ftfs2_open_fd(ftfs2_s *f2, int fd);
+void ftfs2_close(ftfs2_s *f2);
+
+/**
+ * \brief Check chunk idx and copy it to buf.
+ *
+ * \param buf chunk_size bytes at least, can be NULL for opened from memory.
+ *
+ * \return Chunk length, -2 for bad md5sum, -3 for otherwise
+ */
+int ftfs2_read_chunk(ftfs2_s *f2, unsigned int idx, char *buf);
+
+/**
+ * \brief Check all the chunks.
+ *
+ * \return 0 for success, -2 for bad md5sum, -3 for otherwise
+ */
+int ftfs2_check(ftfs2_s *f2);
+
 #ifdef __cplusplus
 }
 #endif
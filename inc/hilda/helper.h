@@ -7,18 +7,44 @@
 extern "C" {
 #endif
 
-#define ARR_INC(STEP, ARR, LEN, TYPE) \
+/*
+ * Growable array: ARR is the buffer, LEN the count of slots in use and CAP
+ * the count of slots allocated, both in elements of TYPE.
+ *
+ * ARR_GROW makes room for at least NEED slots. Capacity doubles through
+ * kmem_realloc, so appending N elements costs O(N) copies in total
+ * instead of O(N^2).
+ *
+ * ARR_ADD appends STEP zeroed slots at the tail, the first new one is
+ * ARR[LEN - STEP] afterwards.
+ *
+ * ARR_FREE releases the buffer and resets LEN and CAP.
+ */
+#define ARR_GROW(ARR, CAP, NEED, TYPE) \
 	do { \
-		void *arr; \
-		(LEN) += (STEP); \
-		\
-		arr = kmem_get((LEN) * sizeof(TYPE)); \
-		if (likely(ARR)) { \
-			memcpy(arr, (ARR), ((LEN) - (STEP)) * sizeof(TYPE)); \
-			kmem_rel((void*)ARR); \
-			memset(((char*)arr) + (((LEN) - (STEP)) * sizeof(TYPE)), 0, (STEP) * sizeof(TYPE)); \
+		if (unlikely((NEED) > (CAP))) { \
+			__typeof__(CAP) __arr_cap = (CAP) ? (CAP) * 2 : 4; \
+			\
+			while (__arr_cap < (NEED)) \
+				__arr_cap *= 2; \
+			ARR = (TYPE*)kmem_realloc((void*)(ARR), \
+					__arr_cap * sizeof(TYPE)); \
+			(CAP) = __arr_cap; \
 		} \
-		ARR = (TYPE*)arr; \
+	} while (0)
+
+#define ARR_ADD(STEP, ARR, LEN, CAP, TYPE) \
+	do { \
+		ARR_GROW(ARR, CAP, (LEN) + (STEP), TYPE); \
+		memset((void*)((ARR) + (LEN)), 0, (STEP) * sizeof(TYPE)); \
+		(LEN) += (STEP); \
+	} while (0)
+
+#define ARR_FREE(ARR, LEN, CAP) \
+	do { \
+		kmem_free_sz(ARR); \
+		(LEN) = 0; \
+		(CAP) = 0; \
 	} while (0)
 
 #ifdef __cplusplus
@@ -36,7 +36,70 @@ void kbuf_adds(kbuf_s *kb, const char *str);
 void kbuf_addf(kbuf_s *kb, const char *fmt, ...);
 void kbuf_vaddf(kbuf_s *kb, const char *fmt, va_list ap);
 
+/*
+ * Reserve then commit, for writer that knows the max length, e.g.
+ *
+ *   p = kbuf_reserve(kb, KBUF_NUM_MAX);
+ *   kbuf_commit(kb, kbuf_fmt_i(p, v));
+ */
+char *kbuf_reserve(kbuf_s *kb, size_t len);
+void kbuf_commit(kbuf_s *kb, size_t len);
+
+/* Enough for any 64 bit integer or pointer by kbuf_fmt_xxx */
+#define KBUF_NUM_MAX            24
+
+/* Format to p without NUL, return the length, no printf parsing */
+int kbuf_fmt_u(char *p, unsigned long long v);
+int kbuf_fmt_i(char *p, long long v);
+int kbuf_fmt_x(char *p, unsigned long long v, int width);
+int kbuf_fmt_p(char *p, const void *ptr);
+
+/*
+ * Width pads the field, space padded and right aligned for decimal and
+ * string, left aligned for negative width, zero padded for hex. 0 for
+ * no padding.
+ */
+void kbuf_addi(kbuf_s *kb, long long v, int width);
+void kbuf_addu(kbuf_s *kb, unsigned long long v, int width);
+void kbuf_addx(kbuf_s *kb, unsigned long long v, int width);
+void kbuf_addp(kbuf_s *kb, const void *ptr);
+void kbuf_addpad(kbuf_s *kb, const char *str, size_t len, int width);
+
+/* C style escaped, \\, \", \n, \r, \t and \xHH for other control */
+void kbuf_addesc(kbuf_s *kb, const char *str, size_t len);
+
 size_t kbuf_fread(kbuf_s *kb, size_t size, FILE *fp, int *err);
+int kbuf_load_file(kbuf_s *kb, const char *path);
+
+/*
+ * Whole file read only, mmap for big file, else read to kb. The data is
+ * not NUL terminated, walk it by kbuf_getline, e.g.
+ *
+ *   kbuf_map_s km;
+ *   size_t pos = 0, len;
+ *
+ *   if (kbuf_map_file(&km, path))
+ *       return -1;
+ *   while ((line = kbuf_getline(km.dat, km.len, &pos, &len)))
+ *       ...
+ *   kbuf_unmap(&km);
+ */
+#define KBUF_MAP_MIN            (256 * 1024)
+
+typedef struct _kbuf_map_s kbuf_map_s;
+struct _kbuf_map_s {
+	const char *dat;
+	size_t len;
+
+	int mapped;
+	kbuf_s kb;
+};
+
+int kbuf_map_file(kbuf_map_s *km, const char *path);
+void kbuf_unmap(kbuf_map_s *km);
+
+/* Next line from pos, EOL is \n, \r\n or \r, not counted in len */
+const char *kbuf_getline(const char *dat, size_t len, size_t *pos, size_t *linelen);
 void kbuf_dump(kbuf_s *kb, const char *banner, char *dat, int len, int width);
 
 #endif /* __K_BUF_H__ */
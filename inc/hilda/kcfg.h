@@ -20,6 +20,7 @@ struct _kcfg_target_s {
 	struct {
 		char **arr;
 		int cnt;
+		int cap;
 	} opts;
 
 	KCFG_SAVE save;
@@ -30,14 +31,18 @@ struct _kcfg_target_s {
 
 	unsigned int pass_through;
 
-	/* XXX: Hash the saved data, skip if same data to be save */
-	char data_hash[32];
+	/* Set by the opt watches, nothing to do for a clean target */
+	unsigned int dirty;
+
+	/* xxh64 of the saved or loaded data, skip if same data to be save */
+	unsigned long long data_hash;
 };
 
 struct _kcfg_s {
 	struct {
 		kcfg_target_s **arr;
 		int cnt;
+		int cap;
 	} target;
 };
 
@@ -0,0 +1,90 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+#ifndef __K_CHAIN_H__
+#define __K_CHAIN_H__
+
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*-----------------------------------------------------------------------
+ * Chain buffer, a list of views on refcounted fixed size segments.
+ *
+ * Unlike kbuf_s, the data is never moved once written. Appending fills
+ * the tail segment or links a new one, prepending links a segment in
+ * front, a slice shares the segments of the source. The whole chain goes
+ * out by one writev or sendmsg, e.g.
+ *
+ *   kchain_s kc;
+ *
+ *   kchain_init(&kc, 0);
+ *   kchain_adds(&kc, body);
+ *   kchain_prependf(&kc, "%zu\r\n", kchain_len(&kc));
+ *   kchain_send(&kc, sock, MSG_NOSIGNAL);
+ *   kchain_release(&kc);
+ *
+ * A chain is not thread safe, but the segments are, a slice can be handed
+ * to other thread.
+ */
+
+#define KCHAIN_SEG_SIZE         4096
+
+/* Refcounted segment, data is appended only, never changed */
+typedef struct _kchain_seg_s kchain_seg_s;
+struct _kchain_seg_s {
+	int ref;
+	unsigned int size;
+	unsigned int used;
+	char dat[0];
+};
+
+/* Bytes [ofs, ofs + len) of seg */
+typedef struct _kchain_ent_s kchain_ent_s;
+struct _kchain_ent_s {
+	kchain_seg_s *seg;
+	unsigned int ofs;
+	unsigned int len;
+};
+
+typedef struct _kchain_s kchain_s;
+struct _kchain_s {
+	size_t len;
+	unsigned int seg_size;
+
+	kchain_ent_s *arr;
+	int cnt;
+	int cap;
+};
+
+void kchain_init(kchain_s *kc, unsigned int seg_size);
+void kchain_release(kchain_s *kc);
+
+#define kchain_len(kc) ((kc)->len)
+
+void kchain_add(kchain_s *kc, const void *data, size_t len);
+void kchain_adds(kchain_s *kc, const char *str);
+void kchain_addf(kchain_s *kc, const char *fmt, ...);
+void kchain_vaddf(kchain_s *kc, const char *fmt, va_list ap);
+void kchain_join(kchain_s *kc, kchain_s *src);
+
+void kchain_prepend(kchain_s *kc, const void *data, size_t len);
+void kchain_prependf(kchain_s *kc, const char *fmt, ...);
+
+int kchain_slice(kchain_s *dst, const kchain_s *src, size_t ofs, size_t len);
+void kchain_drop(kchain_s *kc, size_t len);
+
+int kchain_iov(const kchain_s *kc, struct iovec *iov, int max);
+size_t kchain_copy(const kchain_s *kc, size_t ofs, void *buf, size_t len);
+
+ssize_t kchain_writev(kchain_s *kc, int fd);
+int kchain_send(kchain_s *kc, int sock, int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __K_CHAIN_H__ */
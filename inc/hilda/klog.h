@@ -52,6 +52,7 @@ typedef void (*KRLOGGER)(unsigned char type, unsigned int mask, char *prog, char
 
 #define KLOG_RTM        0x00000100 /* s: Relative Time, in MS, 'ShiJian' */
 #define KLOG_ATM        0x00000200 /* S: ABS Time, in MS, 'ShiJian' */
+#define KLOG_UTM        0x00000400 /* u: Relative Time from klog_init, in US, monotonic */
 
 #define KLOG_PID        0x00001000 /* j: Process ID, 'JinCheng' */
 #define KLOG_TID        0x00002000 /* x: Thread ID, 'XianCheng' */
@@ -63,16 +64,103 @@ typedef void (*KRLOGGER)(unsigned char type, unsigned int mask, char *prog, char
 #define KLOG_LINE       0x00100000 /* N: Line Number */
 
 #define KLOG_ALL        0xffffffff
+
+/* What is logged without rule, KLOG_UTM is turned on by rule "mask=u" */
+#define KLOG_ALL_DFT    (KLOG_ALL & ~KLOG_UTM)
 #define KLOG_DFT        (KLOG_FATAL | KLOG_ALERT | KLOG_CRIT | KLOG_ERR | KLOG_WARNING | KLOG_NOTICE | KLOG_ATM | KLOG_PROG | KLOG_MODU | KLOG_FILE | KLOG_LINE)
 
 /*-----------------------------------------------------------------------
- * Embedded variable used by klog_xxx
+ * Levels above KLOG_COMPILE_LEVEL are removed by compiler, e.g.
+ * -DKLOG_COMPILE_LEVEL=6 drops all the kdebug and klog.
+ */
+#ifndef KLOG_COMPILE_LEVEL
+#define KLOG_COMPILE_LEVEL      7
+#endif
+#define KLOG_COMPILE_MASK       ((2U << (KLOG_COMPILE_LEVEL)) - 1)
+
+/*-----------------------------------------------------------------------
+ * Call site, one for each klog_xxx, all of them are put in section
+ * klog_sites, so klog can update the mask when rule changed.
+ */
+typedef struct _klog_site_s klog_site_s;
+struct _klog_site_s {
+	/* 0 for disabled. Not calculated yet when ver is -1 */
+	unsigned int mask;
+
+	unsigned int level;
+	unsigned char type;
+	int line;
+	const char *modu, *file, *func;
+
+	/* Used by klog */
+	int ver;
+	unsigned int all_mask, rule_pos;
+	char *prog_name, *modu_name, *file_name, *func_name;
+
+	/* Rate limit and dedup, set by the rule rate= and dedup= */
+	unsigned int rate, burst, dedup;
+	unsigned long long tat;
+	unsigned int dropped;
+	/* Last line logged by dedup, and the repeats of it not logged yet */
+	char *dup_msg;
+	unsigned int dup_len, dup_cap, dup_cnt;
+	unsigned long long dup_time;
+};
+
+extern klog_site_s __start_klog_sites[] __attribute__((weak, visibility("hidden")));
+extern klog_site_s __stop_klog_sites[] __attribute__((weak, visibility("hidden")));
+
+void klog_sites_add(klog_site_s *beg, klog_site_s *end);
+void klog_sites_del(klog_site_s *beg);
+
+/*
+ * Register the sites of the executable or shared object which the file
+ * is linked into, so they are updated when rule changed. The section
+ * bounds are hidden, each module only sees its own. Every file including
+ * klog.h has it, klog_sites_add ignores the range already added.
+ */
+static void __attribute__((constructor, used)) __klog_sites_ctor(void)
+{
+	if (__start_klog_sites)
+		klog_sites_add(__start_klog_sites, __stop_klog_sites);
+}
+static void __attribute__((destructor, used)) __klog_sites_dtor(void)
+{
+	if (__start_klog_sites)
+		klog_sites_del(__start_klog_sites);
+}
+
+#define KLOG_SITE_DEF(lvl, indi, modu, file, func, line) \
+	static klog_site_s __kl_site \
+	__attribute__((section("klog_sites"), used, aligned(sizeof(void*)))) = { \
+		KLOG_ALL, (lvl), (indi), (line), (modu), (file), (func), -1, \
+	}
+
+#define KLOG_CHK_AND_CALL(lvl, indi, modu, file, func, line, fmt, ...) do { \
+	if ((lvl) & KLOG_COMPILE_MASK) { \
+		KLOG_SITE_DEF(lvl, indi, modu, file, func, line); \
+		if (unlikely(__kl_site.mask)) { \
+			klog_site_f(&__kl_site, fmt, ##__VA_ARGS__); \
+		} \
+	} \
+} while (0)
+
+#define KLOG_CHK_AND_CALL_AP(lvl, indi, modu, file, func, line, fmt, ap) do { \
+	if ((lvl) & KLOG_COMPILE_MASK) { \
+		KLOG_SITE_DEF(lvl, indi, modu, file, func, line); \
+		if (unlikely(__kl_site.mask)) { \
+			klog_site_vf(&__kl_site, fmt, ap); \
+		} \
+	} \
+} while (0)
+
+/*-----------------------------------------------------------------------
+ * Embedded variable used by kassert
  */
 #define KLOG_INNER_VAR_DEF() \
 	static int VAR_UNUSED __kl_ver_sav = -1; \
 	static char VAR_UNUSED *__kl_modu_name = NULL; \
 	static char VAR_UNUSED *__kl_func_name = NULL; \
-	static int VAR_UNUSED __kl_mask = 0; \
 	int VAR_UNUSED __kl_ver_get = klog_touches()
 
 #define KLOG_SETUP_NAME(modu, file, func) do { \
@@ -90,36 +178,6 @@ typedef void (*KRLOGGER)(unsigned char type, unsigned int mask, char *prog, char
 	} \
 } while (0)
 
-#define KLOG_CHK_AND_CALL(mask, indi, modu, file, func, line, fmt, ...) do { \
-	KLOG_INNER_VAR_DEF(); \
-	if (unlikely(__kl_ver_get > __kl_ver_sav)) { \
-		__kl_ver_sav = __kl_ver_get; \
-		KLOG_SETUP_NAME(modu, file, func); \
-		__kl_mask = klog_calc_mask(__kl_prog_name, __kl_modu_name, __kl_file_name, __kl_func_name, line); \
-		if (!(__kl_mask & (mask))) { \
-			__kl_mask = 0; \
-		} \
-	} \
-	if (__kl_mask) { \
-		klog_f(indi, __kl_mask, __kl_prog_name, modu, __kl_file_name, (char*)func, line, fmt, ##__VA_ARGS__); \
-	} \
-} while (0)
-
-#define KLOG_CHK_AND_CALL_AP(mask, indi, modu, file, func, line, fmt, ap) do { \
-	KLOG_INNER_VAR_DEF(); \
-	if (unlikely(__kl_ver_get > __kl_ver_sav)) { \
-		__kl_ver_sav = __kl_ver_get; \
-		KLOG_SETUP_NAME(modu, file, func); \
-		__kl_mask = klog_calc_mask(__kl_prog_name, __kl_modu_name, __kl_file_name, __kl_func_name, line); \
-		if (!(__kl_mask & (mask))) { \
-			__kl_mask = 0; \
-		} \
-	} \
-	if (__kl_mask) { \
-		klog_vf(indi, __kl_mask, __kl_prog_name, modu, __kl_file_name, (char*)func, line, fmt, ap); \
-	} \
-} while (0)
-
 /*-----------------------------------------------------------------------
  * klog_xxx
  */
@@ -144,7 +202,7 @@ typedef void (*KRLOGGER)(unsigned char type, unsigned int mask, char *prog, char
 			__kl_ver_sav = __kl_ver_get; \
 			KLOG_SETUP_NAME(KLOG_MODU_NAME, __FILE__, __func__); \
 		} \
-		klog_f('!', KLOG_ALL, __kl_prog_name, KLOG_MODU_NAME, __kl_file_name, (char*)__FUNCTION__, __LINE__, \
+		klog_f('!', KLOG_ALL_DFT, __kl_prog_name, KLOG_MODU_NAME, __kl_file_name, (char*)__FUNCTION__, __LINE__, \
 				"ASSERT FAILED: %s\n", msg); \
 	} \
 } while (0)
@@ -162,15 +220,22 @@ char *klog_prog_name_add(char *name);
 char *klog_func_name_add(char *name);
 
 unsigned int klog_calc_mask(char *prog, char *modu, char *file, char *func, int line);
+unsigned int klog_recalc_mask(char *prog, char *modu, char *file, char *func,
+		int line, int ver, unsigned int mask, unsigned int *pos);
 
 void klog_bt(const char *fmt, ...);
 int klog_f(unsigned char type, unsigned int mask, char *prog, char *modu, char *file, char *func, int ln, const char *fmt, ...) __attribute__ ((format (printf, 8, 9)));
 int klog_vf(unsigned char type, unsigned int mask, char *prog, char *modu, char *file, char *func, int ln, const char *fmt, va_list ap);
 
+int klog_site_f(klog_site_s *site, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+int klog_site_vf(klog_site_s *site, const char *fmt, va_list ap);
+
 int klog_add_logger(KNLOGGER logger);
+int klog_add_logger_ex(KNLOGGER logger, unsigned int mask);
 int klog_del_logger(KNLOGGER logger);
 
 int klog_add_rlogger(KRLOGGER logger);
+int klog_add_rlogger_ex(KRLOGGER logger, unsigned int mask);
 int klog_del_rlogger(KRLOGGER logger);
 
 void *klog_attach(void *logcc);
@@ -179,6 +244,29 @@ void klog_touch(void);
 void klog_set_default_mask(unsigned int mask);
 void *klog_init(int argc, char **argv);
 
+/*-----------------------------------------------------------------------
+ * Asynchronous mode
+ */
+#define KLOG_ASYNC_DROP         0 /* Drop the log when the ring is full */
+#define KLOG_ASYNC_BLOCK        1 /* Wait for the writer when the ring is full */
+
+int klog_async_start(unsigned int ring_size, int policy, unsigned int flush_ms);
+void klog_async_stop(void);
+unsigned long klog_async_dropped(void);
+
+/*
+ * A line longer than 1/4 ring or 16K is cut and ended with
+ * "...(truncated)" in asynchronous mode, count of such lines.
+ */
+unsigned long klog_async_truncated(void);
+
+/*-----------------------------------------------------------------------
+ * Binary mode
+ */
+int klog_bin_start(const char *path);
+void klog_bin_flush(void);
+void klog_bin_stop(void);
+
 void klog_rule_add(char *rule);
 void klog_rule_del(unsigned int idx);
 void klog_rule_clr(void);
@@ -18,9 +18,16 @@ void klog_add_file_logger(const char *pathfmt, unsigned int size,
 		unsigned int time, unsigned int when);
 void klog_del_file_logger(void);
 
+void klog_add_mmap_logger(const char *pathfmt, unsigned int size,
+		unsigned int flush_ms, const char *compress);
+void klog_del_mmap_logger(void);
+
 
 void klog_add_network_logger(const char *addr, unsigned short port);
+void klog_add_network_logger_ex(const char *addr, unsigned short port,
+		int udp, unsigned int bufsize);
 void klog_del_network_logger(void);
+unsigned long klog_network_dropped(void);
 
 #ifdef __cplusplus
 }
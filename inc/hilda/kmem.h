@@ -12,6 +12,9 @@ extern "C" {
 
 #include <hilda/ktypes.h>
 
+/* Small blocks from the per-thread size class caches, see kmem_init */
+#define KMEM_POOL               0x00000001
+
 kint kmem_init(kuint a_flg);
 kint kmem_final(kvoid);
 kint kmem_rpt(kint *alloc_cnt, kint *free_cnt, kint *memusage, kint *mempeak);
@@ -21,6 +24,12 @@ kvoid *kmem_get_z(kuint size);
 kvoid *kmem_reget(kvoid *usrptr, kuint size);
 kvoid kmem_rel(kvoid *usrptr);
 
+/* With call site, for MEM_STAT build, see kmem_stat_dump */
+kvoid *kmem_get_at(kuint size, const char *file, kint line);
+kvoid *kmem_get_z_at(kuint size, const char *file, kint line);
+kvoid *kmem_reget_at(kvoid *usrptr, kuint size, const char *file, kint line);
+kvoid kmem_stat_dump(kint top);
+
 #if 0
 #define kmem_alloc(cnt, type) ({ void *__mem_temp_p = kmem_get((cnt) * sizeof(type)); printf("MEM.A:%d:%s\n", __LINE__, __func__); __mem_temp_p; })
 #define kmem_alloz(cnt, type) ({ void *__mem_temp_p = kmem_get_z((cnt) * sizeof(type)); printf("MEM.A:%d:%s\n", __LINE__, __func__); __mem_temp_p; })
@@ -29,6 +38,14 @@ kvoid kmem_rel(kvoid *usrptr);
 #define kmem_free_s(p) do { if (p) kmem_rel(p); printf("MEM.F:%d:%s\n", __LINE__, __func__); } while (0)
 #define kmem_free_z(p) do { kmem_rel(p); p = knil; printf("MEM.F:%d:%s\n", __LINE__, __func__); } while (0)
 #define kmem_free_sz(p) do { if (p) { kmem_rel(p); p = knil; printf("MEM.F:%d:%s\n", __LINE__, __func__); } } while (0)
+#elif defined(MEM_STAT)
+#define kmem_alloc(cnt, type) kmem_get_at((cnt) * sizeof(type), __FILE__, __LINE__)
+#define kmem_alloz(cnt, type) kmem_get_z_at((cnt) * sizeof(type), __FILE__, __LINE__)
+#define kmem_realloc(p, sz) kmem_reget_at((p), (sz), __FILE__, __LINE__)
+#define kmem_free(p) do { kmem_rel(p); } while (0)
+#define kmem_free_s(p) do { if (p) kmem_rel(p); } while (0)
+#define kmem_free_z(p) do { kmem_rel(p); p = knil; } while (0)
+#define kmem_free_sz(p) do { if (p) { kmem_rel(p); p = knil; } } while (0)
 #else
 #define kmem_alloc(cnt, type) kmem_get((cnt) * sizeof(type))
 #define kmem_alloz(cnt, type) kmem_get_z((cnt) * sizeof(type))
@@ -39,6 +56,45 @@ kvoid kmem_rel(kvoid *usrptr);
 #define kmem_free_sz(p) do { if (p) { kmem_rel(p); p = knil; } } while (0)
 #endif
 
+/*-----------------------------------------------------------------------
+ * Arena, bump allocate and release all at once, e.g.
+ *
+ *   char stk[2048];
+ *   kmem_arena_s ar;
+ *
+ *   kmem_arena_init(&ar, stk, sizeof(stk));
+ *   s = kmem_arena_strdup(&ar, name);
+ *   ...
+ *   kmem_arena_release(&ar);
+ *
+ * kmem_arena_reset frees all but the first block to reuse the arena,
+ * kmem_arena_release also forgets the first block, it is the end.
+ */
+typedef struct _kmem_arena_s kmem_arena_s;
+struct _kmem_arena_s {
+	char *cur, *end;
+
+	/* Blocks from kmem_get, newest first */
+	kvoid *blks;
+
+	/* The first block, may be on stack, not freed by arena */
+	char *buf;
+	kuint size;
+
+	/* Size of the block to add when full */
+	kuint blk_size;
+};
+
+kvoid kmem_arena_init(kmem_arena_s *ar, kvoid *buf, kuint size);
+kvoid kmem_arena_release(kmem_arena_s *ar);
+kmem_arena_s *kmem_arena_new(kuint blk_size);
+kvoid kmem_arena_del(kmem_arena_s *ar);
+
+kvoid *kmem_arena_get(kmem_arena_s *ar, kuint size);
+kvoid *kmem_arena_get_z(kmem_arena_s *ar, kuint size);
+char *kmem_arena_strdup(kmem_arena_s *ar, const char *str);
+kvoid kmem_arena_reset(kmem_arena_s *ar);
+
 kvoid* kmem_move(kvoid *to, kvoid *fr, kuint num);
 void kmem_dump(const char *banner, char *dat, int len, int width);
 
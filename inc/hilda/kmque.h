@@ -11,6 +11,7 @@ extern "C" {
 
 #include <hilda/sdlist.h>
 #include <hilda/xtcool.h>
+#include <hilda/kbuf.h>
 
 typedef struct _mentry_s mentry_s;
 typedef struct _kmque_s kmque_s;
@@ -18,14 +19,39 @@ typedef struct _kmque_s kmque_s;
 typedef void (*ME_WORKER)(void *ua, void *ub);
 typedef void (*ME_DESTORYER)(void *ua, void *ub);
 
+/* worker for mentry_call, the return value is passed back to caller */
+typedef int (*ME_CALLER)(void *ua, void *ub);
+
+/* mentry_s::snd.state */
+#define ME_SND_QUEUED   0 /* in lane qhdr, can be taken back */
+#define ME_SND_RUNNING  1 /* picked by kmque_run */
+#define ME_SND_DONE     2 /* worker returned */
+#define ME_SND_ABORT    3 /* dropped by kmque_set_quit */
+
+/* Priority lanes of kmque_s::lane, smaller is more urgent */
+#define KMQUE_PRIO_HIGH         0 /* latency sensitive control message */
+#define KMQUE_PRIO_NORMAL       1 /* mentry_post and mentry_send */
+#define KMQUE_PRIO_LOW          2 /* bulk work, cfg save, log flush etc */
+#define KMQUE_PRIO_MAX          3
+
+/* kmque_s::sched */
+#define KMQUE_SCHED_STRICT      0 /* always the most urgent lane first */
+#define KMQUE_SCHED_WEIGHTED    1 /* round robin by kmque_lane_s::weight */
+
+/* Buckets of kmque_stat_s histograms, [i] counts usec in [2^(i-1), 2^i) */
+#define KMQUE_HIST_MAX          24
+
 
 struct _mentry_s {
 	/*
-	 * Queue to kmque_s::msg_qhdr or kmque_s::dpc_qhdr for
+	 * Queue to kmque_s::lane[prio].qhdr or kmque_s::dpc_qhdr for
 	 * mentry_delay().
 	 */
 	K_dlist_entry entry;
 
+	/* KMQUE_PRIO_XXX, which lane the entry queued to */
+	int prio;
+
 	/* Delayed Process Call */
 	struct {
 		unsigned int id;
@@ -34,37 +60,90 @@ struct _mentry_s {
 
 	ME_WORKER worker;
 	ME_DESTORYER destoryer;
+	ME_CALLER caller;
 
 	/* Userdata A and B */
 	void *ua, *ub;
 
-	/* emit by mentry_send */
+	/* emit by mentry_send, the entry lives in sender's stack */
 	kbool is_send;
 
+	/* Completion slot for mentry_send and mentry_call */
+	struct {
+		/* Per sender thread, see snd_sem_get() */
+		SPL_HANDLE sem;
+		/* ME_SND_XXX, protected by kmque_s::qhdr_lck */
+		int state;
+		/* return value of caller */
+		int ret;
+	} snd;
+
 	/* pointer back to kmque_s */
 	kmque_s *mque;
+
+	/* usec when queued, 0 if kmque_s::stat not enabled */
+	unsigned long long int queue_time;
+};
+
+typedef struct _kmque_lane_s kmque_lane_s;
+struct _kmque_lane_s {
+	/* Queue HeaDeR for queue message of this priority */
+	K_dlist_entry qhdr;
+
+	/* How many entries in qhdr now */
+	unsigned int depth;
+
+	/* KMQUE_SCHED_WEIGHTED: max picks in a round and what left */
+	unsigned int weight;
+	unsigned int credit;
+};
+
+typedef struct _kmque_stat_s kmque_stat_s;
+struct _kmque_stat_s {
+	/* Nothing recorded if not enabled */
+	int enable;
+
+	/* entries done since enabled */
+	unsigned int done_cnt;
+
+	/* max of all lanes' depth */
+	unsigned int depth_max;
+
+	/* time waiting in queue and time worker runs */
+	unsigned int wait_hist[KMQUE_HIST_MAX];
+	unsigned int run_hist[KMQUE_HIST_MAX];
+
+	/* The slowest worker */
+	unsigned long long int run_max;
+	void *run_max_func;
 };
 
 struct _kmque_s {
-	/* Queue HeaDeR for queue message */
-	K_dlist_entry msg_qhdr;
+	/* Queue message lanes, KMQUE_PRIO_XXX */
+	kmque_lane_s lane[KMQUE_PRIO_MAX];
+
+	/* KMQUE_SCHED_XXX */
+	int sched;
 
 	/* Queue HeaDeR for Delayed Process Call message */
 	K_dlist_entry dpc_qhdr;
 
-	/* Lock for both msg_qhdr and dpc_qhdr */
+	/* Lock for both lane[].qhdr and dpc_qhdr */
 	SPL_HANDLE qhdr_lck;
 
 	/* event when message added */
 	SPL_HANDLE msg_new_sem;
-	/* event when mentry_send() done */
-	SPL_HANDLE msg_snt_sem;
 
 	SPL_HANDLE main_task;
 
 	int quit;
 
 	unsigned int dpc_ref;
+
+	/* diag part */
+	kmque_stat_s stat;
+	/* kmque_diag_add */
+	char *diag_name;
 };
 
 kmque_s *kmque_new();
@@ -72,10 +151,18 @@ int kmque_del(kmque_s *mque);
 
 void kmque_set_quit(kmque_s *mque);
 
+int kmque_set_sched(kmque_s *mque, int sched);
+int kmque_set_weight(kmque_s *mque, int prio, unsigned int weight);
+int kmque_depth(kmque_s *mque, int prio);
+
 int kmque_peek(kmque_s *mque, mentry_s **retme, int timeout);
 int mentry_send(kmque_s *mque, ME_WORKER worker, void *ua, void *ub);
+int mentry_call(kmque_s *mque, ME_CALLER caller, void *ua, void *ub,
+		int *retval, int timeout);
 int mentry_post(kmque_s *mque, ME_WORKER worker, ME_DESTORYER destoryer,
 		void *ua, void *ub);
+int mentry_post_prio(kmque_s *mque, int prio, ME_WORKER worker,
+		ME_DESTORYER destoryer, void *ua, void *ub);
 
 int mentry_dpc_add(kmque_s *mque, void (*worker)(void *ua, void *ub),
 		void (*destoryer)(void *ua, void *ub), void *ua, void *ub,
@@ -84,6 +171,10 @@ int mentry_dpc_kill(kmque_s *mque, unsigned int dpcid);
 
 int kmque_run(kmque_s *mque);
 
+int kmque_stat_enable(kmque_s *mque, int enable);
+void kmque_stat_dump(kmque_s *mque, kbuf_s *kb);
+int kmque_diag_add(kmque_s *mque, const char *name);
+
 #ifdef __cplusplus
 }
 #endif
@@ -81,6 +81,7 @@ struct _knode_s {
 	struct {
 		dstr_node_s *arr;
 		int cnt;
+		int cap;
 	} dstr;
 };
 
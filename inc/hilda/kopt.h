@@ -13,6 +13,7 @@ extern "C" {
 #include <hilda/sdlist.h>
 #include <hilda/kstr.h>
 #include <hilda/kflg.h>
+#include <hilda/kmem.h>
 
 static kinline char *kopt_path(void *oe);
 static kinline char *kopt_desc(void *oe);
@@ -464,6 +465,8 @@ int kopt_setbat(const char *inibuf, int errbrk, int add);
 
 int kopt_getini_by_opt(void *opt, char **ret);
 int kopt_getini(const char *path, char **ret);
+int kopt_getini_by_opt_ex(void *opt, kmem_arena_s *ar, char **ret);
+int kopt_getini_ex(const char *path, kmem_arena_s *ar, char **ret);
 
 /*
  * s => ses, p => pa,pb
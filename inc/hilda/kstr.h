@@ -16,6 +16,7 @@ int kstr_icmp(const char *a_str0, const char *a_str1, int a_len);
 char *kstr_dup(const char *a_str);
 char *kstr_subs(char *a_str, char a_from, char a_to);
 int kstr_escxml(const char *a_is, char **a_os, int *a_ol);
+int kstr_unescxml(const char *a_is, char **a_os, int *a_ol);
 int kstr_toint(const char *s, int *ret);
 
 char *kstr_trim_left(char *str);
@@ -7,10 +7,52 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
 #include <hilda/sysdeps.h>
 
+/*
+ * Streaming MD5, feed the data piece by piece, e.g. header then payload,
+ * no need to put them in one buffer first:
+ *
+ *   md5_ctx_s ctx;
+ *   unsigned char digest[16];
+ *
+ *   md5_init(&ctx);
+ *   md5_update(&ctx, &hdr, sizeof(hdr));
+ *   md5_update(&ctx, dat, len);
+ *   md5_final(&ctx, digest);
+ */
+typedef struct _md5_ctx_s md5_ctx_s;
+struct _md5_ctx_s {
+	unsigned int state[4];
+	unsigned long long count;       /** bytes fed */
+	unsigned char buf[64];
+};
+
+void md5_init(md5_ctx_s *ctx);
+void md5_update(md5_ctx_s *ctx, const void *dat, size_t len);
+void md5_final(md5_ctx_s *ctx, unsigned char digest[16]);
+
+/* 32 lower case hex chars, no tail '\0' */
+void md5_hex(char rethash[32], const unsigned char digest[16]);
+
 void md5_calculate(char rethash[32], const char *dat, int len);
 
+/*
+ * What md5_calculate returned before on 64 bit long platform, it is not
+ * the standard MD5. Only for verify the data hashed by old version.
+ */
+void md5_calculate_legacy(char rethash[32], const char *dat, int len);
+
+/*
+ * Hash cnt independent messages, several messages run in SIMD lanes at
+ * the same time. Same result as md5_init/update/final on each one.
+ */
+#define MD5_MB_LANES    8
+
+void md5_mb(const void *dat[], const size_t len[], unsigned char digest[][16], int cnt);
+
 #ifdef __cplusplus
 }
 #endif
@@ -11,6 +11,7 @@ extern "C" {
 #define kinline
 #define kexport __declspec(dllexport)
 #define VAR_UNUSED
+#define kthread_local __declspec(thread)
 typedef long long int int64_t;
 #endif
 
@@ -18,6 +19,7 @@ typedef long long int int64_t;
 #define kinline inline
 #define kexport
 #define VAR_UNUSED __attribute__ ((unused))
+#define kthread_local __thread
 
 #ifndef likely
 #define likely(x)      __builtin_expect(!!(x), 1)
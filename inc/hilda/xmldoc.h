@@ -35,6 +35,11 @@ typedef struct _KXmlDoc {
 
 	XML_Parser parser;
 	kint parsedOffset;
+
+	/* Only used in xmldoc_parse, character data not set to cur_node yet */
+	kmem_arena_s *tmp;
+	kchar *text;
+	kint text_len, text_cap;
 } KXmlDoc;
 
 #define setVal(a, v) \
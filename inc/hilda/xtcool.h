@@ -97,6 +97,15 @@ void spl_thread_detach(SPL_HANDLE h);
 int spl_thread_kill(SPL_HANDLE h, int signo);
 int spl_thread_destroy(SPL_HANDLE h);
 
+/**
+ * \brief Thread local slot, dtor is called with the value of a thread
+ * when it exits, if the value is not NULL.
+ */
+SPL_HANDLE spl_tls_new(void (*dtor)(void *));
+int spl_tls_del(SPL_HANDLE key);
+int spl_tls_set(SPL_HANDLE key, void *val);
+void *spl_tls_get(SPL_HANDLE key);
+
 /**
  * \brief Process
  */
@@ -124,6 +133,9 @@ void spl_sleep(int ms);
 unsigned long spl_get_ticks();
 unsigned long long int spl_time_get_usec(void);
 
+/* Monotonic, for measure the duration, not changed by wall clock step */
+unsigned long long int spl_time_get_mono_usec(void);
+
 char *spl_get_cmdline(int *size);
 
 char kvfs_path_sep(kvoid);
@@ -0,0 +1,37 @@
+/* vim:set noet ts=8 sw=8 sts=8 ff=unix: */
+
+#ifndef __K_XXH64_H__
+#define __K_XXH64_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#include <hilda/sysdeps.h>
+
+/*
+ * XXH64, fast non cryptographic hash. Four independent lanes of 8 bytes,
+ * so the CPU runs them in parallel. For change detection only, use md5
+ * when a digest must be trusted.
+ */
+typedef struct _xxh64_s xxh64_s;
+struct _xxh64_s {
+	unsigned long long total;
+	unsigned long long seed;
+	unsigned long long v[4];
+	unsigned char mem[32];
+	unsigned int memsize;
+};
+
+void xxh64_init(xxh64_s *st, unsigned long long seed);
+void xxh64_update(xxh64_s *st, const void *dat, size_t len);
+unsigned long long xxh64_digest(const xxh64_s *st);
+
+unsigned long long xxh64(const void *dat, size_t len, unsigned long long seed);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* __K_XXH64_H__ */
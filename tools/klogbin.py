@@ -0,0 +1,217 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+
+# Decode the binary log written by klog_bin_start(), see core/klog.c.
+#
+# USAGE: klogbin.py [-n] binlog-file [out-file]
+#     -n:  no color for the type field
+
+from __future__ import print_function
+
+import sys
+import re
+import struct
+import time
+
+KLOG_RTM = 0x00000100
+KLOG_ATM = 0x00000200
+KLOG_PID = 0x00001000
+KLOG_TID = 0x00002000
+KLOG_PROG = 0x00010000
+KLOG_MODU = 0x00020000
+KLOG_FILE = 0x00040000
+KLOG_FUNC = 0x00080000
+KLOG_LINE = 0x00100000
+
+COLORS = {
+    'F': '31', 'A': '31', 'C': '31', 'E': '31',
+    'W': '33', 'I': '35', 'N': '36', 'D': '36',
+}
+
+SPEC = re.compile(r"%([-+ #0']*)(\*|\d+)?(?:\.(\*|\d*))?(hh|h|ll|l|L|q|j|z|t)?([a-zA-Z%])")
+
+def help():
+    print("USAGE: klogbin.py [-n] binlog-file [out-file]")
+    sys.exit(1)
+
+def cformat(fmt, args):
+    '''Format C printf fmt with the args saved by enc_args()'''
+    out = []
+    pos = 0
+
+    for m in SPEC.finditer(fmt):
+        out.append(fmt[pos:m.start()])
+        pos = m.end()
+
+        flags, width, prec, lm, conv = m.groups()
+        flags = flags.replace("'", "")
+
+        if conv == '%':
+            out.append('%')
+            continue
+        if conv == 'm':
+            out.append('(errno)')
+            continue
+        if conv == 'n':
+            continue
+
+        if width == '*':
+            width = str(args.pop(0)) if args else ''
+        if prec == '*':
+            prec = str(args.pop(0)) if args else ''
+        if not args:
+            out.append(m.group(0))
+            continue
+
+        spec = '%' + flags + (width or '')
+        if prec is not None:
+            spec += '.' + prec
+
+        val = args.pop(0)
+        if conv in 'diu':
+            out.append((spec + 'd') % val)
+        elif conv in 'oxX':
+            if conv != 'o' and lm not in ('l', 'll', 'q', 'j', 'z', 't'):
+                val &= 0xffffffff
+            out.append((spec + conv) % val)
+        elif conv in 'cC':
+            out.append((spec + 'c') % chr(val & 0xff))
+        elif conv in 'eEfFgG':
+            out.append((spec + conv) % val)
+        elif conv in 'aA':
+            out.append((spec + 'e') % val)
+        elif conv in 'sS':
+            out.append((spec + 's') % val)
+        elif conv == 'p':
+            out.append((spec + 's') % ('0x%x' % val if val else '(nil)'))
+        else:
+            out.append(m.group(0))
+
+    out.append(fmt[pos:])
+    return ''.join(out)
+
+def prefix(rec, strs, pid, color):
+    typ, mask, line, usec, tid, prog, modu, file, func = rec
+    s = ''
+
+    if typ:
+        c = chr(typ)
+        if color and c in COLORS:
+            s += '|\033[0;%sm%s\033[0m|' % (COLORS[c], c)
+        else:
+            s += '|%s|' % c
+
+    tick = usec // 1000
+    if mask & KLOG_RTM:
+        s += 's:%d|' % tick
+    if mask & KLOG_ATM:
+        tm = time.strftime('%Y/%m/%d %H:%M:%S', time.localtime(usec // 1000000))
+        s += 'S:%s.%03d|' % (tm, tick % 1000)
+
+    if mask & KLOG_PID:
+        s += 'j:%d|' % pid
+    if mask & KLOG_TID:
+        s += 'x:%x|' % (tid & 0xffffffff)
+
+    if (mask & KLOG_PROG) and prog:
+        s += 'P:%s|' % strs.get(prog, '?')
+    if (mask & KLOG_MODU) and modu:
+        s += 'M:%s|' % strs.get(modu, '?')
+    if (mask & KLOG_FILE) and file:
+        s += 'F:%s|' % strs.get(file, '?')
+    if (mask & KLOG_FUNC) and func:
+        s += 'H:%s|' % strs.get(func, '?')
+    if mask & KLOG_LINE:
+        s += 'L:%d|' % line
+
+    if s:
+        s += ' '
+    return s
+
+def decode_args(body, bo):
+    args = []
+    i = 0
+    while i < len(body):
+        tag = body[i:i + 1]
+        i += 1
+        if tag == b'i':
+            args.append(struct.unpack(bo + 'q', body[i:i + 8])[0])
+            i += 8
+        elif tag in (b'u', b'p'):
+            args.append(struct.unpack(bo + 'Q', body[i:i + 8])[0])
+            i += 8
+        elif tag == b'f':
+            args.append(struct.unpack(bo + 'd', body[i:i + 8])[0])
+            i += 8
+        elif tag == b's':
+            n = struct.unpack(bo + 'I', body[i:i + 4])[0]
+            i += 4
+            args.append(body[i:i + n].decode('utf-8', 'replace'))
+            i += n
+        else:
+            break
+    return args
+
+def decode(fin, fout, color):
+    hdr = fin.read(16)
+    if len(hdr) < 16 or hdr[:8] != b'KLOGBIN1':
+        print('Not a klog binary file', file=sys.stderr)
+        return 1
+
+    bo = '<' if struct.unpack('<I', hdr[8:12])[0] == 0x01020304 else '>'
+    pid = struct.unpack(bo + 'I', hdr[12:16])[0]
+
+    strs = {}
+    fixed = bo + 'BIiQQQQQQQ'
+    fixed_len = struct.calcsize(fixed)
+
+    while True:
+        tag = fin.read(1)
+        if not tag:
+            break
+
+        if tag == b'S':
+            key, n = struct.unpack(bo + 'QI', fin.read(12))
+            strs[key] = fin.read(n).decode('utf-8', 'replace')
+        elif tag == b'L':
+            n = struct.unpack(bo + 'I', fin.read(4))[0]
+            body = fin.read(n)
+            if len(body) < n:
+                break
+
+            f = struct.unpack(fixed, body[:fixed_len])
+            fmt = strs.get(f[9], '(fmt?)')
+            msg = cformat(fmt, decode_args(body[fixed_len:], bo))
+
+            line = prefix(f[:9], strs, pid, color) + msg
+            if not line.endswith('\n'):
+                line += '\n'
+            fout.write(line)
+        else:
+            print('Bad record tag: %r' % tag, file=sys.stderr)
+            return 1
+
+    return 0
+
+def main():
+    args = sys.argv[1:]
+    color = True
+
+    if args and args[0] == '-n':
+        color = False
+        args = args[1:]
+    if not args or len(args) > 2:
+        help()
+
+    fin = open(args[0], 'rb')
+    fout = open(args[1], 'w') if len(args) > 1 else sys.stdout
+
+    ret = decode(fin, fout, color)
+
+    fin.close()
+    if fout is not sys.stdout:
+        fout.close()
+    return ret
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -340,6 +340,36 @@ int spl_thread_destroy(SPL_HANDLE h)
 	return err;
 }
 
+/* pthread_key_t 0 is a valid key, the handle keeps key + 1 */
+SPL_HANDLE spl_tls_new(void (*dtor)(void *))
+{
+	pthread_key_t key;
+
+	if (pthread_key_create(&key, dtor))
+		return NULL;
+	return (SPL_HANDLE)((unsigned long)key + 1);
+}
+int spl_tls_del(SPL_HANDLE key)
+{
+	if (!key)
+		return SPL_EC_HANDLE;
+	return pthread_key_delete((pthread_key_t)((unsigned long)key - 1)) ?
+		SPL_EC_NG : SPL_EC_OK;
+}
+int spl_tls_set(SPL_HANDLE key, void *val)
+{
+	if (!key)
+		return SPL_EC_HANDLE;
+	return pthread_setspecific((pthread_key_t)((unsigned long)key - 1), val) ?
+		SPL_EC_NG : SPL_EC_OK;
+}
+void *spl_tls_get(SPL_HANDLE key)
+{
+	if (!key)
+		return NULL;
+	return pthread_getspecific((pthread_key_t)((unsigned long)key - 1));
+}
+
 /**
  * @brief Create a process and let it run freely
  *
@@ -451,6 +481,13 @@ unsigned long long int spl_time_get_usec(void)
 	return (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
 }
 
+unsigned long long int spl_time_get_mono_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
 /*
  * buf: IN user provided buffer to put the cmdline data. if NULL, a new will allocated.
  * size[INOUT]: IN sizeof buf, OUT bytes of all the cmdline.
@@ -459,26 +496,19 @@ unsigned long long int spl_time_get_usec(void)
  */
 char *spl_get_cmdline(int *size)
 {
-	FILE *fp;
+	kbuf_s kb;
 	char path[256];
 
 	sprintf(path, "/proc/%d/cmdline", getpid());
-	fp = fopen(path, "rt");
-	if (fp) {
-		kbuf_s kb;
-		kbuf_init(&kb, 2048);
-
-		while (kbuf_fread(&kb, 2048, fp, NULL) > 0)
-			;
-		fclose(fp);
-
-		if (size)
-			*size = kb.len;
-		kb.buf[kb.len] = '\0';
-
-		return (char*)kb.buf;
+	kbuf_init(&kb, 2048);
+	if (kbuf_load_file(&kb, path)) {
+		kbuf_release(&kb);
+		return NULL;
 	}
-	return NULL;
+
+	if (size)
+		*size = kb.len;
+	return (char*)kb.buf;
 }
 
 /**
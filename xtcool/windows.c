@@ -347,6 +347,34 @@ int spl_thread_destroy(SPL_HANDLE h)
 	return SPL_EC_OK;
 }
 
+/* Fiber local storage, unlike TLS it calls dtor when the thread exits */
+SPL_HANDLE spl_tls_new(void (*dtor)(void *))
+{
+	DWORD idx = FlsAlloc((PFLS_CALLBACK_FUNCTION)dtor);
+
+	if (idx == FLS_OUT_OF_INDEXES)
+		return NULL;
+	return (SPL_HANDLE)((ULONG_PTR)idx + 1);
+}
+int spl_tls_del(SPL_HANDLE key)
+{
+	if (!key)
+		return SPL_EC_HANDLE;
+	return FlsFree((DWORD)((ULONG_PTR)key - 1)) ? SPL_EC_OK : SPL_EC_NG;
+}
+int spl_tls_set(SPL_HANDLE key, void *val)
+{
+	if (!key)
+		return SPL_EC_HANDLE;
+	return FlsSetValue((DWORD)((ULONG_PTR)key - 1), val) ? SPL_EC_OK : SPL_EC_NG;
+}
+void *spl_tls_get(SPL_HANDLE key)
+{
+	if (!key)
+		return NULL;
+	return FlsGetValue((DWORD)((ULONG_PTR)key - 1));
+}
+
 typedef struct _win_process_p {
 	DWORD ProcessId;
 	HANDLE ProcessHandle;
@@ -538,6 +566,18 @@ unsigned long spl_get_ticks(void)
 	return base_tick + (unsigned long) (1000 * (double) (counter.QuadPart - start.QuadPart) / freq.QuadPart);
 }
 
+unsigned long long int spl_time_get_mono_usec(void)
+{
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER counter;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&counter);
+	return (unsigned long long int)(counter.QuadPart / freq.QuadPart) * 1000000 +
+		(unsigned long long int)(counter.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+
 /**
  * @brief seperator for directory, in *nix it should be '/' in win32s, should be '\\'
  */